@@ -0,0 +1,37 @@
+import argparse
+import subprocess
+import time
+
+parser = argparse.ArgumentParser(description='Benchmark of builtin commands in the shell')
+parser.add_argument('-e', type=str, default='./a.out',
+                    help='executable shell file')
+parser.add_argument('-n', type=int, default=10000,
+                    help='how many commands to run')
+parser.add_argument('--bash', type=str, default='/bin/bash',
+                    help='reference shell')
+args = parser.parse_args()
+
+scenarios = [
+    ('builtin echo', 'echo line {}\n'),
+    ('exec /bin/echo', '/bin/echo line {}\n'),
+    ('builtin && chain', 'true && echo line {} || false\n'),
+]
+
+
+def run(shell, script):
+    start = time.perf_counter()
+    p = subprocess.run([shell], input=script.encode(), stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT)
+    return time.perf_counter() - start, p.stdout
+
+
+print('{} commands per scenario'.format(args.n))
+print('{:<20} {:>12} {:>12} {:>10}'.format('scenario', 'shell, s', 'bash, s', 'ratio'))
+for name, line in scenarios:
+    script = ''.join(line.format(i) for i in range(args.n))
+    shell_time, shell_output = run(args.e, script)
+    bash_time, bash_output = run(args.bash, script)
+    if shell_output != bash_output:
+        print('{}: output differs from {}'.format(name, args.bash))
+    print('{:<20} {:>12.3f} {:>12.3f} {:>10.2f}'.format(
+        name, shell_time, bash_time, shell_time / bash_time))
@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef PARSER_INCLUDED
+#include "parser.c"
+#endif
+
+#ifndef UTILS_INCLUDED
+#include "utils.c"
+#endif
+
+/*
+ * Commands which are executed inside the shell process, without fork() + exec(). 'exit' is not here, because it
+ * needs to tear the whole shell down and is handled by main.c itself.
+ */
+
+typedef struct output_buffer {
+    char *data;
+    int size;
+    int capacity;
+} output_buffer;
+
+output_buffer create_output_buffer() {
+    const int INITIAL_CAPACITY = 256;
+    return (output_buffer) {.data = malloc(sizeof(char) * INITIAL_CAPACITY), .size = 0, .capacity = INITIAL_CAPACITY};
+}
+
+void append_bytes(output_buffer *buffer, const char *bytes, int count) {
+    if (buffer->size + count > buffer->capacity) {
+        while (buffer->size + count > buffer->capacity)
+            buffer->capacity *= 2;
+        buffer->data = realloc(buffer->data, sizeof(char) * buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->size, bytes, count);
+    buffer->size += count;
+}
+
+void append_char(output_buffer *buffer, char ch) {
+    append_bytes(buffer, &ch, 1);
+}
+
+void append_string(output_buffer *buffer, const char *string) {
+    append_bytes(buffer, string, (int) strlen(string));
+}
+
+// Returns false if the output could not be written completely
+bool flush_and_dispose_of_output_buffer(output_buffer *buffer, int output_fd) {
+    bool success = true;
+    int written = 0;
+    while (written < buffer->size) {
+        ssize_t rc = write(output_fd, buffer->data + written, buffer->size - written);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            success = false;
+            break;
+        }
+        written += (int) rc;
+    }
+    free(buffer->data);
+    buffer->data = NULL;
+    return success;
+}
+
+// Appends escape sequence started at string[0] == '\\', returns count of consumed chars. Sets *stop on '\c'
+int append_escape_sequence(output_buffer *buffer, const char *string, bool *stop) {
+    switch (string[1]) {
+        case 'n':
+            append_char(buffer, '\n');
+            return 2;
+        case 't':
+            append_char(buffer, '\t');
+            return 2;
+        case 'r':
+            append_char(buffer, '\r');
+            return 2;
+        case 'a':
+            append_char(buffer, '\a');
+            return 2;
+        case 'b':
+            append_char(buffer, '\b');
+            return 2;
+        case 'f':
+            append_char(buffer, '\f');
+            return 2;
+        case 'v':
+            append_char(buffer, '\v');
+            return 2;
+        case 'e':
+            append_char(buffer, '\033');
+            return 2;
+        case '\\':
+            append_char(buffer, '\\');
+            return 2;
+        case 'c':
+            *stop = true;
+            return 2;
+        case '0': {
+            int value = 0;
+            int consumed = 2;
+            while (consumed < 5 && string[consumed] >= '0' && string[consumed] <= '7')
+                value = value * 8 + (string[consumed++] - '0');
+            append_char(buffer, (char) value);
+            return consumed;
+        }
+        case '\0':
+            append_char(buffer, '\\');
+            return 1;
+        default:
+            append_char(buffer, '\\');
+            append_char(buffer, string[1]);
+            return 2;
+    }
+}
+
+int execute_echo_builtin(const command *cmd, int output_fd) {
+    bool print_newline = true;
+    bool interpret_escapes = false;
+    int argument_ptr = 0;
+    // Like in bash, only arguments consisting of known option letters are options
+    for (; argument_ptr < cmd->argc; ++argument_ptr) {
+        const char *argument = cmd->argv[argument_ptr];
+        if (argument[0] != '-' || argument[1] == '\0' || strspn(argument + 1, "neE") != strlen(argument + 1))
+            break;
+        for (const char *option = argument + 1; *option != '\0'; ++option) {
+            if (*option == 'n')
+                print_newline = false;
+            else
+                interpret_escapes = *option == 'e';
+        }
+    }
+
+    output_buffer output = create_output_buffer();
+    bool stop = false;
+    for (int i = argument_ptr; i < cmd->argc && !stop; ++i) {
+        if (i != argument_ptr)
+            append_char(&output, ' ');
+        if (!interpret_escapes) {
+            append_string(&output, cmd->argv[i]);
+            continue;
+        }
+        for (const char *ptr = cmd->argv[i]; *ptr != '\0' && !stop;) {
+            if (*ptr == '\\')
+                ptr += append_escape_sequence(&output, ptr, &stop);
+            else
+                append_char(&output, *ptr++);
+        }
+    }
+    if (print_newline && !stop)
+        append_char(&output, '\n');
+    return flush_and_dispose_of_output_buffer(&output, output_fd) ? 0 : 1;
+}
+
+int execute_true_builtin(const command *cmd, int output_fd) {
+    (void) cmd;
+    (void) output_fd;
+    return 0;
+}
+
+int execute_false_builtin(const command *cmd, int output_fd) {
+    (void) cmd;
+    (void) output_fd;
+    return 1;
+}
+
+int execute_pwd_builtin(const command *cmd, int output_fd) {
+    (void) cmd;
+    char *directory = getcwd(NULL, 0);
+    if (directory == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    output_buffer output = create_output_buffer();
+    append_string(&output, directory);
+    append_char(&output, '\n');
+    free(directory);
+    return flush_and_dispose_of_output_buffer(&output, output_fd) ? 0 : 1;
+}
+
+int execute_cd_builtin(const command *cmd, int output_fd) {
+    (void) output_fd;
+    const char *directory = cmd->argc == 0 ? getenv("HOME") : cmd->argv[0];
+    if (directory == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (chdir(directory) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", directory, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+const int TEST_TRUE = 0, TEST_FALSE = 1, TEST_ERROR = 2;
+
+int test_result(bool value) {
+    return value ? TEST_TRUE : TEST_FALSE;
+}
+
+bool parse_test_integer(const char *string, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(string, &end, 10);
+    if (end == string || errno != 0)
+        return false;
+    while (*end == ' ' || *end == '\t')
+        end++;
+    return *end == '\0';
+}
+
+int evaluate_unary_test(const char *operator, const char *operand) {
+    struct stat file_stat;
+    switch (operator[1]) {
+        case 'n':
+            return test_result(operand[0] != '\0');
+        case 'z':
+            return test_result(operand[0] == '\0');
+        case 'e':
+            return test_result(stat(operand, &file_stat) == 0);
+        case 'f':
+            return test_result(stat(operand, &file_stat) == 0 && S_ISREG(file_stat.st_mode));
+        case 'd':
+            return test_result(stat(operand, &file_stat) == 0 && S_ISDIR(file_stat.st_mode));
+        case 's':
+            return test_result(stat(operand, &file_stat) == 0 && file_stat.st_size > 0);
+        case 'r':
+            return test_result(access(operand, R_OK) == 0);
+        case 'w':
+            return test_result(access(operand, W_OK) == 0);
+        case 'x':
+            return test_result(access(operand, X_OK) == 0);
+        default:
+            fprintf(stderr, "test: %s: unary operator expected\n", operator);
+            return TEST_ERROR;
+    }
+}
+
+int evaluate_binary_test(const char *left, const char *operator, const char *right) {
+    if (strings_equal((char *) operator, "=") || strings_equal((char *) operator, "=="))
+        return test_result(strings_equal((char *) left, (char *) right));
+    if (strings_equal((char *) operator, "!="))
+        return test_result(!strings_equal((char *) left, (char *) right));
+
+    const char *integer_operators[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int operator_index = NONE;
+    for (int i = 0; i < (int) (sizeof(integer_operators) / sizeof(integer_operators[0])); ++i) {
+        if (strings_equal((char *) operator, (char *) integer_operators[i]))
+            operator_index = i;
+    }
+    if (operator_index == NONE) {
+        fprintf(stderr, "test: %s: binary operator expected\n", operator);
+        return TEST_ERROR;
+    }
+    long long left_value, right_value;
+    if (!parse_test_integer(left, &left_value) || !parse_test_integer(right, &right_value)) {
+        fprintf(stderr, "test: %s: integer expression expected\n",
+                parse_test_integer(left, &left_value) ? right : left);
+        return TEST_ERROR;
+    }
+    switch (operator_index) {
+        case 0:
+            return test_result(left_value == right_value);
+        case 1:
+            return test_result(left_value != right_value);
+        case 2:
+            return test_result(left_value < right_value);
+        case 3:
+            return test_result(left_value <= right_value);
+        case 4:
+            return test_result(left_value > right_value);
+        default:
+            return test_result(left_value >= right_value);
+    }
+}
+
+// Supports POSIX forms of up to 3 arguments with '!' negation, without -a/-o and parentheses
+int evaluate_test(char **argv, int argc) {
+    if (argc > 0 && strings_equal(argv[0], "!") && argc != 3) {
+        int negated = evaluate_test(argv + 1, argc - 1);
+        return negated == TEST_ERROR ? TEST_ERROR : test_result(negated != TEST_TRUE);
+    }
+    switch (argc) {
+        case 0:
+            return TEST_FALSE;
+        case 1:
+            return test_result(argv[0][0] != '\0');
+        case 2:
+            if (argv[0][0] != '-' || argv[0][1] == '\0' || argv[0][2] != '\0') {
+                fprintf(stderr, "test: %s: unary operator expected\n", argv[0]);
+                return TEST_ERROR;
+            }
+            return evaluate_unary_test(argv[0], argv[1]);
+        case 3:
+            if (strings_equal(argv[0], "!")) {
+                int negated = evaluate_test(argv + 1, 2);
+                return negated == TEST_ERROR ? TEST_ERROR : test_result(negated != TEST_TRUE);
+            }
+            return evaluate_binary_test(argv[0], argv[1], argv[2]);
+        default:
+            fprintf(stderr, "test: too many arguments\n");
+            return TEST_ERROR;
+    }
+}
+
+int execute_test_builtin(const command *cmd, int output_fd) {
+    (void) output_fd;
+    int argc = cmd->argc;
+    if (strings_equal(cmd->name, "[")) {
+        if (argc == 0 || !strings_equal(cmd->argv[argc - 1], "]")) {
+            fprintf(stderr, "[: missing `]'\n");
+            return TEST_ERROR;
+        }
+        argc--;
+    }
+    return evaluate_test(cmd->argv, argc);
+}
+
+// Formats one conversion (like "%-5d") for @a argument, returns count of consumed format chars
+int append_printf_conversion(output_buffer *output, const char *format, const char *argument) {
+    int spec_length = 1;
+    while (format[spec_length] != '\0' && strchr("-+ #0", format[spec_length]) != NULL)
+        spec_length++;
+    while (format[spec_length] >= '0' && format[spec_length] <= '9')
+        spec_length++;
+    if (format[spec_length] == '.') {
+        spec_length++;
+        while (format[spec_length] >= '0' && format[spec_length] <= '9')
+            spec_length++;
+    }
+    char conversion = format[spec_length];
+    if (conversion == '\0' || strchr("sdiuxXoceEfgG", conversion) == NULL) {
+        append_bytes(output, format, spec_length);
+        return spec_length;
+    }
+    spec_length++;
+
+    // Room for the flags plus 'll' length modifier
+    char spec[64];
+    if (spec_length + 3 > (int) sizeof(spec)) {
+        append_bytes(output, format, spec_length);
+        return spec_length;
+    }
+    memcpy(spec, format, spec_length - 1);
+    int formatted_length;
+    char small_result[128];
+    char *result = small_result;
+    switch (conversion) {
+        case 's':
+            spec[spec_length - 1] = 's';
+            spec[spec_length] = '\0';
+            formatted_length = snprintf(NULL, 0, spec, argument);
+            result = formatted_length < (int) sizeof(small_result) ? small_result : malloc(formatted_length + 1);
+            snprintf(result, formatted_length + 1, spec, argument);
+            break;
+        case 'c':
+            spec[spec_length - 1] = 'c';
+            spec[spec_length] = '\0';
+            formatted_length = snprintf(small_result, sizeof(small_result), spec, argument[0]);
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'g':
+        case 'G':
+            spec[spec_length - 1] = conversion;
+            spec[spec_length] = '\0';
+            formatted_length = snprintf(small_result, sizeof(small_result), spec, strtod(argument, NULL));
+            break;
+        default:
+            spec[spec_length - 1] = 'l';
+            spec[spec_length] = 'l';
+            spec[spec_length + 1] = conversion;
+            spec[spec_length + 2] = '\0';
+            formatted_length = snprintf(small_result, sizeof(small_result), spec, strtoll(argument, NULL, 0));
+            break;
+    }
+    if (formatted_length >= (int) sizeof(small_result) && result == small_result)
+        formatted_length = sizeof(small_result) - 1;
+    if (formatted_length > 0)
+        append_bytes(output, result, formatted_length);
+    if (result != small_result)
+        free(result);
+    return spec_length;
+}
+
+int execute_printf_builtin(const command *cmd, int output_fd) {
+    if (cmd->argc == 0) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *format = cmd->argv[0];
+    int next_argument = 1;
+    output_buffer output = create_output_buffer();
+    bool stop = false;
+    // The format is reused while there are arguments left, like in bash
+    do {
+        int arguments_before_pass = next_argument;
+        for (const char *ptr = format; *ptr != '\0' && !stop;) {
+            if (*ptr == '\\') {
+                ptr += append_escape_sequence(&output, ptr, &stop);
+            } else if (*ptr == '%' && ptr[1] == '%') {
+                append_char(&output, '%');
+                ptr += 2;
+            } else if (*ptr == '%') {
+                const char *argument = next_argument < cmd->argc ? cmd->argv[next_argument++] : "";
+                ptr += append_printf_conversion(&output, ptr, argument);
+            } else {
+                append_char(&output, *ptr++);
+            }
+        }
+        if (next_argument == arguments_before_pass)
+            break;
+    } while (next_argument < cmd->argc && !stop);
+    return flush_and_dispose_of_output_buffer(&output, output_fd) ? 0 : 1;
+}
+
+typedef int (*builtin_f)(const command *cmd, int output_fd);
+
+typedef struct builtin {
+    const char *name;
+    builtin_f function;
+    // Such a builtin affects the shell itself, so inside a pipeline it runs in a subshell like in bash
+    bool changes_shell_state;
+} builtin;
+
+const builtin BUILTINS[] = {
+        {.name = "cd", .function = execute_cd_builtin, .changes_shell_state = true},
+        {.name = "echo", .function = execute_echo_builtin, .changes_shell_state = false},
+        {.name = "true", .function = execute_true_builtin, .changes_shell_state = false},
+        {.name = "false", .function = execute_false_builtin, .changes_shell_state = false},
+        {.name = "test", .function = execute_test_builtin, .changes_shell_state = false},
+        {.name = "[", .function = execute_test_builtin, .changes_shell_state = false},
+        {.name = "printf", .function = execute_printf_builtin, .changes_shell_state = false},
+        {.name = "pwd", .function = execute_pwd_builtin, .changes_shell_state = false},
+};
+
+const builtin *try_get_builtin(char *name) {
+    for (int i = 0; i < (int) (sizeof(BUILTINS) / sizeof(BUILTINS[0])); ++i) {
+        if (strings_equal(name, (char *) BUILTINS[i].name))
+            return &BUILTINS[i];
+    }
+    return NULL;
+}
+
+// Without a fork the builtin can run only if it does not block a pipe, and does not change the shell from a pipeline
+bool can_run_builtin_in_shell(const builtin *this_builtin, bool input_is_piped, bool output_is_piped) {
+    if (this_builtin == NULL || output_is_piped)
+        return false;
+    return !this_builtin->changes_shell_state || !input_is_piped;
+}
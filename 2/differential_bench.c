@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Differential benchmark of the shell against a reference shell (/bin/bash by default). Every scenario is a script
+ * which is fed to both shells on stdin, each in its own fresh temporary directory. The outputs (stdout and stderr
+ * merged, like checker.py does) and exit codes must match, and the wall times are compared. Every run is timed on its
+ * own, and the table shows the median (p50) and the tail (p99) of the runs of both shells, so a shell which is fast
+ * on the whole but stalls now and then, like on many short commands, is visible too. With less than 100 runs p99
+ * is the slowest run.
+ *
+ * Scenarios are the commands of tests.txt plus synthetic heavy workloads: a big pipe output, many short commands and
+ * long argument lists. Unlike checker.py it does not need an etalon file, so it catches regressions in any command
+ * bash can run, and it shows speedups and slowdowns in numbers.
+ *
+ * Build and run:
+ *
+ *     gcc -Wextra -Werror -Wall -O2 differential_bench.c -o differential_bench
+ *     ./differential_bench -e ./a.out [-b /bin/bash] [-t tests.txt] [-r runs] [-s scale]
+ */
+
+const int NONE = -1;
+
+typedef struct growing_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} growing_buffer;
+
+void append_to_buffer(growing_buffer *buffer, const char *data, size_t size) {
+    if (buffer->size + size + 1 > buffer->capacity) {
+        size_t new_capacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (buffer->size + size + 1 > new_capacity)
+            new_capacity *= 2;
+        buffer->data = realloc(buffer->data, new_capacity);
+        buffer->capacity = new_capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    buffer->data[buffer->size] = '\0';
+}
+
+void append_string_to_buffer(growing_buffer *buffer, const char *string) {
+    append_to_buffer(buffer, string, strlen(string));
+}
+
+void dispose_of_buffer(growing_buffer *buffer) {
+    free(buffer->data);
+    *buffer = (growing_buffer) {.data = NULL, .size = 0, .capacity = 0};
+}
+
+typedef struct scenario {
+    const char *name;
+    growing_buffer script;
+    // What is counted for the throughput: commands or output bytes
+    long long work_units;
+    const char *work_unit_name;
+} scenario;
+
+typedef struct shell_run {
+    double wall_seconds;
+    int exit_code;
+    growing_buffer output;
+} shell_run;
+
+double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+int remove_tree_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+    (void) stat;
+    (void) type;
+    (void) ftw;
+    remove(path);
+    return 0;
+}
+
+/*
+ * Runs the script in an empty @a directory, which is removed afterwards. Both shells get the same directory path,
+ * so commands like 'pwd' print the same. Stdin is the script, stdout and stderr are collected together.
+ */
+shell_run run_shell(const char *shell_path, const growing_buffer *script, const char *directory) {
+    shell_run run = {.exit_code = NONE, .output = {.data = NULL, .size = 0, .capacity = 0}};
+    if (mkdir(directory, 0700) != 0) {
+        perror(directory);
+        exit(1);
+    }
+    // The script goes through a file, so the shell can't be blocked by a full input pipe
+    char script_path[PATH_MAX];
+    snprintf(script_path, sizeof(script_path), "%s.script", directory);
+    int script_fd = open(script_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (script_fd < 0 || write(script_fd, script->data, script->size) != (ssize_t) script->size) {
+        perror(script_path);
+        exit(1);
+    }
+    lseek(script_fd, 0, SEEK_SET);
+
+    int output_pipe[2];
+    if (pipe(output_pipe) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    double start = now_seconds();
+    int pid = fork();
+    if (pid == 0) {
+        dup2(script_fd, STDIN_FILENO);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        dup2(output_pipe[1], STDERR_FILENO);
+        close(script_fd);
+        close(output_pipe[0]);
+        close(output_pipe[1]);
+        if (chdir(directory) != 0)
+            _exit(127);
+        execl(shell_path, shell_path, (char *) NULL);
+        _exit(127);
+    }
+    close(output_pipe[1]);
+    char chunk[64 * 1024];
+    ssize_t read_count;
+    while ((read_count = read(output_pipe[0], chunk, sizeof(chunk))) != 0) {
+        if (read_count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        append_to_buffer(&run.output, chunk, read_count);
+    }
+    close(output_pipe[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    run.wall_seconds = now_seconds() - start;
+    run.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (run.output.data == NULL)
+        append_to_buffer(&run.output, "", 0);
+
+    close(script_fd);
+    unlink(script_path);
+    nftw(directory, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return run;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double left = *(const double *) a, right = *(const double *) b;
+    return left < right ? -1 : left > right;
+}
+
+// Nearest-rank percentile of the sorted times
+double get_percentile(const double *sorted_times, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    return sorted_times[rank > 0 ? rank - 1 : 0];
+}
+
+// Returns true if the outputs are the same
+bool report_scenario(const scenario *this_scenario, const char *shell_path, const char *reference_path, int runs,
+                     const char *directory) {
+    double *shell_times = malloc(sizeof(double) * runs);
+    double *reference_times = malloc(sizeof(double) * runs);
+    bool same = true;
+    char difference[128] = "";
+    for (int i = 0; i < runs; ++i) {
+        shell_run shell = run_shell(shell_path, &this_scenario->script, directory);
+        shell_run reference = run_shell(reference_path, &this_scenario->script, directory);
+        shell_times[i] = shell.wall_seconds;
+        reference_times[i] = reference.wall_seconds;
+        if (same && shell.exit_code != reference.exit_code) {
+            same = false;
+            snprintf(difference, sizeof(difference), "exit code %d, expected %d", shell.exit_code,
+                     reference.exit_code);
+        }
+        if (same && (shell.output.size != reference.output.size ||
+                     memcmp(shell.output.data, reference.output.data, shell.output.size) != 0)) {
+            same = false;
+            size_t position = 0;
+            while (position < shell.output.size && position < reference.output.size &&
+                   shell.output.data[position] == reference.output.data[position])
+                position++;
+            snprintf(difference, sizeof(difference), "output differs at byte %zu (%zu vs %zu bytes)", position,
+                     shell.output.size, reference.output.size);
+        }
+        dispose_of_buffer(&shell.output);
+        dispose_of_buffer(&reference.output);
+    }
+    qsort(shell_times, runs, sizeof(double), compare_doubles);
+    qsort(reference_times, runs, sizeof(double), compare_doubles);
+    double shell_p50 = get_percentile(shell_times, runs, 50);
+    double reference_p50 = get_percentile(reference_times, runs, 50);
+    double shell_p99 = get_percentile(shell_times, runs, 99);
+    double reference_p99 = get_percentile(reference_times, runs, 99);
+
+    printf("%-22s %10.4f %10.4f %8.2fx %10.4f %10.4f %8.2fx %14.0f %14.0f %-10s %s\n", this_scenario->name,
+           shell_p50, reference_p50, shell_p50 / reference_p50, shell_p99, reference_p99,
+           shell_p99 / reference_p99, (double) this_scenario->work_units / shell_p50,
+           (double) this_scenario->work_units / reference_p50, this_scenario->work_unit_name,
+           same ? "same" : "DIFFERENT");
+    if (!same)
+        printf("    %s\n", difference);
+    free(shell_times);
+    free(reference_times);
+    return same;
+}
+
+// A command in tests.txt ends at a newline which is not escaped and not inside quotes, same as in the shell
+size_t get_command_end(const char *text) {
+    bool escaped = false;
+    char quote = '\0';
+    size_t i = 0;
+    for (; text[i] != '\0'; ++i) {
+        char ch = text[i];
+        if (escaped) {
+            escaped = false;
+            continue;
+        }
+        if (ch == '\\') {
+            escaped = true;
+        } else if (quote != '\0') {
+            if (ch == quote)
+                quote = '\0';
+        } else if (ch == '\'' || ch == '"') {
+            quote = ch;
+        } else if (ch == '\n') {
+            break;
+        }
+    }
+    return i;
+}
+
+scenario load_tests_scenario(const char *tests_path) {
+    scenario tests = {.name = "tests.txt", .script = {NULL, 0, 0}, .work_units = 0, .work_unit_name = "commands"};
+    FILE *file = fopen(tests_path, "r");
+    if (file == NULL) {
+        perror(tests_path);
+        exit(1);
+    }
+    growing_buffer text = {NULL, 0, 0};
+    char chunk[4096];
+    size_t read_count;
+    while ((read_count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        append_to_buffer(&text, chunk, read_count);
+    fclose(file);
+    if (text.data == NULL)
+        append_to_buffer(&text, "", 0);
+
+    const char *PROMPT = "$> ";
+    const char *line = text.data;
+    while (*line != '\0') {
+        if (strncmp(line, PROMPT, strlen(PROMPT)) == 0) {
+            const char *command = line + strlen(PROMPT);
+            size_t command_length = get_command_end(command);
+            append_to_buffer(&tests.script, command, command_length);
+            append_string_to_buffer(&tests.script, "\n");
+            tests.work_units++;
+            line = command + command_length;
+        } else {
+            const char *line_end = strchr(line, '\n');
+            line = line_end == NULL ? line + strlen(line) : line_end;
+        }
+        if (*line == '\n')
+            line++;
+    }
+    dispose_of_buffer(&text);
+    return tests;
+}
+
+scenario make_big_pipe_scenario(int scale) {
+    scenario big_pipe = {.name = "big pipe output", .script = {NULL, 0, 0}, .work_unit_name = "bytes"};
+    long long byte_count = 1000000LL * scale;
+    char line[128];
+    snprintf(line, sizeof(line), "head -c %lld /dev/zero | tr '\\0' a | head -c %lld\n", byte_count, byte_count);
+    append_string_to_buffer(&big_pipe.script, line);
+    big_pipe.work_units = byte_count;
+    return big_pipe;
+}
+
+scenario make_many_commands_scenario(const char *name, const char *command, int count) {
+    scenario many = {.name = name, .script = {NULL, 0, 0}, .work_units = count, .work_unit_name = "commands"};
+    for (int i = 0; i < count; ++i) {
+        append_string_to_buffer(&many.script, command);
+        append_string_to_buffer(&many.script, "\n");
+    }
+    return many;
+}
+
+scenario make_long_arguments_scenario(int argument_count) {
+    scenario long_arguments = {.name = "long argument lists", .script = {NULL, 0, 0},
+            .work_units = 2LL * argument_count, .work_unit_name = "arguments"};
+    const char *commands[] = {"echo", "/bin/echo"};
+    for (int i = 0; i < 2; ++i) {
+        append_string_to_buffer(&long_arguments.script, commands[i]);
+        for (int j = 0; j < argument_count; ++j) {
+            char argument[32];
+            snprintf(argument, sizeof(argument), " arg%d", j);
+            append_string_to_buffer(&long_arguments.script, argument);
+        }
+        append_string_to_buffer(&long_arguments.script, " | wc -c\n");
+    }
+    return long_arguments;
+}
+
+int main(int argc, char **argv) {
+    const char *shell_path = "./a.out";
+    const char *reference_path = "/bin/bash";
+    const char *tests_path = "tests.txt";
+    int runs = 3;
+    int scale = 4;
+    int option;
+    while ((option = getopt(argc, argv, "e:b:t:r:s:")) != -1) {
+        switch (option) {
+            case 'e':
+                shell_path = optarg;
+                break;
+            case 'b':
+                reference_path = optarg;
+                break;
+            case 't':
+                tests_path = optarg;
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 's':
+                scale = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e shell] [-b reference shell] [-t tests.txt] [-r runs] [-s scale]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (runs <= 0 || scale <= 0) {
+        fprintf(stderr, "runs and scale must be positive\n");
+        return 2;
+    }
+    // Paths are resolved before the shells are started in temporary directories
+    char *shell_real_path = realpath(shell_path, NULL);
+    char *reference_real_path = realpath(reference_path, NULL);
+    if (shell_real_path == NULL || reference_real_path == NULL) {
+        perror(shell_real_path == NULL ? shell_path : reference_path);
+        return 2;
+    }
+
+    scenario scenarios[] = {
+            load_tests_scenario(tests_path),
+            make_big_pipe_scenario(scale),
+            make_many_commands_scenario("many short builtins", "echo short", 5000 * scale),
+            make_many_commands_scenario("many short execs", "/bin/true", 250 * scale),
+            make_long_arguments_scenario(25000 * scale),
+    };
+    int scenario_count = (int) (sizeof(scenarios) / sizeof(scenarios[0]));
+
+    char root_directory[] = "/tmp/differential_bench_XXXXXX";
+    if (mkdtemp(root_directory) == NULL) {
+        perror("mkdtemp");
+        return 2;
+    }
+    char work_directory[sizeof(root_directory) + 16];
+    snprintf(work_directory, sizeof(work_directory), "%s/work", root_directory);
+
+    printf("%s vs %s, p50 and p99 of %d runs, rates of p50\n", shell_real_path, reference_real_path, runs);
+    printf("%-22s %10s %10s %9s %10s %10s %9s %14s %14s %-10s %s\n", "scenario", "shell p50", "ref p50", "ratio",
+           "shell p99", "ref p99", "ratio", "shell rate", "ref rate", "rate unit", "output");
+    int different_count = 0;
+    for (int i = 0; i < scenario_count; ++i) {
+        if (!report_scenario(&scenarios[i], shell_real_path, reference_real_path, runs, work_directory))
+            different_count++;
+        dispose_of_buffer(&scenarios[i].script);
+    }
+    rmdir(root_directory);
+    free(shell_real_path);
+    free(reference_real_path);
+    if (different_count != 0) {
+        printf("%d scenario(s) differ from the reference shell\n", different_count);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <errno.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "trace.c"
+
+#ifndef UTILS_INCLUDED
+#include "utils.c"
+#endif
+
+/*
+ * Children are tracked in a hash table keyed by pid (open addressing, linear probing). SIGCHLD is blocked and
+ * consumed through a signalfd, so any child is reaped as soon as the shell looks at the table, in any order, and
+ * finding its job costs O(1). Reaping goes through wait4() to get the child's rusage for the trace.
+ */
+
+typedef enum job_kind {
+    FOREGROUND_JOB,
+    BACKGROUND_JOB
+} job_kind;
+
+typedef struct job {
+    // NONE for an empty slot
+    int pid;
+    job_kind kind;
+    // Status of the job is needed by the shell, so the slot outlives the process
+    bool keep_status;
+    bool finished;
+    int status;
+    // For the trace
+    long long started_ns;
+    int line_number;
+    int stage;
+} job;
+
+typedef struct job_table {
+    job *jobs;
+    // Always a power of two
+    int capacity;
+    int job_count;
+    int running_foreground_count;
+    int running_background_count;
+    int signal_fd;
+    // Can be NULL
+    shell_trace *trace;
+} job_table;
+
+const int JOB_TABLE_INITIAL_CAPACITY = 16;
+
+int open_child_signal_fd() {
+    sigset_t child_signal;
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, NULL);
+    return signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+job *allocate_empty_jobs(int capacity) {
+    job *jobs = malloc(sizeof(job) * capacity);
+    for (int i = 0; i < capacity; ++i)
+        jobs[i].pid = NONE;
+    return jobs;
+}
+
+job_table create_job_table(shell_trace *trace) {
+    return (job_table) {
+            .jobs = allocate_empty_jobs(JOB_TABLE_INITIAL_CAPACITY),
+            .capacity = JOB_TABLE_INITIAL_CAPACITY,
+            .job_count = 0,
+            .running_foreground_count = 0,
+            .running_background_count = 0,
+            .signal_fd = open_child_signal_fd(),
+            .trace = trace
+    };
+}
+
+void dispose_of_job_table(job_table *table) {
+    free(table->jobs);
+    table->jobs = NULL;
+    close(table->signal_fd);
+    table->signal_fd = NONE;
+}
+
+int get_job_home_slot(const job_table *table, int pid) {
+    // Fibonacci hashing spreads consecutive pids over the table
+    return (int) (((unsigned int) pid * 2654435769u) & (unsigned int) (table->capacity - 1));
+}
+
+int try_find_job_slot(const job_table *table, int pid) {
+    for (int slot = get_job_home_slot(table, pid);; slot = (slot + 1) & (table->capacity - 1)) {
+        if (table->jobs[slot].pid == NONE)
+            return NONE;
+        if (table->jobs[slot].pid == pid)
+            return slot;
+    }
+}
+
+void insert_job_without_growth(job_table *table, job new_job) {
+    int slot = get_job_home_slot(table, new_job.pid);
+    while (table->jobs[slot].pid != NONE)
+        slot = (slot + 1) & (table->capacity - 1);
+    table->jobs[slot] = new_job;
+    table->job_count++;
+}
+
+void grow_job_table(job_table *table) {
+    job *old_jobs = table->jobs;
+    int old_capacity = table->capacity;
+    table->capacity *= 2;
+    table->jobs = allocate_empty_jobs(table->capacity);
+    table->job_count = 0;
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_jobs[i].pid != NONE)
+            insert_job_without_growth(table, old_jobs[i]);
+    }
+    free(old_jobs);
+}
+
+// Backward shift deletion keeps probe chains intact without tombstones
+void remove_job_slot(job_table *table, int slot) {
+    int mask = table->capacity - 1;
+    int hole = slot;
+    for (int next = (hole + 1) & mask; table->jobs[next].pid != NONE; next = (next + 1) & mask) {
+        int home = get_job_home_slot(table, table->jobs[next].pid);
+        bool home_is_cyclically_in_hole_next_range = hole <= next ? (hole < home && home <= next)
+                                                                  : (hole < home || home <= next);
+        if (home_is_cyclically_in_hole_next_range)
+            continue;
+        table->jobs[hole] = table->jobs[next];
+        hole = next;
+    }
+    table->jobs[hole].pid = NONE;
+    table->job_count--;
+}
+
+void add_job(job_table *table, int pid, job_kind kind, int stage) {
+    // Keep load factor under 1/2
+    if ((table->job_count + 1) * 2 > table->capacity)
+        grow_job_table(table);
+    insert_job_without_growth(table, (job) {
+            .pid = pid,
+            .kind = kind,
+            .keep_status = kind == FOREGROUND_JOB,
+            .finished = false,
+            .status = 0,
+            .started_ns = now_ns(),
+            .line_number = table->trace != NULL ? table->trace->line_number : 0,
+            .stage = stage
+    });
+    if (kind == FOREGROUND_JOB)
+        table->running_foreground_count++;
+    else
+        table->running_background_count++;
+}
+
+void register_exited_child(job_table *table, int pid, int status, const struct rusage *usage) {
+    int slot = try_find_job_slot(table, pid);
+    if (slot == NONE)
+        return;
+    job *exited_job = &table->jobs[slot];
+    trace_child_exit(table->trace, pid, exited_job->line_number, exited_job->stage, exited_job->started_ns, status,
+                     usage);
+    if (exited_job->kind == BACKGROUND_JOB) {
+        table->running_background_count--;
+        remove_job_slot(table, slot);
+        return;
+    }
+    table->running_foreground_count--;
+    if (!exited_job->keep_status) {
+        remove_job_slot(table, slot);
+        return;
+    }
+    exited_job->finished = true;
+    exited_job->status = status;
+}
+
+void reap_exited_children(job_table *table) {
+    struct signalfd_siginfo info;
+    do {
+        count_syscall(table->trace, TRACED_READ);
+    } while (read(table->signal_fd, &info, sizeof(info)) == sizeof(info));
+
+    int status;
+    int pid;
+    struct rusage usage;
+    do {
+        count_syscall(table->trace, TRACED_WAIT4);
+        pid = wait4(-1, &status, WNOHANG, &usage);
+        if (pid > 0)
+            register_exited_child(table, pid, status, &usage);
+    } while (pid > 0);
+}
+
+// To be used as line_reader's side fd callback
+void reap_exited_children_callback(void *table) {
+    reap_exited_children((job_table *) table);
+}
+
+void wait_for_child_signal(job_table *table) {
+    struct pollfd signal_poll = {.fd = table->signal_fd, .events = POLLIN};
+    do {
+        count_syscall(table->trace, TRACED_POLL);
+    } while (poll(&signal_poll, 1, -1) < 0 && errno == EINTR);
+}
+
+// The shell is no longer interested in the job's status, so it is dropped right when the job exits
+void release_job(job_table *table, int pid) {
+    int slot = try_find_job_slot(table, pid);
+    if (slot == NONE || table->jobs[slot].kind != FOREGROUND_JOB)
+        return;
+    if (table->jobs[slot].finished)
+        remove_job_slot(table, slot);
+    else
+        table->jobs[slot].keep_status = false;
+}
+
+bool job_is_tracked(const job_table *table, int pid) {
+    return try_find_job_slot(table, pid) != NONE;
+}
+
+// Returns waitpid()-like status of a foreground job and forgets it
+int wait_for_job(job_table *table, int pid) {
+    reap_exited_children(table);
+    int slot;
+    while ((slot = try_find_job_slot(table, pid)) != NONE && !table->jobs[slot].finished) {
+        wait_for_child_signal(table);
+        reap_exited_children(table);
+    }
+    if (slot == NONE)
+        return 0;
+    int status = table->jobs[slot].status;
+    remove_job_slot(table, slot);
+    return status;
+}
+
+void wait_for_foreground_jobs(job_table *table) {
+    reap_exited_children(table);
+    while (table->running_foreground_count > 0) {
+        wait_for_child_signal(table);
+        reap_exited_children(table);
+    }
+}
+
+void wait_for_background_job_slot(job_table *table, int max_background_jobs) {
+    reap_exited_children(table);
+    if (max_background_jobs == NONE)
+        return;
+    while (table->running_background_count >= max_background_jobs) {
+        wait_for_child_signal(table);
+        reap_exited_children(table);
+    }
+}
+
+// A subshell has none of the parent's children and needs a signalfd of its own
+void reset_job_table_in_subshell(job_table *table) {
+    for (int i = 0; i < table->capacity; ++i)
+        table->jobs[i].pid = NONE;
+    table->job_count = 0;
+    table->running_foreground_count = 0;
+    table->running_background_count = 0;
+    close(table->signal_fd);
+    table->signal_fd = open_child_signal_fd();
+}
+
+// Exec keeps the signal mask, so a command would start with SIGCHLD blocked otherwise
+void prepare_job_table_for_exec() {
+    sigset_t child_signal;
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &child_signal, NULL);
+}
+
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    return 0;
+}
@@ -1,8 +1,11 @@
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <sys/wait.h>
 #include "parser.c"
+#include "builtins.c"
+#include "jobs.c"
 
 
 #ifndef UTILS_INCLUDED
@@ -10,27 +13,6 @@
 #endif
 
 
-typedef struct pid_list {
-    int pid;
-    struct pid_list *other_pids;
-} pid_list;
-
-void dispose_of_pid_list(pid_list *list) {
-    pid_list *ptr = list;
-    while (ptr != NULL) {
-        pid_list *next = ptr->other_pids;
-        free(ptr);
-        ptr = next;
-    }
-}
-
-pid_list *add_pid(pid_list *list, int new_pid) {
-    pid_list *answer = malloc(sizeof(pid_list));
-    *answer = (pid_list) {.other_pids = list, .pid = new_pid};
-    return answer;
-}
-
-
 int execute_command(command_array *commands, command *this_command) {
     char **arguments_with_filename = malloc(sizeof(char *) * (2 + (*this_command).argc));
     arguments_with_filename[0] = strdup((*this_command).name);
@@ -51,17 +33,6 @@ int execute_command(command_array *commands, command *this_command) {
     exit(errno);
 }
 
-int execute_chdir_command(command command) {
-    int last_child_exit_code;
-    if (command.argc == 0) {
-        last_child_exit_code = chdir("~");
-    } else {
-        last_child_exit_code = chdir(command.argv[0]);
-    }
-    return last_child_exit_code;
-}
-
-
 int get_command_count_before_redirection(command_array *commands) {
     int command_count_without_redirection;
     if ((*commands).command_count <= 1) {
@@ -78,6 +49,17 @@ int get_command_count_before_redirection(command_array *commands) {
 }
 
 
+int open_redirection_file(command_array *commands, int logical_command_count) {
+    bool overwrite_file = strings_equal(commands->commands[logical_command_count - 2].name, ">");
+    char *file_to_write = commands->commands[logical_command_count - 1].name;
+    int file_descriptor = open(file_to_write, O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite_file ? O_TRUNC : O_APPEND),
+                               0644);
+    if (file_descriptor < 0)
+        perror(file_to_write);
+    return file_descriptor;
+}
+
+
 void execute_exit_command(command_array *commands, command first_command) {
     int exit_code = 0;
     if (first_command.argc != 0) {
@@ -87,14 +69,65 @@ void execute_exit_command(command_array *commands, command first_command) {
     exit(exit_code);
 }
 
-int main() {
+typedef struct shell_options {
+    // NULL means that the commands come from stdin
+    char *script_path;
+    // How many '&' lines can run at once, NONE for no limit
+    int max_background_jobs;
+} shell_options;
+
+shell_options parse_shell_options(int argc, char **argv) {
+    shell_options options = {.script_path = NULL, .max_background_jobs = NONE};
+    int option;
+    while ((option = getopt(argc, argv, "f:j:")) != -1) {
+        switch (option) {
+            case 'f':
+                options.script_path = optarg;
+                break;
+            case 'j':
+                options.max_background_jobs = atoi(optarg);
+                if (options.max_background_jobs <= 0) {
+                    fprintf(stderr, "%s: -j expects a positive job count\n", argv[0]);
+                    exit(2);
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f script] [-j max_background_jobs]\n", argv[0]);
+                exit(2);
+        }
+    }
+    // Like bash, a single positional argument is a script
+    if (options.script_path == NULL && optind < argc)
+        options.script_path = argv[optind];
+    return options;
+}
+
+int main(int argc, char **argv) {
+    shell_options options = parse_shell_options(argc, argv);
+    int input_fd = STDIN_FILENO;
+    if (options.script_path != NULL) {
+        input_fd = open(options.script_path, O_RDONLY | O_CLOEXEC);
+        if (input_fd < 0) {
+            perror(options.script_path);
+            return 127;
+        }
+    }
+    // Batch mode (a script or a non-TTY stdin) is read in big chunks, a TTY anyway returns one line per read
+    line_reader reader = open_line_reader(input_fd, SCRIPT_READ_BUFFER_SIZE);
+    shell_trace trace = create_shell_trace();
+    job_table jobs = create_job_table(&trace);
+    // Background jobs are reaped even while the shell waits for the next line
+    watch_side_fd(&reader, jobs.signal_fd, reap_exited_children_callback, &jobs);
+
     bool last_line_ended_with_EOF = false;
     int last_child_exit_code = 0;
     while (!last_line_ended_with_EOF) {
-        reader_output read_data = read_stdin_line();
+        reader_output read_data = read_line(&reader);
         last_line_ended_with_EOF = read_data.ended_with_EOF;
+        trace_line_start(&trace);
         command_array commands = parse(read_data.line);
         free(read_data.line);
+        trace_line_parsed(&trace, commands.command_count);
 
         int logical_command_count = commands.command_count;
         if (logical_command_count == 0) {
@@ -103,24 +136,32 @@ int main() {
         }
 
         int last_child_pid = NONE;
-        pid_list *children_to_wait_for = NULL;
 
         command first_command = commands.commands[0];
         if (logical_command_count == 1 && strings_equal(first_command.name, "exit")) {
             execute_exit_command(&commands, first_command);
-        } else if (logical_command_count == 1 && strings_equal(first_command.name, "cd")) {
-            last_child_exit_code = execute_chdir_command(first_command);
         } else {
             if (strings_equal("&", commands.commands[logical_command_count - 1].name)) {
+                wait_for_background_job_slot(&jobs, options.max_background_jobs);
                 // Subshell will be executing this command set
                 const int FORK_CHILD = 0;
+                long long fork_start_ns = now_ns();
+                count_syscall(&trace, TRACED_FORK);
                 if ((last_child_pid = fork()) == FORK_CHILD) {
                     // child will finish this command set
                     logical_command_count -= 1;
-                    fclose(stdin);
+                    abandon_line_reader(&reader);
+                    watch_side_fd(&reader, NONE, NULL, NULL);
+                    close(STDIN_FILENO);
+                    reset_job_table_in_subshell(&jobs);
+                    last_child_pid = NONE;
 
                 } else {
                     // we will proceed
+                    if (last_child_pid > 0) {
+                        add_job(&jobs, last_child_pid, BACKGROUND_JOB, NONE);
+                        trace_fork(&trace, NONE, "&", last_child_pid, fork_start_ns);
+                    }
                     dispose_of_commands(commands);
                     continue;
                 }
@@ -129,6 +170,8 @@ int main() {
 
             int command_array_ptr = 0;
             int last_pipe_end = NONE;
+            // Position of the command in its pipeline, for the trace. The operators don't count.
+            int pipeline_stage = 0;
 
             // NOTE: currently only support one redirect and exactly at the end of command chain
             int command_count_without_redirection = get_command_count_before_redirection(&commands);
@@ -144,22 +187,17 @@ int main() {
 
                 if (last_operator != NULL && !strings_equal(last_operator, "|")) {
                     // OR or AND
+                    pipeline_stage = 0;
                     if (last_pipe_end != NONE) {
-                        int status;
                         int single_byte;
-                        while (read(last_pipe_end, &single_byte, 1) > 0) {
+                        while (count_syscall(&trace, TRACED_READ), read(last_pipe_end, &single_byte, 1) > 0) {
+                            count_syscall(&trace, TRACED_WRITE);
                             write(STDOUT_FILENO, &single_byte, 1);
                         }
                         close(last_pipe_end);  // Close the read end of the pipe
                         last_pipe_end = NONE;
 
-                        waitpid(last_child_pid, &status, 0);
-                        if (WIFEXITED(status)) {
-                            int es = WEXITSTATUS(status);
-                            last_child_exit_code = es;
-                        } else {
-                            last_child_exit_code = 0;
-                        }
+                        last_child_exit_code = status_to_exit_code(wait_for_job(&jobs, last_child_pid));
                     }
                     if (strings_equal(last_operator, "||")) {
                         if (!last_child_exit_code) {
@@ -183,10 +221,52 @@ int main() {
                     continue;
                 }
 
+                command this_command = commands.commands[command_array_ptr];
+                bool is_last_command = command_array_ptr == logical_command_count - 1;
+                bool is_redirected_command = !is_last_command && command_array_ptr == command_count_without_redirection - 1;
+                bool output_is_piped = !is_last_command && !is_redirected_command &&
+                                       strings_equal(commands.commands[command_array_ptr + 1].name, "|");
+                const builtin *this_builtin = try_get_builtin(this_command.name);
+                if (can_run_builtin_in_shell(this_builtin, last_pipe_end != NONE, output_is_piped)) {
+                    // Builtins don't read stdin, so the previous pipeline stage simply gets its pipe closed
+                    if (last_pipe_end != NONE) {
+                        close(last_pipe_end);
+                        last_pipe_end = NONE;
+                    }
+                    if (last_child_pid != NONE) {
+                        release_job(&jobs, last_child_pid);
+                        last_child_pid = NONE;
+                    }
+                    int output_fd = is_redirected_command ? open_redirection_file(&commands, logical_command_count)
+                                                          : STDOUT_FILENO;
+                    if (output_fd < 0) {
+                        last_child_exit_code = 1;
+                    } else {
+                        long long builtin_start_ns = now_ns();
+                        last_child_exit_code = this_builtin->function(&this_command, output_fd);
+                        trace_builtin(&trace, pipeline_stage, this_command.name, builtin_start_ns,
+                                      last_child_exit_code);
+                        if (output_fd != STDOUT_FILENO)
+                            close(output_fd);
+                    }
+                    if (is_last_command || is_redirected_command)
+                        break;
+                    last_operator = NULL;
+                    command_array_ptr++;
+                    pipeline_stage++;
+                    continue;
+                }
+
                 int fd[2];
+                count_syscall(&trace, TRACED_PIPE);
                 pipe(fd);
                 const int FORK_CHILD = 0;
 
+                // Only the status of the last started child is interesting
+                if (last_child_pid != NONE)
+                    release_job(&jobs, last_child_pid);
+                long long fork_start_ns = now_ns();
+                count_syscall(&trace, TRACED_FORK);
                 if ((last_child_pid = fork()) == FORK_CHILD) {
                     if (last_pipe_end != NONE) {
                         // Take the last cmd's output as STDIN
@@ -198,38 +278,48 @@ int main() {
                     dup2(fd[1], 1);
                     close(fd[1]);  // Close the duplicated write end of the pipe
                     close(fd[0]);  // Close the unused read end of the pipe
-                    command this_command = commands.commands[command_array_ptr];
-                    dispose_of_pid_list(children_to_wait_for);
-                    children_to_wait_for = NULL;
+                    dispose_of_job_table(&jobs);
+                    dispose_of_line_reader(&reader);
+                    prepare_job_table_for_exec();
                     if (strings_equal(this_command.name, "exit")) {
                         execute_exit_command(&commands, this_command);
                     }
+                    if (this_builtin != NULL) {
+                        // Still no exec needed
+                        int exit_code = this_builtin->function(&this_command, STDOUT_FILENO);
+                        dispose_of_commands(commands);
+                        exit(exit_code);
+                    }
+                    trace_exec(&trace, pipeline_stage, this_command.name);
                     return execute_command(&commands,&this_command); // Leads to execvp
                 } else // PARENT
                 {
-                    children_to_wait_for = add_pid(children_to_wait_for, last_child_pid);
+                    add_job(&jobs, last_child_pid, FOREGROUND_JOB, pipeline_stage);
+                    trace_fork(&trace, pipeline_stage, this_command.name, last_child_pid, fork_start_ns);
 
                     close(fd[1]);  // Close the unused write end of the pipe
                     if (command_array_ptr == logical_command_count - 1) {
                         // Last command, so we manually output to STDOUT
                         int single_byte;
-                        while (read(fd[0], &single_byte, 1) > 0) {
+                        while (count_syscall(&trace, TRACED_READ), read(fd[0], &single_byte, 1) > 0) {
+                            count_syscall(&trace, TRACED_WRITE);
                             write(STDOUT_FILENO, &single_byte, 1);
                         }
                         close(fd[0]);  // Close the read end of the pipe
                         break;
                     } else if (command_array_ptr == command_count_without_redirection - 1) {
                         // The child was the last subcommand, so we just output to the file as the redirection says
-                        bool overwrite_file = strings_equal(commands.commands[logical_command_count - 2].name, ">");
-                        char *file_to_write = commands.commands[logical_command_count - 1].name;
-                        FILE *file = fopen(file_to_write, overwrite_file ? "w" : "a");
-                        int file_descriptor = fileno(file);
+                        int file_descriptor = open_redirection_file(&commands, logical_command_count);
 
                         int single_byte;
-                        while (read(fd[0], &single_byte, 1) > 0) {
-                            write(file_descriptor, &single_byte, 1);
+                        while (count_syscall(&trace, TRACED_READ), read(fd[0], &single_byte, 1) > 0) {
+                            if (file_descriptor >= 0) {
+                                count_syscall(&trace, TRACED_WRITE);
+                                write(file_descriptor, &single_byte, 1);
+                            }
                         }
-                        fclose(file);
+                        if (file_descriptor >= 0)
+                            close(file_descriptor);
                         close(fd[0]);  // Close the read end of the pipe
                         break;
                     }
@@ -241,33 +331,24 @@ int main() {
                 last_operator = NULL;
                 last_pipe_end = fd[0];
                 command_array_ptr++;
+                pipeline_stage++;
             }
             if (last_pipe_end != NONE) {
                 close(last_pipe_end);
             }
         }
 
-        // Wait for children to terminate
-        int status = 0;
-        pid_list *ptr = children_to_wait_for;
-        while (ptr != NULL) {
-            int pid_to_wait_this_turn = ptr->pid;
-
-            waitpid(pid_to_wait_this_turn, &status, 0);
-            if (pid_to_wait_this_turn == last_child_pid) {
-                if (WIFEXITED(status)) {
-                    int es = WEXITSTATUS(status);
-                    last_child_exit_code = es;
-                } else {
-                    last_child_exit_code = 0;
-                }
-            }
-            ptr = ptr->other_pids;
-        }
-        dispose_of_pid_list(children_to_wait_for);
+        // Children are reaped in the order they exit, only the last one's status matters
+        wait_for_foreground_jobs(&jobs);
+        if (last_child_pid != NONE && job_is_tracked(&jobs, last_child_pid))
+            last_child_exit_code = status_to_exit_code(wait_for_job(&jobs, last_child_pid));
+        trace_line_done(&trace, last_child_exit_code);
 
         dispose_of_commands(commands);
 
     }
+    dispose_of_job_table(&jobs);
+    dispose_of_shell_trace(&trace);
+    dispose_of_line_reader(&reader);
     return last_child_exit_code;
 }
@@ -1,3 +1,4 @@
+#define PARSER_INCLUDED
 
 #include <malloc.h>
 #include <string.h>
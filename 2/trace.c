@@ -0,0 +1,219 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef UTILS_INCLUDED
+#include "utils.c"
+#endif
+
+/*
+ * Opt-in tracing of where the launch latency goes. With SHELL_TRACE=<fd> (or SHELL_TRACE=<path>) the shell writes
+ * one JSON object per line of trace: parse time of each input line, fork/exec/exit timestamps of each pipeline
+ * stage, wall time and rusage of every child (collected via wait4()), and counts of the syscalls the shell itself
+ * made for the line. Each event is a single write(), so the events of subshells don't interleave mid-line.
+ */
+
+typedef enum traced_syscall {
+    TRACED_FORK,
+    TRACED_PIPE,
+    TRACED_WAIT4,
+    TRACED_READ,
+    TRACED_WRITE,
+    TRACED_POLL,
+    TRACED_SYSCALL_COUNT
+} traced_syscall;
+
+const char *TRACED_SYSCALL_NAMES[] = {"fork", "pipe", "wait4", "read", "write", "poll"};
+
+typedef struct shell_trace {
+    // NONE when tracing is off
+    int fd;
+    // SHELL_TRACE=<path> is opened by the shell, SHELL_TRACE=<fd> belongs to the caller
+    bool owns_fd;
+    int line_number;
+    long long line_start_ns;
+    long syscall_counts[TRACED_SYSCALL_COUNT];
+} shell_trace;
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+shell_trace create_shell_trace() {
+    shell_trace trace = {.fd = NONE, .owns_fd = false, .line_number = 0, .line_start_ns = 0};
+    memset(trace.syscall_counts, 0, sizeof(trace.syscall_counts));
+    const char *destination = getenv("SHELL_TRACE");
+    if (destination == NULL || destination[0] == '\0')
+        return trace;
+
+    char *end;
+    long fd = strtol(destination, &end, 10);
+    if (*end == '\0' && fd >= 0) {
+        trace.fd = (int) fd;
+        // Commands executed by the shell should not inherit the trace
+        fcntl(trace.fd, F_SETFD, FD_CLOEXEC);
+    } else {
+        trace.fd = open(destination, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        trace.owns_fd = trace.fd >= 0;
+        if (trace.fd < 0)
+            perror(destination);
+    }
+    return trace;
+}
+
+void dispose_of_shell_trace(shell_trace *trace) {
+    if (trace->owns_fd)
+        close(trace->fd);
+    trace->fd = NONE;
+    trace->owns_fd = false;
+}
+
+bool trace_is_enabled(const shell_trace *trace) {
+    return trace != NULL && trace->fd != NONE;
+}
+
+void count_syscall(shell_trace *trace, traced_syscall syscall_kind) {
+    if (trace != NULL)
+        trace->syscall_counts[syscall_kind]++;
+}
+
+typedef struct trace_event {
+    char data[1024];
+    int size;
+} trace_event;
+
+void append_trace_format(trace_event *event, const char *format, ...) {
+    int space_left = (int) sizeof(event->data) - event->size;
+    if (space_left <= 0)
+        return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(event->data + event->size, space_left, format, args);
+    va_end(args);
+    event->size += written < space_left ? written : space_left - 1;
+}
+
+// Command names are user input, so they are escaped and clipped to keep the event a single short line
+void append_trace_string(trace_event *event, const char *key, const char *value) {
+    const int MAX_VALUE_LENGTH = 256;
+    append_trace_format(event, ",\"%s\":\"", key);
+    for (int i = 0; value[i] != '\0' && i < MAX_VALUE_LENGTH; ++i) {
+        unsigned char ch = (unsigned char) value[i];
+        if (ch == '"' || ch == '\\')
+            append_trace_format(event, "\\%c", ch);
+        else if (ch < 0x20)
+            append_trace_format(event, "\\u%04x", ch);
+        else
+            append_trace_format(event, "%c", ch);
+    }
+    append_trace_format(event, "\"");
+}
+
+trace_event start_trace_event(const shell_trace *trace, const char *event_name) {
+    trace_event event = {.size = 0};
+    append_trace_format(&event, "{\"event\":\"%s\",\"t_ns\":%lld,\"shell_pid\":%d,\"line\":%d", event_name, now_ns(),
+                        (int) getpid(), trace->line_number);
+    return event;
+}
+
+void emit_trace_event(shell_trace *trace, trace_event *event) {
+    // Leave room for the closing brace and the newline even if the event was clipped
+    if (event->size > (int) sizeof(event->data) - 3)
+        event->size = (int) sizeof(event->data) - 3;
+    event->data[event->size++] = '}';
+    event->data[event->size++] = '\n';
+    int written = 0;
+    while (written < event->size) {
+        ssize_t rc = write(trace->fd, event->data + written, event->size - written);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return;
+        written += (int) rc;
+    }
+}
+
+void trace_line_start(shell_trace *trace) {
+    trace->line_number++;
+    trace->line_start_ns = now_ns();
+    memset(trace->syscall_counts, 0, sizeof(trace->syscall_counts));
+}
+
+void trace_line_parsed(shell_trace *trace, int command_count) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "parse");
+    append_trace_format(&event, ",\"parse_ns\":%lld,\"commands\":%d", now_ns() - trace->line_start_ns,
+                        command_count);
+    emit_trace_event(trace, &event);
+}
+
+void trace_line_done(shell_trace *trace, int exit_code) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "line_done");
+    append_trace_format(&event, ",\"wall_ns\":%lld,\"exit_code\":%d,\"syscalls\":{", now_ns() - trace->line_start_ns,
+                        exit_code);
+    for (int i = 0; i < TRACED_SYSCALL_COUNT; ++i)
+        append_trace_format(&event, "%s\"%s\":%ld", i == 0 ? "" : ",", TRACED_SYSCALL_NAMES[i],
+                            trace->syscall_counts[i]);
+    append_trace_format(&event, "}");
+    emit_trace_event(trace, &event);
+}
+
+void trace_fork(shell_trace *trace, int stage, const char *command_name, int pid, long long fork_start_ns) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "fork");
+    append_trace_format(&event, ",\"stage\":%d,\"pid\":%d,\"fork_ns\":%lld", stage, pid, now_ns() - fork_start_ns);
+    append_trace_string(&event, "command", command_name);
+    emit_trace_event(trace, &event);
+}
+
+// Called by the child right before execvp(), so exec latency is the time from the 'fork' event until this one
+void trace_exec(shell_trace *trace, int stage, const char *command_name) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "exec");
+    append_trace_format(&event, ",\"stage\":%d,\"pid\":%d", stage, (int) getpid());
+    append_trace_string(&event, "command", command_name);
+    emit_trace_event(trace, &event);
+}
+
+void trace_builtin(shell_trace *trace, int stage, const char *command_name, long long start_ns, int exit_code) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "builtin");
+    append_trace_format(&event, ",\"stage\":%d,\"duration_ns\":%lld,\"exit_code\":%d", stage, now_ns() - start_ns,
+                        exit_code);
+    append_trace_string(&event, "command", command_name);
+    emit_trace_event(trace, &event);
+}
+
+void trace_child_exit(shell_trace *trace, int pid, int job_line, int stage, long long started_ns, int status,
+                      const struct rusage *usage) {
+    if (!trace_is_enabled(trace))
+        return;
+    trace_event event = start_trace_event(trace, "exit");
+    append_trace_format(&event, ",\"job_line\":%d,\"stage\":%d,\"pid\":%d,\"wall_ns\":%lld", job_line, stage, pid,
+                        now_ns() - started_ns);
+    if (WIFEXITED(status))
+        append_trace_format(&event, ",\"exit_code\":%d", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        append_trace_format(&event, ",\"signal\":%d", WTERMSIG(status));
+    append_trace_format(&event, ",\"user_us\":%lld,\"sys_us\":%lld,\"max_rss_kb\":%ld",
+                        (long long) usage->ru_utime.tv_sec * 1000000LL + usage->ru_utime.tv_usec,
+                        (long long) usage->ru_stime.tv_sec * 1000000LL + usage->ru_stime.tv_usec,
+                        usage->ru_maxrss);
+    emit_trace_event(trace, &event);
+}
@@ -1,17 +1,110 @@
 #define UTILS_INCLUDED
 
+#include <errno.h>
 #include <malloc.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 const int NONE = -1;
 
+// Scripts are read in big chunks instead of char-by-char stdio calls
+const int SCRIPT_READ_BUFFER_SIZE = 64 * 1024;
+
 typedef struct reader_output {
     bool ended_with_EOF;
     char *line;
 } reader_output;
 
-reader_output read_stdin_line() {
+typedef struct line_reader {
+    int fd;
+    char *buffer;
+    int buffer_size;
+    int buffer_filled;
+    int buffer_ptr;
+    bool reached_EOF;
+    // While waiting for input, readiness of this fd (if not NONE) is handled by the callback
+    int side_fd;
+    void (*on_side_fd_ready)(void *context);
+    void *side_context;
+} line_reader;
+
+line_reader open_line_reader(int fd, int buffer_size) {
+    return (line_reader) {
+            .fd = fd,
+            .buffer = malloc(sizeof(char) * buffer_size),
+            .buffer_size = buffer_size,
+            .buffer_filled = 0,
+            .buffer_ptr = 0,
+            .reached_EOF = false,
+            .side_fd = NONE,
+            .on_side_fd_ready = NULL,
+            .side_context = NULL
+    };
+}
+
+void watch_side_fd(line_reader *reader, int side_fd, void (*on_side_fd_ready)(void *context), void *context) {
+    reader->side_fd = side_fd;
+    reader->on_side_fd_ready = on_side_fd_ready;
+    reader->side_context = context;
+}
+
+void wait_for_input_handling_side_fd(line_reader *reader) {
+    if (reader->side_fd == NONE)
+        return;
+    while (true) {
+        struct pollfd fds[2] = {
+                {.fd = reader->fd, .events = POLLIN},
+                {.fd = reader->side_fd, .events = POLLIN}
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        if (fds[1].revents != 0)
+            reader->on_side_fd_ready(reader->side_context);
+        if (fds[0].revents != 0)
+            return;
+    }
+}
+
+// Makes all the following reads return EOF, for example in a subshell which must not consume the script
+void abandon_line_reader(line_reader *reader) {
+    reader->reached_EOF = true;
+    reader->buffer_ptr = reader->buffer_filled;
+}
+
+void dispose_of_line_reader(line_reader *reader) {
+    if (reader->fd != STDIN_FILENO && reader->fd != NONE)
+        close(reader->fd);
+    reader->fd = NONE;
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+int read_next_char(line_reader *reader) {
+    if (reader->buffer_ptr == reader->buffer_filled) {
+        if (reader->reached_EOF)
+            return EOF;
+        wait_for_input_handling_side_fd(reader);
+        ssize_t read_count;
+        do {
+            read_count = read(reader->fd, reader->buffer, reader->buffer_size);
+        } while (read_count < 0 && errno == EINTR);
+        if (read_count <= 0) {
+            reader->reached_EOF = true;
+            return EOF;
+        }
+        reader->buffer_filled = (int) read_count;
+        reader->buffer_ptr = 0;
+    }
+    return (unsigned char) reader->buffer[reader->buffer_ptr++];
+}
+
+reader_output read_line(line_reader *reader) {
     bool next_char_escaping = false;
     bool ended_with_EOF = false;
     const char NO_QUOTES_USED = 'a';
@@ -22,8 +115,8 @@ reader_output read_stdin_line() {
     char *str = malloc(sizeof(char) * (str_size + 1));
     str[str_ptr] = '\0';
 
-    char ch;
-    while ((ch = (char) getchar()) != '\n' || next_char_escaping || (used_quote_symbol != NO_QUOTES_USED)) {
+    int ch;
+    while ((ch = read_next_char(reader)) != '\n' || next_char_escaping || (used_quote_symbol != NO_QUOTES_USED)) {
         if (ch == EOF) {
             ended_with_EOF = true;
             break;
@@ -54,7 +147,7 @@ reader_output read_stdin_line() {
                     if (used_quote_symbol == ch) {
                         used_quote_symbol = NO_QUOTES_USED;
                     } else if (used_quote_symbol == NO_QUOTES_USED) {
-                        used_quote_symbol = ch;
+                        used_quote_symbol = (char) ch;
                     }
                 }
 
@@ -66,7 +159,7 @@ reader_output read_stdin_line() {
         }
 
 
-        str[str_ptr] = ch;
+        str[str_ptr] = (char) ch;
         str_ptr++;
         str[str_ptr] = '\0';
 
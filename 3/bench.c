@@ -0,0 +1,744 @@
+#include "userfs.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Throughput benchmarks of userfs. Not a part of the tests - the numbers
+ * depend on the machine. Build with 'make bench' and run ./bench.
+ */
+
+static double
+now_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double
+megabytes_per_second(size_t bytes, double seconds)
+{
+	return bytes / (1024.0 * 1024.0) / seconds;
+}
+
+static void
+bench_sequential_io(void)
+{
+	const size_t io_sizes[] = {1, 512, 64 * 1024, 1024 * 1024};
+	/* Byte-sized calls are slow, so they move less data. */
+	const size_t totals[] = {8 * 1024 * 1024, 64 * 1024 * 1024,
+				 64 * 1024 * 1024, 64 * 1024 * 1024};
+	char *buf = malloc(io_sizes[3]);
+	memset(buf, 'x', io_sizes[3]);
+
+	printf("%-12s %14s %14s\n", "io size", "write, MB/s", "read, MB/s");
+	for (size_t i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); ++i) {
+		size_t io_size = io_sizes[i], total = totals[i];
+		int fd = ufs_open("bench_file", UFS_CREATE);
+
+		double start = now_seconds();
+		for (size_t done = 0; done < total; done += io_size)
+			ufs_write(fd, buf, io_size);
+		double write_time = now_seconds() - start;
+		ufs_close(fd);
+
+		fd = ufs_open("bench_file", 0);
+		start = now_seconds();
+		for (size_t done = 0; done < total; done += io_size)
+			ufs_read(fd, buf, io_size);
+		double read_time = now_seconds() - start;
+		ufs_close(fd);
+		ufs_delete("bench_file");
+
+		printf("%-12zu %14.1f %14.1f\n", io_size,
+		       megabytes_per_second(total, write_time),
+		       megabytes_per_second(total, read_time));
+	}
+	free(buf);
+}
+
+static void
+bench_name_lookup(void)
+{
+	const int file_counts[] = {1000, 10000, 100000};
+	char name[32];
+
+	printf("%-12s %14s %14s\n", "files", "open, ops/s", "delete, ops/s");
+	for (size_t i = 0; i < sizeof(file_counts) / sizeof(file_counts[0]);
+	     ++i) {
+		int count = file_counts[i];
+		for (int j = 0; j < count; ++j) {
+			sprintf(name, "file%d", j);
+			ufs_close(ufs_open(name, UFS_CREATE));
+		}
+
+		double start = now_seconds();
+		for (int j = 0; j < count; ++j) {
+			sprintf(name, "file%d", j);
+			ufs_close(ufs_open(name, 0));
+		}
+		double open_time = now_seconds() - start;
+
+		start = now_seconds();
+		for (int j = 0; j < count; ++j) {
+			sprintf(name, "file%d", j);
+			ufs_delete(name);
+		}
+		double delete_time = now_seconds() - start;
+
+		printf("%-12d %14.0f %14.0f\n", count, count / open_time,
+		       count / delete_time);
+	}
+}
+
+static void
+bench_descriptors(void)
+{
+	const int descriptor_counts[] = {1000, 10000, 100000};
+
+	printf("%-12s %14s %14s\n", "descriptors", "open, ops/s",
+	       "resize, ops/s");
+	for (size_t i = 0;
+	     i < sizeof(descriptor_counts) / sizeof(descriptor_counts[0]);
+	     ++i) {
+		int count = descriptor_counts[i];
+		int *fds = malloc(sizeof(*fds) * count);
+		/* The resized file has one descriptor among many others. */
+		int resized_fd = ufs_open("resized_file", UFS_CREATE);
+
+		double start = now_seconds();
+		for (int j = 0; j < count; ++j)
+			fds[j] = ufs_open("bench_file", UFS_CREATE);
+		double open_time = now_seconds() - start;
+
+		const int resize_count = 10000;
+		start = now_seconds();
+		for (int j = 0; j < resize_count; ++j)
+			ufs_resize(resized_fd, 0);
+		double resize_time = now_seconds() - start;
+
+		for (int j = 0; j < count; ++j)
+			ufs_close(fds[j]);
+		ufs_close(resized_fd);
+		ufs_delete("bench_file");
+		ufs_delete("resized_file");
+		free(fds);
+
+		printf("%-12d %14.0f %14.0f\n", count, count / open_time,
+		       resize_count / resize_time);
+	}
+}
+
+static unsigned int
+next_random(unsigned int *state)
+{
+	/* xorshift32 - the same sequence on every run. */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void
+bench_random_io(void)
+{
+	const size_t file_size = 64 * 1024 * 1024;
+	const size_t io_sizes[] = {64, 4096};
+	const int op_count = 1000000;
+	char *buf = malloc(file_size);
+	memset(buf, 'x', file_size);
+
+	int fd = ufs_open("bench_file", UFS_CREATE);
+	ufs_write(fd, buf, file_size);
+
+	printf("random I/O on a %zu MiB file\n", file_size / (1024 * 1024));
+	printf("%-12s %14s %14s\n", "io size", "pwrite, ops/s",
+	       "pread, ops/s");
+	for (size_t i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); ++i) {
+		size_t io_size = io_sizes[i];
+		size_t offset_count = file_size - io_size;
+		unsigned int state = 1;
+
+		double start = now_seconds();
+		for (int j = 0; j < op_count; ++j)
+			ufs_pwrite(fd, buf, io_size,
+				   next_random(&state) % offset_count);
+		double write_time = now_seconds() - start;
+
+		start = now_seconds();
+		for (int j = 0; j < op_count; ++j)
+			ufs_pread(fd, buf, io_size,
+				  next_random(&state) % offset_count);
+		double read_time = now_seconds() - start;
+
+		printf("%-12zu %14.0f %14.0f\n", io_size, op_count / write_time,
+		       op_count / read_time);
+	}
+	ufs_close(fd);
+	ufs_delete("bench_file");
+	free(buf);
+}
+
+static void
+bench_directories(void)
+{
+	const int file_count = 1000 * 1000;
+	/* The same million files flat in the root and spread over dirs. */
+	const int dir_counts[] = {0, 1000};
+	char name[64];
+	unsigned int seed = 1;
+
+	printf("%-12s %14s %14s %14s %14s\n", "dirs", "create, ops/s",
+	       "open, ops/s", "readdir, us", "delete, ops/s");
+	for (size_t i = 0; i < sizeof(dir_counts) / sizeof(dir_counts[0]);
+	     ++i) {
+		int dir_count = dir_counts[i];
+		for (int j = 0; j < dir_count; ++j) {
+			sprintf(name, "dir%d", j);
+			ufs_mkdir(name);
+		}
+		double start = now_seconds();
+		for (int j = 0; j < file_count; ++j) {
+			if (dir_count > 0)
+				sprintf(name, "dir%d/file%d", j % dir_count, j);
+			else
+				sprintf(name, "file%d", j);
+			ufs_close(ufs_open(name, UFS_CREATE));
+		}
+		double create_time = now_seconds() - start;
+
+		start = now_seconds();
+		for (int j = 0; j < file_count; ++j) {
+			int k = next_random(&seed) % file_count;
+			if (dir_count > 0)
+				sprintf(name, "dir%d/file%d", k % dir_count, k);
+			else
+				sprintf(name, "file%d", k);
+			ufs_close(ufs_open(name, 0));
+		}
+		double open_time = now_seconds() - start;
+
+		struct ufs_dirent *entries;
+		start = now_seconds();
+		ufs_readdir(dir_count > 0 ? "dir0" : "", &entries);
+		double readdir_time = now_seconds() - start;
+		free(entries);
+
+		start = now_seconds();
+		for (int j = 0; j < file_count; ++j) {
+			if (dir_count > 0)
+				sprintf(name, "dir%d/file%d", j % dir_count, j);
+			else
+				sprintf(name, "file%d", j);
+			ufs_delete(name);
+		}
+		double delete_time = now_seconds() - start;
+		for (int j = 0; j < dir_count; ++j) {
+			sprintf(name, "dir%d", j);
+			ufs_rmdir(name);
+		}
+		printf("%-12d %14.0f %14.0f %14.0f %14.0f\n", dir_count,
+		       file_count / create_time, file_count / open_time,
+		       readdir_time * 1e6, file_count / delete_time);
+	}
+}
+
+static size_t
+heap_in_use(void)
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+static void
+bench_block_sizes(void)
+{
+	const size_t block_sizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+	const size_t total = 64 * 1024 * 1024, io_size = 64 * 1024;
+	char *buf = malloc(io_size);
+	memset(buf, 'x', io_size);
+
+	printf("%zu MiB file in %zu KiB writes\n", total / (1024 * 1024),
+	       io_size / 1024);
+	printf("%-12s %14s %14s\n", "block size", "write, MB/s", "overhead, %");
+	for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]);
+	     ++i) {
+		ufs_set_block_size(block_sizes[i]);
+		size_t heap_before = heap_in_use();
+		int fd = ufs_open("bench_file", UFS_CREATE);
+
+		double start = now_seconds();
+		for (size_t done = 0; done < total; done += io_size)
+			ufs_write(fd, buf, io_size);
+		double write_time = now_seconds() - start;
+		size_t heap_used = heap_in_use() - heap_before;
+
+		ufs_close(fd);
+		ufs_delete("bench_file");
+
+		printf("%-12zu %14.1f %14.2f\n", block_sizes[i],
+		       megabytes_per_second(total, write_time),
+		       100.0 * ((double) heap_used - total) / total);
+	}
+	ufs_set_block_size(4096);
+	free(buf);
+}
+
+static void
+bench_sparse_resize(void)
+{
+	const size_t sizes[] = {1024 * 1024, 10 * 1024 * 1024,
+				100 * 1024 * 1024 - 1};
+	const int resize_count = 100000;
+	int fd = ufs_open("bench_file", UFS_CREATE);
+
+	printf("%-12s %14s %14s\n", "grow to, MiB", "resize, ops/s",
+	       "heap, KiB");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		size_t heap_before = heap_in_use();
+		ufs_resize(fd, sizes[i]);
+		size_t heap_used = heap_in_use() - heap_before;
+		ufs_resize(fd, 0);
+
+		double start = now_seconds();
+		for (int j = 0; j < resize_count; ++j) {
+			ufs_resize(fd, sizes[i]);
+			ufs_resize(fd, 0);
+		}
+		double resize_time = now_seconds() - start;
+		printf("%-12zu %14.0f %14zu\n", sizes[i] / (1024 * 1024),
+		       2 * resize_count / resize_time, heap_used / 1024);
+	}
+	ufs_close(fd);
+	ufs_delete("bench_file");
+}
+
+struct reader_args {
+	int fd;
+	unsigned int seed;
+	int op_count;
+	size_t file_size;
+};
+
+static void *
+parallel_reader(void *arg)
+{
+	struct reader_args *args = arg;
+	char buf[4096];
+	for (int i = 0; i < args->op_count; ++i) {
+		size_t offset = next_random(&args->seed) %
+				(args->file_size - sizeof(buf));
+		ufs_pread(args->fd, buf, sizeof(buf), offset);
+	}
+	return NULL;
+}
+
+static void
+bench_parallel_reads(void)
+{
+	const size_t file_size = 64 * 1024 * 1024;
+	const int op_count = 200000;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+	char *buf = malloc(file_size);
+	memset(buf, 'x', file_size);
+	int fd = ufs_open("bench_file", UFS_CREATE);
+	ufs_write(fd, buf, file_size);
+	free(buf);
+
+	printf("random 4 KiB preads of one file, %d per thread\n", op_count);
+	printf("%-12s %14s\n", "threads", "MB/s");
+	for (long thread_count = 1; thread_count <= max_threads;
+	     thread_count *= 2) {
+		pthread_t *threads = malloc(sizeof(*threads) * thread_count);
+		struct reader_args *args = malloc(sizeof(*args) * thread_count);
+		double start = now_seconds();
+		for (long i = 0; i < thread_count; ++i) {
+			args[i] = (struct reader_args) {
+				.fd = fd,
+				.seed = i + 1,
+				.op_count = op_count,
+				.file_size = file_size,
+			};
+			pthread_create(&threads[i], NULL, parallel_reader,
+				       &args[i]);
+		}
+		for (long i = 0; i < thread_count; ++i)
+			pthread_join(threads[i], NULL);
+		double read_time = now_seconds() - start;
+		printf("%-12ld %14.1f\n", thread_count,
+		       megabytes_per_second(thread_count * op_count * 4096,
+					    read_time));
+		free(threads);
+		free(args);
+	}
+	ufs_close(fd);
+	ufs_delete("bench_file");
+}
+
+static void
+bench_clone(void)
+{
+	const size_t file_size = 100 * 1024 * 1024, io_size = 1024 * 1024;
+	char *buf = malloc(io_size);
+	memset(buf, 'x', io_size);
+	int fd = ufs_open("bench_file", UFS_CREATE);
+	for (size_t done = 0; done < file_size; done += io_size)
+		ufs_write(fd, buf, io_size);
+	ufs_close(fd);
+
+	double start = now_seconds();
+	int in = ufs_open("bench_file", 0);
+	int out = ufs_open("bench_copy", UFS_CREATE);
+	ssize_t rc;
+	while ((rc = ufs_read(in, buf, io_size)) > 0)
+		ufs_write(out, buf, rc);
+	ufs_close(in);
+	ufs_close(out);
+	double copy_time = now_seconds() - start;
+	ufs_delete("bench_copy");
+
+	start = now_seconds();
+	ufs_clone("bench_file", "bench_copy");
+	double clone_time = now_seconds() - start;
+
+	/* The first write to each block of a clone copies it. */
+	out = ufs_open("bench_copy", 0);
+	start = now_seconds();
+	for (size_t done = 0; done < file_size; done += io_size)
+		ufs_write(out, buf, io_size);
+	double cow_write_time = now_seconds() - start;
+	ufs_close(out);
+
+	printf("%zu MiB file\n", file_size / (1024 * 1024));
+	printf("%-24s %10.3f ms\n", "read + write copy", copy_time * 1000);
+	printf("%-24s %10.3f ms\n", "clone", clone_time * 1000);
+	printf("%-24s %10.3f ms\n", "overwrite of the clone",
+	       cow_write_time * 1000);
+	ufs_delete("bench_copy");
+	ufs_delete("bench_file");
+	free(buf);
+}
+
+static unsigned long
+checksum(const char *data, size_t size, unsigned long sum)
+{
+	for (size_t i = 0; i < size; ++i)
+		sum = sum * 31 + (unsigned char) data[i];
+	return sum;
+}
+
+static void
+bench_zero_copy(void)
+{
+	const size_t file_size = 64 * 1024 * 1024, io_size = 64 * 1024;
+	char *buf = malloc(io_size);
+	memset(buf, 'x', io_size);
+	int fd = ufs_open("bench_file", UFS_CREATE);
+	for (size_t done = 0; done < file_size; done += io_size)
+		ufs_write(fd, buf, io_size);
+
+	/* The same consumer of the data in both cases, only the copy differs. */
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	unsigned long read_sum = 0;
+	double start = now_seconds();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, io_size)) > 0)
+		read_sum = checksum(buf, rc, read_sum);
+	double read_time = now_seconds() - start;
+
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	unsigned long map_sum = 0;
+	struct ufs_span spans[16];
+	struct ufs_mapping *mapping;
+	int count;
+	start = now_seconds();
+	while ((count = ufs_read_iov(fd, io_size, spans, 16, &mapping)) > 0) {
+		for (int i = 0; i < count; ++i)
+			map_sum = checksum(spans[i].data, spans[i].size, map_sum);
+		ufs_unmap(mapping);
+	}
+	double map_time = now_seconds() - start;
+
+	printf("checksum of a %zu MiB file in %zu KiB pieces\n",
+	       file_size / (1024 * 1024), io_size / 1024);
+	printf("%-24s %14s\n", "", "MB/s");
+	printf("%-24s %14.1f\n", "ufs_read", megabytes_per_second(file_size,
+								 read_time));
+	printf("%-24s %14.1f%s\n", "ufs_read_iov",
+	       megabytes_per_second(file_size, map_time),
+	       read_sum == map_sum ? "" : " (wrong data)");
+	ufs_close(fd);
+	ufs_delete("bench_file");
+	free(buf);
+}
+
+static void
+bench_dedup(void)
+{
+	const int file_count = 64;
+	const size_t file_size = 1024 * 1024;
+	/* Like log or text files: repetitive, but not all the same. */
+	char *content = malloc(file_size);
+	char *buf = malloc(file_size);
+	unsigned int seed = 1;
+	for (size_t i = 0; i < file_size;) {
+		i += snprintf(content + i, file_size - i,
+			      "%08u request id=%u status=%s\n", (unsigned)i,
+			      next_random(&seed) % 1000,
+			      next_random(&seed) % 8 == 0 ? "error" : "ok");
+	}
+
+	printf("%-12s %14s %14s %14s\n", "dedup", "write, MB/s",
+	       "logical, MiB", "physical, MiB");
+	for (int is_enabled = 0; is_enabled <= 1; ++is_enabled) {
+		ufs_set_dedup(is_enabled);
+		double start = now_seconds();
+		for (int i = 0; i < file_count; ++i) {
+			char name[32];
+			snprintf(name, sizeof(name), "bench_file_%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			/* Near-identical copies: each differs in a few bytes. */
+			memcpy(buf, content, file_size);
+			for (int j = 0; j < 4; ++j)
+				buf[next_random(&seed) % file_size] = '#';
+			ufs_write(fd, buf, file_size);
+			ufs_close(fd);
+		}
+		double write_time = now_seconds() - start;
+		struct ufs_space_stats stats;
+		ufs_get_space_stats(&stats);
+		printf("%-12s %14.1f %14zu %14zu\n", is_enabled ? "on" : "off",
+		       megabytes_per_second(file_count * file_size, write_time),
+		       stats.logical_bytes >> 20, stats.physical_bytes >> 20);
+		if (is_enabled)
+			break;
+		for (int i = 0; i < file_count; ++i) {
+			char name[32];
+			snprintf(name, sizeof(name), "bench_file_%d", i);
+			ufs_delete(name);
+		}
+	}
+	ufs_set_dedup(0);
+
+	/* Shared blocks are not compressed, so compress unique files. */
+	for (int i = 1; i < file_count; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "bench_file_%d", i);
+		ufs_delete(name);
+	}
+	ufs_compress_cold_blocks();
+	double start = now_seconds();
+	int compressed_count = ufs_compress_cold_blocks();
+	double compress_time = now_seconds() - start;
+	struct ufs_space_stats stats;
+	ufs_get_space_stats(&stats);
+	int fd = ufs_open("bench_file_0", 0);
+	start = now_seconds();
+	ufs_read(fd, buf, file_size);
+	double read_time = now_seconds() - start;
+	ufs_close(fd);
+	printf("compressed %d blocks: ratio %.2f, compress %.1f MB/s, "
+	       "inflating read %.1f MB/s\n", compressed_count,
+	       (double)stats.logical_bytes / stats.physical_bytes,
+	       megabytes_per_second(file_size, compress_time),
+	       megabytes_per_second(file_size, read_time));
+	ufs_delete("bench_file_0");
+	free(buf);
+	free(content);
+}
+
+/** Upper bound of the latency bucket where the @a fraction of timed calls ends. */
+static double
+latency_percentile_ns(const struct ufs_op_stats *op, double fraction)
+{
+	size_t timed = 0;
+	for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i)
+		timed += op->latency_buckets[i];
+	size_t seen = 0;
+	for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i) {
+		seen += op->latency_buckets[i];
+		if (seen >= fraction * timed)
+			return (double)(1ull << i);
+	}
+	return (double)(1ull << (UFS_LATENCY_BUCKET_COUNT - 1));
+}
+
+static void
+bench_stats(void)
+{
+	const int op_count = 4 * 1000 * 1000;
+	char buf[64] = {0};
+	int fd = ufs_open("bench_file", UFS_CREATE);
+
+	printf("%-12s %14s %14s %14s\n", "trace", "pwrite, ops/s",
+	       "p50, ns <", "p99, ns <");
+	for (int is_tracing = 0; is_tracing <= 1; ++is_tracing) {
+		if (is_tracing)
+			ufs_trace_start(4096);
+		struct ufs_stats before;
+		ufs_stats(&before);
+		double start = now_seconds();
+		for (int i = 0; i < op_count; ++i)
+			ufs_pwrite(fd, buf, sizeof(buf), (i % 1024) * 64);
+		double write_time = now_seconds() - start;
+		struct ufs_stats after;
+		ufs_stats(&after);
+		/* Only the calls of this round. */
+		struct ufs_op_stats op = after.ops[UFS_OP_WRITE];
+		for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i) {
+			op.latency_buckets[i] -=
+				before.ops[UFS_OP_WRITE].latency_buckets[i];
+		}
+		printf("%-12s %14.0f %14.0f %14.0f\n", is_tracing ? "on" : "off",
+		       op_count / write_time, latency_percentile_ns(&op, 0.5),
+		       latency_percentile_ns(&op, 0.99));
+	}
+	ufs_trace_stop();
+	ufs_close(fd);
+	ufs_delete("bench_file");
+}
+
+/*
+ * Small pwrites and preads of one descriptor, one call each against batches
+ * of a ring, inline and on its worker thread.
+ */
+static void
+bench_async_io(void)
+{
+	const int op_count = 4 * 1000 * 1000, batch_size = 64;
+	char buf[64] = {0};
+	int fd = ufs_open("bench_file", UFS_CREATE);
+	ufs_write(fd, buf, sizeof(buf));
+
+	printf("%-12s %14s %14s\n", "64 B calls", "write, ops/s", "read, ops/s");
+	double start = now_seconds();
+	for (int i = 0; i < op_count; ++i)
+		ufs_pwrite(fd, buf, sizeof(buf), (i % 1024) * 64);
+	double write_time = now_seconds() - start;
+	start = now_seconds();
+	for (int i = 0; i < op_count; ++i)
+		ufs_pread(fd, buf, sizeof(buf), (i % 1024) * 64);
+	double read_time = now_seconds() - start;
+	printf("%-12s %14.0f %14.0f\n", "sync", op_count / write_time,
+	       op_count / read_time);
+
+	struct ufs_cqe cqes[64];
+	int flags[] = {0, UFS_RING_WORKER};
+	for (int i = 0; i < 2; ++i) {
+		struct ufs_ring *ring = ufs_ring_create(batch_size, flags[i]);
+		double times[2];
+		for (int op = 0; op < 2; ++op) {
+			start = now_seconds();
+			for (int done = 0; done < op_count; done += batch_size) {
+				for (int j = 0; j < batch_size; ++j) {
+					struct ufs_sqe *sqe;
+					sqe = ufs_ring_get_sqe(ring);
+					sqe->op = op == 0 ? UFS_RING_WRITE :
+						  UFS_RING_READ;
+					sqe->fd = fd;
+					sqe->buf = buf;
+					sqe->data = buf;
+					sqe->size = sizeof(buf);
+					sqe->offset = ((done + j) % 1024) * 64;
+				}
+				ufs_ring_submit(ring);
+				ufs_ring_reap(ring, cqes, batch_size, batch_size);
+			}
+			times[op] = now_seconds() - start;
+		}
+		ufs_ring_destroy(ring);
+		printf("%-12s %14.0f %14.0f\n",
+		       i == 0 ? "ring" : "ring worker",
+		       op_count / times[0], op_count / times[1]);
+	}
+	ufs_close(fd);
+	ufs_delete("bench_file");
+}
+
+static void
+bench_image(void)
+{
+	const int file_count = 10000;
+	const size_t total = 64 * 1024 * 1024, io_size = 64 * 1024;
+	char path[] = "/tmp/userfs_bench_XXXXXX";
+	char name[32];
+	char *buf = malloc(io_size);
+	memset(buf, 'x', io_size);
+	close(mkstemp(path));
+	unlink(path);
+
+	ufs_destroy();
+	setenv("UFS_IMAGE", path, 1);
+	printf("image mode, %zu MiB file in %zu KiB writes\n",
+	       total / (1024 * 1024), io_size / 1024);
+	printf("%-24s %14s\n", "journal", "write, MB/s");
+	const char *sync_modes[] = {"0", "1"};
+	for (size_t i = 0; i < sizeof(sync_modes) / sizeof(sync_modes[0]); ++i) {
+		setenv("UFS_IMAGE_SYNC", sync_modes[i], 1);
+		int fd = ufs_open("bench_file", UFS_CREATE);
+		double start = now_seconds();
+		for (size_t done = 0; done < total; done += io_size)
+			ufs_write(fd, buf, io_size);
+		double write_time = now_seconds() - start;
+		ufs_close(fd);
+		ufs_delete("bench_file");
+		ufs_destroy();
+		printf("%-24s %14.1f\n", i == 0 ? "no sync" : "synced on each call",
+		       megabytes_per_second(total, write_time));
+	}
+	unsetenv("UFS_IMAGE_SYNC");
+
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		ufs_write(fd, buf, 4096);
+		ufs_close(fd);
+	}
+	ufs_destroy();
+	/* The mount happens on the first call. */
+	double start = now_seconds();
+	ufs_close(ufs_open("file0", 0));
+	double mount_time = now_seconds() - start;
+	start = now_seconds();
+	for (int i = 1; i < file_count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_close(ufs_open(name, 0));
+	}
+	double open_time = now_seconds() - start;
+	printf("image with %d files\n", file_count);
+	printf("%-24s %10.3f ms\n", "mount", mount_time * 1000);
+	printf("%-24s %10.0f ops/s\n", "first open of a file",
+	       (file_count - 1) / open_time);
+
+	ufs_destroy();
+	unsetenv("UFS_IMAGE");
+	unlink(path);
+	free(buf);
+}
+
+int
+main(void)
+{
+	bench_sequential_io();
+	bench_name_lookup();
+	bench_directories();
+	bench_descriptors();
+	bench_random_io();
+	bench_block_sizes();
+	bench_sparse_resize();
+	bench_parallel_reads();
+	bench_clone();
+	bench_zero_copy();
+	bench_dedup();
+	bench_stats();
+	bench_async_io();
+	bench_image();
+
+	ufs_destroy();
+	return 0;
+}
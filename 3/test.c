@@ -2,7 +2,11 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -436,11 +440,812 @@ test_resize(void)
 	unit_fail_if(ufs_close(fd2) != 0);
 	unit_fail_if(ufs_close(fd) != 0);
 	unit_fail_if(ufs_delete("file") != 0);
+	/*
+	 * Growing keeps the data, and the new part reads as zeros until it
+	 * is written.
+	 */
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	rc = ufs_write(fd, "start", 5);
+	unit_fail_if(rc != 5);
+	int big_size = 1024 * 1024 * 100 - 1;
+	unit_check(ufs_resize(fd, big_size) == 0, "grow to the max size");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 0);
+	unit_check(rc == sizeof(buffer) && memcmp(buffer, "start\0\0", 7) == 0,
+		   "data is kept");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), big_size - 100);
+	bool is_zero = rc == 100;
+	for (int i = 0; i < 100; ++i)
+		is_zero = is_zero && buffer[i] == 0;
+	unit_check(is_zero, "the end reads as zeros");
+	rc = ufs_pwrite(fd, "middle", 6, 50 * 1024 * 1024);
+	unit_fail_if(rc != 6);
+	rc = ufs_pread(fd, buffer, 8, 50 * 1024 * 1024 - 1);
+	unit_check(rc == 8 && memcmp(buffer, "\0middle\0", 8) == 0,
+		   "write into the grown part");
+	unit_fail_if(ufs_resize(fd, 3) != 0);
+	unit_fail_if(ufs_resize(fd, 50 * 1024 * 1024 + 6) != 0);
+	rc = ufs_pread(fd, buffer, 6, 50 * 1024 * 1024);
+	unit_check(rc == 6 && memcmp(buffer, "\0\0\0\0\0\0", 6) == 0,
+		   "shrunk data does not come back after growing");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_positional_io(void)
+{
+#ifdef NEED_POSITIONAL_IO
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ssize_t rc = ufs_write(fd, "123456", 6);
+	unit_fail_if(rc != 6);
+
+	char buffer[4096];
+	rc = ufs_pread(fd, buffer, 3, 2);
+	unit_check(rc == 3 && memcmp(buffer, "345", 3) == 0,
+		   "pread from the middle");
+	rc = ufs_pwrite(fd, "ab", 2, 1);
+	unit_fail_if(rc != 2);
+	rc = ufs_write(fd, "7", 1);
+	unit_check(rc == 1, "pwrite does not move the position");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 0);
+	unit_check(rc == 7 && memcmp(buffer, "1ab4567", 7) == 0,
+		   "pwrite overwrites the data");
+
+	unit_check(ufs_lseek(fd, 1, UFS_SEEK_SET) == 1, "seek from the start");
+	unit_check(ufs_lseek(fd, 2, UFS_SEEK_CUR) == 3, "seek from the position");
+	rc = ufs_read(fd, buffer, 2);
+	unit_check(rc == 2 && memcmp(buffer, "45", 2) == 0,
+		   "read from the new position");
+	unit_check(ufs_lseek(fd, -1, UFS_SEEK_END) == 6, "seek from the end");
+	unit_check(ufs_lseek(fd, -10, UFS_SEEK_CUR) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT,
+		   "can not seek before the start");
+
+	unit_msg("seek beyond the end and make a hole");
+	unit_fail_if(ufs_lseek(fd, 10000, UFS_SEEK_SET) != 10000);
+	rc = ufs_read(fd, buffer, sizeof(buffer));
+	unit_check(rc == 0, "read beyond the end is EOF");
+	rc = ufs_write(fd, "end", 3);
+	unit_fail_if(rc != 3);
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 7);
+	unit_fail_if(rc != sizeof(buffer));
+	bool is_zero = true;
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		is_zero = is_zero && buffer[i] == 0;
+	unit_check(is_zero, "hole reads as zeros");
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 9998);
+	unit_check(rc == 5 && memcmp(buffer, "\0\0end", 5) == 0,
+		   "data after the hole");
+
+	unit_msg("shrink and grow back");
+	unit_fail_if(ufs_resize(fd, 3) != 0);
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	rc = ufs_pread(fd, buffer, sizeof(buffer), 0);
+	unit_check(rc == 10 && memcmp(buffer, "1ab\0\0\0\0\0\0\0", 10) == 0,
+		   "truncated data does not come back");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_zero_copy_io(void)
+{
+#ifdef NEED_ZERO_COPY_IO
+	unit_test_start();
+
+	char buffer[10000], read_buffer[20000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_span parts[] = {
+		{buffer, 3000}, {NULL, 0}, {buffer + 3000, 7000},
+	};
+	unit_check(ufs_write_iov(fd, parts, 3) == sizeof(buffer),
+		   "write_iov gathers the buffers");
+	unit_fail_if(ufs_pwrite(fd, "end", 3, 19997) != 3);
+
+	struct ufs_span spans[16];
+	struct ufs_mapping *mapping;
+	int count = ufs_map_range(fd, 0, sizeof(read_buffer), spans, 16,
+				  &mapping);
+	unit_check(count > 1 && mapping != NULL, "range is mapped");
+	size_t mapped = 0;
+	for (int i = 0; i < count; ++i) {
+		memcpy(read_buffer + mapped, spans[i].data, spans[i].size);
+		mapped += spans[i].size;
+	}
+	char zeros[9997] = {0};
+	unit_check(mapped == 20000 &&
+		   memcmp(read_buffer, buffer, sizeof(buffer)) == 0 &&
+		   memcmp(read_buffer + 10000, zeros, sizeof(zeros)) == 0 &&
+		   memcmp(read_buffer + 19997, "end", 3) == 0,
+		   "spans have the data and the hole");
+
+	unit_msg("pinned spans don't change");
+	unit_fail_if(ufs_pwrite(fd, "changed", 7, 0) != 7);
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(memcmp(spans[0].data, buffer, 7) == 0,
+		   "write, resize and delete keep the spans");
+	ufs_unmap(mapping);
+
+	unit_msg("read_iov moves the position");
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_lseek(fd, 100, UFS_SEEK_SET) != 100);
+	count = ufs_read_iov(fd, 50, spans, 16, &mapping);
+	unit_check(count == 1 && spans[0].size == 50 &&
+		   memcmp(spans[0].data, buffer + 100, 50) == 0,
+		   "read_iov from the position");
+	ufs_unmap(mapping);
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_CUR) == 150, "position moved");
+	count = ufs_map_range(fd, 20000, 10, spans, 16, &mapping);
+	unit_check(count == 0 && mapping == NULL, "nothing beyond the end");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_block_size(void)
+{
+#ifdef NEED_BLOCK_SIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_set_block_size(512) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "can not change block size when there are files");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(ufs_set_block_size(1000) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT,
+		   "block size must be a power of two");
+
+	const size_t sizes[] = {512, 1024 * 1024};
+	char buffer[3000], read_buffer[3000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		unit_msg("block size %zu", sizes[i]);
+		unit_fail_if(ufs_set_block_size(sizes[i]) != 0);
+		fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) !=
+			     sizeof(buffer));
+		unit_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		unit_fail_if(fd == -1);
+		ssize_t rc = ufs_read(fd, read_buffer, sizeof(read_buffer));
+		unit_check(rc == sizeof(buffer) &&
+			   memcmp(buffer, read_buffer, rc) == 0,
+			   "data is correct");
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+	unit_fail_if(ufs_set_block_size(4096) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+enum {
+	STRESS_THREAD_COUNT = 8,
+	STRESS_ITERATION_COUNT = 300,
+	SHARED_FILE_SIZE = 64 * 1024,
+};
+
+static char
+shared_file_byte(int offset)
+{
+	return 'a' + offset % 26;
+}
+
+static void *
+stress_worker(void *arg)
+{
+	int id = *(int *)arg;
+	char name[32], buffer[1024], read_buffer[1024];
+	sprintf(name, "thread%d", id);
+	memset(buffer, 'a' + id, sizeof(buffer));
+
+	int shared_fd = ufs_open("shared", 0);
+	unit_fail_if(shared_fd == -1);
+	for (int i = 0; i < STRESS_ITERATION_COUNT; ++i) {
+		/* Own file: create, fill, check, delete. */
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		for (int j = 0; j < 4; ++j)
+			unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) !=
+				     sizeof(buffer));
+		ssize_t rc = ufs_pread(fd, read_buffer, sizeof(read_buffer),
+				       sizeof(buffer) * (i % 4));
+		unit_fail_if(rc != sizeof(read_buffer));
+		unit_fail_if(memcmp(buffer, read_buffer, rc) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete(name) != 0);
+
+		/* Shared file: readers see whole data, writers rewrite it. */
+		int offset = (i * 997 + id * 131) % (SHARED_FILE_SIZE - 100);
+		if (id % 4 == 0) {
+			for (int j = 0; j < 100; ++j)
+				read_buffer[j] = shared_file_byte(offset + j);
+			rc = ufs_pwrite(shared_fd, read_buffer, 100, offset);
+			unit_fail_if(rc != 100);
+		} else {
+			rc = ufs_pread(shared_fd, read_buffer, 100, offset);
+			unit_fail_if(rc != 100);
+			for (int j = 0; j < 100; ++j) {
+				unit_fail_if(read_buffer[j] !=
+					     shared_file_byte(offset + j));
+			}
+		}
+	}
+	/* Errors of other threads are not visible here. */
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_ERR);
+	unit_fail_if(ufs_open("no such file", 0) != -1);
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_fail_if(ufs_close(shared_fd) != 0);
+	return NULL;
+}
+
+static void
+test_multithreading(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < SHARED_FILE_SIZE; ++i) {
+		char byte = shared_file_byte(i);
+		unit_fail_if(ufs_write(fd, &byte, 1) != 1);
+	}
+
+	pthread_t threads[STRESS_THREAD_COUNT];
+	int ids[STRESS_THREAD_COUNT];
+	for (int i = 0; i < STRESS_THREAD_COUNT; ++i) {
+		ids[i] = i;
+		unit_fail_if(pthread_create(&threads[i], NULL, stress_worker,
+					    &ids[i]) != 0);
+	}
+	for (int i = 0; i < STRESS_THREAD_COUNT; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_check(true, "threads worked with own and shared files");
+
+	char name[32];
+	sprintf(name, "thread%d", 0);
+	unit_check(ufs_open(name, 0) == -1, "files of the threads are deleted");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone_and_snapshot(void)
+{
+#ifdef NEED_SNAPSHOTS
+	unit_test_start();
+
+	char buffer[10000], read_buffer[10000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	int fd = ufs_open("source", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+
+	unit_check(ufs_clone("no such file", "copy") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of no file fails");
+	unit_fail_if(ufs_clone("source", "copy") != 0);
+	int copy_fd = ufs_open("copy", 0);
+	unit_check(copy_fd != -1, "clone is a file");
+	ssize_t rc = ufs_read(copy_fd, read_buffer, sizeof(read_buffer));
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(buffer, read_buffer, rc) == 0, "clone has the data");
+
+	unit_fail_if(ufs_pwrite(fd, "source", 6, 5000) != 6);
+	unit_fail_if(ufs_pwrite(copy_fd, "copy", 4, 5002) != 4);
+	unit_fail_if(ufs_resize(copy_fd, 6000) != 0);
+	rc = ufs_pread(fd, read_buffer, sizeof(read_buffer), 0);
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(read_buffer + 5000, "source", 6) == 0 &&
+		   memcmp(read_buffer, buffer, 5000) == 0,
+		   "writes to the clone don't change the source");
+	rc = ufs_pread(copy_fd, read_buffer, sizeof(read_buffer), 0);
+	unit_check(rc == 6000 && memcmp(read_buffer + 5002, "copy", 4) == 0 &&
+		   memcmp(read_buffer + 5000, buffer + 5000, 2) == 0,
+		   "writes to the source don't change the clone");
+	unit_fail_if(ufs_close(copy_fd) != 0);
+
+	unit_msg("snapshot");
+	int id = ufs_snapshot_create();
+	unit_check(id >= 0, "snapshot is created");
+	unit_fail_if(ufs_pwrite(fd, "changed", 7, 0) != 7);
+	unit_fail_if(ufs_delete("copy") != 0);
+	int new_fd = ufs_open("new", UFS_CREATE);
+	unit_fail_if(new_fd == -1);
+	unit_fail_if(ufs_close(new_fd) != 0);
+
+	unit_fail_if(ufs_snapshot_restore(id) != 0);
+	unit_check(ufs_open("new", 0) == -1, "files after the snapshot are gone");
+	copy_fd = ufs_open("copy", 0);
+	unit_check(copy_fd != -1, "deleted file is back");
+	unit_fail_if(ufs_close(copy_fd) != 0);
+	rc = ufs_pread(fd, read_buffer, 7, 0);
+	unit_check(rc == 7 && memcmp(read_buffer, "changed", 7) == 0,
+		   "old descriptor works with the replaced file");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("source", 0);
+	rc = ufs_pread(fd, read_buffer, 7, 0);
+	unit_check(rc == 7 && memcmp(read_buffer, buffer, 7) == 0,
+		   "restored file has the old data");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_snapshot_delete(id) != 0);
+	unit_check(ufs_snapshot_restore(id) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT,
+		   "deleted snapshot can't be restored");
+	unit_fail_if(ufs_delete("source") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_dedup(void)
+{
+#ifdef NEED_DEDUP
+	unit_test_start();
+
+	char buffer[4 * 4096], read_buffer[4 * 4096];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + (i / 4096 + i % 7) % 26;
+	unit_fail_if(ufs_set_dedup(1) != 0);
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, buffer, sizeof(buffer)) != sizeof(buffer));
+	/* Smaller writes seal a block too, when they fill it up. */
+	for (size_t i = 0; i < sizeof(buffer); i += 1000) {
+		size_t size = sizeof(buffer) - i < 1000 ? sizeof(buffer) - i : 1000;
+		unit_fail_if(ufs_write(fd2, buffer + i, size) != (ssize_t)size);
+	}
+	struct ufs_space_stats stats;
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.logical_bytes == 2 * sizeof(buffer) &&
+		   stats.block_count == 4 && stats.sealed_block_count == 4 &&
+		   stats.physical_bytes == sizeof(buffer),
+		   "files with the same content share the blocks");
+
+	unit_fail_if(ufs_pwrite(fd2, "x", 1, 4096) != 1);
+	unit_fail_if(ufs_pread(fd1, read_buffer, sizeof(buffer), 0) !=
+		     sizeof(buffer));
+	unit_check(memcmp(read_buffer, buffer, sizeof(buffer)) == 0,
+		   "write to a shared block doesn't change the other file");
+	unit_fail_if(ufs_pread(fd2, read_buffer, sizeof(buffer), 0) !=
+		     sizeof(buffer));
+	unit_check(read_buffer[4096] == 'x' &&
+		   memcmp(read_buffer + 4097, buffer + 4097, 4095) == 0,
+		   "the written file has a copy");
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.block_count == 5, "only one block is copied");
+
+	unit_msg("cold blocks");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	unit_check(ufs_compress_cold_blocks() == 0, "hot blocks stay");
+	unit_check(ufs_compress_cold_blocks() == 4,
+		   "blocks not used since the previous call are compressed");
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.compressed_block_count == 4 &&
+		   stats.physical_bytes < sizeof(buffer) / 4,
+		   "compressed blocks take less memory");
+	unit_fail_if(ufs_pread(fd1, read_buffer, 4096, 4096) != 4096);
+	unit_check(memcmp(read_buffer, buffer + 4096, 4096) == 0,
+		   "compressed block is read back");
+	unit_fail_if(ufs_pwrite(fd1, "y", 1, 0) != 1);
+	unit_fail_if(ufs_pread(fd1, read_buffer, sizeof(buffer), 0) !=
+		     sizeof(buffer));
+	unit_check(read_buffer[0] == 'y' &&
+		   memcmp(read_buffer + 1, buffer + 1, sizeof(buffer) - 1) == 0,
+		   "compressed blocks are read and written back");
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.compressed_block_count == 0, "used blocks inflated");
+
+	unsigned int seed = 1;
+	for (size_t i = 0; i < 4096; ++i)
+		buffer[i] = (char)rand_r(&seed);
+	unit_fail_if(ufs_pwrite(fd1, buffer, 4096, 0) != 4096);
+	ufs_compress_cold_blocks();
+	unit_check(ufs_compress_cold_blocks() == 3,
+		   "random data is not compressed");
+
+	unit_fail_if(ufs_set_dedup(0) != 0);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.block_count == 0 && stats.logical_bytes == 0,
+		   "all blocks are freed");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_directories(void)
+{
+#ifdef NEED_DIRECTORIES
+	unit_test_start();
+
+	unit_check(ufs_open("dir/file", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no file in a missing dir");
+	unit_fail_if(ufs_mkdir("dir") != 0);
+	unit_fail_if(ufs_mkdir("dir/sub") != 0);
+	unit_check(ufs_mkdir("dir") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of an existing dir");
+	unit_check(ufs_mkdir("a/b") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir in a missing dir");
+	unit_check(ufs_mkdir("dir//x") == -1 && ufs_mkdir("dir/") == -1 &&
+		   ufs_mkdir("/dir") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "empty names");
+
+	int fd1 = ufs_open("dir/sub/file", UFS_CREATE);
+	int fd2 = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, "nested", 6) != 6);
+	unit_fail_if(ufs_write(fd2, "root", 4) != 4);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	char buf[16];
+	fd1 = ufs_open("dir/sub/file", 0);
+	unit_check(fd1 != -1 && ufs_read(fd1, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "nested", 6) == 0,
+		   "files with the same name in different dirs are apart");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_check(ufs_open("dir/sub", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "no file over a dir");
+	unit_check(ufs_mkdir("dir/sub/file") == -1 &&
+		   ufs_errno() == UFS_ERR_EXISTS, "no dir over a file");
+	unit_check(ufs_open("dir/sub", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "dir can't be opened");
+
+	struct ufs_dirent *entries;
+	unit_check(ufs_readdir("dir/sub", &entries) == 1 &&
+		   strcmp(entries[0].name, "file") == 0 &&
+		   !entries[0].is_directory, "readdir shows the file");
+	free(entries);
+	int count = ufs_readdir("", &entries);
+	int dir_count = 0;
+	int file_count = 0;
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(entries[i].name, "dir") == 0)
+			dir_count += entries[i].is_directory;
+		if (strcmp(entries[i].name, "file") == 0)
+			file_count += !entries[i].is_directory;
+	}
+	free(entries);
+	unit_check(count == 2 && dir_count == 1 && file_count == 1,
+		   "readdir of the root");
+	unit_check(ufs_readdir("missing", &entries) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "readdir of a missing dir");
+
+	unit_msg("rmdir");
+	unit_check(ufs_rmdir("dir/sub") == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_EMPTY, "non-empty dir stays");
+	unit_check(ufs_rmdir("dir/sub/file") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "rmdir of a file");
+#ifdef NEED_SNAPSHOTS
+	int snapshot = ufs_snapshot_create();
+	unit_fail_if(snapshot < 0);
+#endif
+	unit_fail_if(ufs_delete("dir/sub/file") != 0);
+	unit_check(ufs_readdir("dir/sub", &entries) == 0, "file is gone");
+	free(entries);
+	unit_check(ufs_rmdir("dir/sub") == 0 && ufs_rmdir("dir") == 0,
+		   "empty dirs are removed");
+	unit_check(ufs_open("dir/sub/file", UFS_CREATE) == -1,
+		   "removed dir has no files");
+
+#ifdef NEED_SNAPSHOTS
+	unit_fail_if(ufs_snapshot_restore(snapshot) != 0);
+	fd1 = ufs_open("dir/sub/file", 0);
+	unit_check(fd1 != -1, "restore makes the dirs of the files");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_snapshot_delete(snapshot) != 0);
+	unit_fail_if(ufs_delete("dir/sub/file") != 0);
+	unit_fail_if(ufs_rmdir("dir/sub") != 0);
+	unit_fail_if(ufs_rmdir("dir") != 0);
+#endif
+	unit_fail_if(ufs_delete("file") != 0);
 
 	unit_test_finish();
 #endif
 }
 
+static void
+test_stats(void)
+{
+#ifdef NEED_STATS
+	unit_test_start();
+
+	/* Count only the operations of this test. */
+	ufs_destroy();
+	unit_fail_if(ufs_trace_start(4) != 0);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[100] = {0};
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_pread(fd, buf, 50, 0) != 50);
+	unit_fail_if(ufs_read(fd + 1000, buf, 10) != -1);
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+
+	struct ufs_stats stats;
+	unit_fail_if(ufs_stats(&stats) != 0);
+	unit_check(stats.file_count == 1 && stats.block_count == 1 &&
+		   stats.file_bytes == 10 && stats.used_bytes == 4096 &&
+		   stats.allocated_bytes >= stats.used_bytes, "space");
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_stats(&stats) != 0);
+	unit_check(stats.file_count == 1 && stats.block_count == 1 &&
+		   stats.file_bytes == 0, "deleted opened file is counted");
+	unit_check(stats.descriptor_count == 1 &&
+		   stats.descriptor_capacity >= 1, "descriptors");
+	struct ufs_op_stats *ops = stats.ops;
+	unit_check(ops[UFS_OP_OPEN].count == 1 &&
+		   ops[UFS_OP_WRITE].count == 1 &&
+		   ops[UFS_OP_WRITE].byte_count == 100 &&
+		   ops[UFS_OP_READ].count == 2 &&
+		   ops[UFS_OP_READ].error_count == 1 &&
+		   ops[UFS_OP_READ].byte_count == 50 &&
+		   ops[UFS_OP_RESIZE].count == 1 &&
+		   ops[UFS_OP_DELETE].count == 1, "operations are counted");
+	size_t latency_count = 0;
+	for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i)
+		latency_count += ops[UFS_OP_READ].latency_buckets[i];
+	unit_check(latency_count == 2, "latencies are counted");
+
+	unit_msg("trace");
+	ufs_trace_stop();
+	unit_fail_if(ufs_close(fd) != 0);
+	int pipe_fds[2];
+	unit_fail_if(pipe(pipe_fds) != 0);
+	unit_check(ufs_trace_dump(pipe_fds[1]) == 4,
+		   "the ring keeps the last operations");
+	close(pipe_fds[1]);
+	char dump[1024];
+	ssize_t dump_size = read(pipe_fds[0], dump, sizeof(dump) - 1);
+	close(pipe_fds[0]);
+	unit_fail_if(dump_size <= 0);
+	dump[dump_size] = 0;
+	unit_check(strstr(dump, " write ") == NULL &&
+		   strstr(dump, " read fd=1000 ") != NULL &&
+		   strstr(dump, "error=1") != NULL &&
+		   strstr(dump, " delete fd=-1 size=0 result=0 error=0") !=
+		   NULL && strstr(dump, "name=file\n") != NULL,
+		   "dump has the operations in order");
+	unit_fail_if(ufs_stats(&stats) != 0);
+	unit_check(stats.file_count == 0 && stats.descriptor_count == 0,
+		   "closed file is gone");
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_async_io(void)
+{
+#ifdef NEED_ASYNC_IO
+	unit_test_start();
+
+	unit_check(ufs_ring_create(0, 0) == NULL &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "bad capacity");
+	int flags[] = {0, UFS_RING_WORKER};
+	for (int i = 0; i < 2; ++i) {
+		unit_msg(i == 0 ? "inline" : "worker");
+		struct ufs_ring *ring = ufs_ring_create(4, flags[i]);
+		unit_fail_if(ring == NULL);
+		struct ufs_cqe cqes[8];
+
+		struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_RING_OPEN;
+		sqe->filename = "file";
+		sqe->flags = UFS_CREATE;
+		unit_fail_if(ufs_ring_submit(ring) != 1);
+		unit_fail_if(ufs_ring_reap(ring, cqes, 8, 1) != 1);
+		int fd = cqes[0].result;
+		unit_fail_if(fd < 0);
+
+		/* Writes, a bad read and a positional read in a row. */
+		const char *words[] = {"abc", "def"};
+		for (int j = 0; j < 2; ++j) {
+			sqe = ufs_ring_get_sqe(ring);
+			sqe->op = UFS_RING_WRITE;
+			sqe->fd = fd;
+			sqe->data = words[j];
+			sqe->size = 3;
+			sqe->user_data = j;
+		}
+		char buf[16] = {0};
+		sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_RING_READ;
+		sqe->fd = fd + 1000;
+		sqe->buf = buf;
+		sqe->size = 6;
+		sqe->user_data = 2;
+		sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_RING_READ;
+		sqe->fd = fd;
+		sqe->buf = buf;
+		sqe->size = 6;
+		sqe->offset = 0;
+		sqe->user_data = 3;
+		unit_check(ufs_ring_get_sqe(ring) == NULL,
+			   "full ring gives no entries");
+		unit_fail_if(ufs_ring_submit(ring) != 4);
+		unit_fail_if(ufs_ring_reap(ring, cqes, 8, -1) != 4);
+		bool is_ok = true;
+		for (int j = 0; j < 4; ++j)
+			is_ok = is_ok && cqes[j].user_data == (unsigned) j;
+		unit_check(is_ok, "completions are in order");
+		unit_check(cqes[0].result == 3 && cqes[1].result == 3 &&
+			   cqes[1].error == UFS_ERR_NO_ERR, "writes");
+		unit_check(cqes[2].result == -1 &&
+			   cqes[2].error == UFS_ERR_NO_FILE, "bad descriptor");
+		unit_check(cqes[3].result == 6 &&
+			   memcmp(buf, "abcdef", 6) == 0, "read");
+		unit_check(ufs_ring_reap(ring, cqes, 8, 1) == 0,
+			   "nothing to wait for");
+
+		sqe = ufs_ring_get_sqe(ring);
+		sqe->op = UFS_RING_CLOSE;
+		sqe->fd = fd;
+		ufs_ring_submit(ring);
+		/* Destroy runs the submitted close. */
+		ufs_ring_destroy(ring);
+		unit_check(ufs_close(fd) == -1, "closed");
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/userfs_image_XXXXXX";
+	int tmp_fd = mkstemp(path);
+	unit_fail_if(tmp_fd == -1);
+	close(tmp_fd);
+	unlink(path);
+	/* The image is mounted on the first call after a destroy. */
+	ufs_destroy();
+	setenv("UFS_IMAGE", path, 1);
+	setenv("UFS_IMAGE_SIZE_MB", "16", 1);
+
+	char buffer[10000], read_buffer[60000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	int fd = ufs_open("persistent", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_pwrite(fd, "tail", 4, 50000) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+#ifdef NEED_SNAPSHOTS
+	unit_fail_if(ufs_clone("persistent", "clone") != 0);
+	fd = ufs_open("clone", 0);
+	unit_fail_if(ufs_write(fd, "clone", 5) != 5);
+	unit_fail_if(ufs_resize(fd, 6000) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	int orphan_fd = ufs_open("orphan", UFS_CREATE);
+	unit_fail_if(ufs_write(orphan_fd, buffer, 5000) != 5000);
+	unit_fail_if(ufs_delete("orphan") != 0);
+	ssize_t rc = ufs_pread(orphan_fd, read_buffer, 5000, 0);
+	unit_check(rc == 5000 && memcmp(read_buffer, buffer, rc) == 0,
+		   "deleted file is readable via its descriptor");
+#ifdef NEED_SNAPSHOTS
+	unit_check(ufs_snapshot_create() == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_IMPLEMENTED,
+		   "no snapshots of an image");
+#endif
+	ufs_destroy();
+
+	unit_msg("remount");
+	fd = ufs_open("persistent", 0);
+	unit_check(fd != -1, "file is in the image");
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_END) == 50004, "size is kept");
+	rc = ufs_pread(fd, read_buffer, sizeof(read_buffer), 0);
+	char zeros[40000] = {0};
+	unit_check(rc == 50004 && memcmp(read_buffer, buffer, 10000) == 0 &&
+		   memcmp(read_buffer + 10000, zeros, 40000) == 0 &&
+		   memcmp(read_buffer + 50000, "tail", 4) == 0,
+		   "data and the hole are kept");
+	unit_fail_if(ufs_close(fd) != 0);
+#ifdef NEED_SNAPSHOTS
+	fd = ufs_open("clone", 0);
+	rc = ufs_read(fd, read_buffer, sizeof(read_buffer));
+	unit_check(rc == 6000 && memcmp(read_buffer, "clone", 5) == 0 &&
+		   memcmp(read_buffer + 5, buffer + 5, 5995) == 0,
+		   "clone is kept apart from the source");
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_check(ufs_open("orphan", 0) == -1, "deleted file is gone");
+#ifdef NEED_BLOCK_SIZE
+	unit_check(ufs_set_block_size(8192) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "block size of an image is fixed");
+#endif
+	ufs_destroy();
+
+	unit_msg("crash of a process");
+	pid_t pid = fork();
+	unit_fail_if(pid == -1);
+	if (pid == 0) {
+		int crash_fd = ufs_open("crash", UFS_CREATE);
+		ufs_write(crash_fd, buffer, sizeof(buffer));
+		int clone_fd = ufs_open("clone", 0);
+		ufs_delete("clone");
+		ufs_write(clone_fd, buffer, sizeof(buffer));
+#ifdef NEED_ZERO_COPY_IO
+		int pinned_fd = ufs_open("pinned", UFS_CREATE);
+		ufs_write(pinned_fd, buffer, sizeof(buffer));
+		struct ufs_span spans[4];
+		struct ufs_mapping *mapping;
+		ufs_map_range(pinned_fd, 0, sizeof(buffer), spans, 4, &mapping);
+		ufs_close(pinned_fd);
+		ufs_delete("pinned");
+#endif
+		/* No ufs_close() and no ufs_destroy(). */
+		_exit(0);
+	}
+	int status;
+	unit_fail_if(waitpid(pid, &status, 0) != pid);
+	fd = ufs_open("crash", 0);
+	rc = ufs_read(fd, read_buffer, sizeof(read_buffer));
+	unit_check(rc == sizeof(buffer) &&
+		   memcmp(read_buffer, buffer, rc) == 0,
+		   "file of the crashed process is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("clone", 0) == -1,
+		   "file deleted by the crashed process is gone");
+	unit_fail_if(ufs_delete("crash") != 0);
+	unit_fail_if(ufs_delete("persistent") != 0);
+#ifdef NEED_DEDUP
+	struct ufs_space_stats stats;
+	unit_fail_if(ufs_get_space_stats(&stats) != 0);
+	unit_check(stats.block_count == 0,
+		   "blocks of the crashed process are freed");
+#endif
+
+	ufs_destroy();
+	unsetenv("UFS_IMAGE");
+	unsetenv("UFS_IMAGE_SIZE_MB");
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -454,6 +1259,16 @@ main(void)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_positional_io();
+	test_zero_copy_io();
+	test_block_size();
+	test_multithreading();
+	test_clone_and_snapshot();
+	test_dedup();
+	test_directories();
+	test_stats();
+	test_async_io();
+	test_image();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
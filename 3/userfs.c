@@ -1,12 +1,45 @@
 #include "userfs.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The FS is thread-safe. Names are split into shards with a lock
+ * each, so lookups of different names rarely meet. Every file has
+ * a reader-writer lock, so readers of the same file don't
+ * serialize, and every descriptor has a mutex for its position.
+ * The descriptor table and the block pool have a lock each. Locks
+ * are taken in this order: image, snapshot table, shard,
+ * descriptor, file, then the descriptor table or the block pool.
+ *
+ * ufs_destroy() and ufs_set_block_size() are not supposed to run
+ * concurrently with anything else, neither is ufs_close() with
+ * other calls on the same descriptor.
+ */
 
 enum {
-    BLOCK_SIZE = 512,
+    DEFAULT_BLOCK_SIZE = 4096,
+    MIN_BLOCK_SIZE = 512,
+    MAX_BLOCK_SIZE = 1024 * 1024,
+    /** Blocks are allocated in slabs of at least this size. */
+    SLAB_SIZE = 1024 * 1024,
     MAX_FILE_SIZE = 1024 * 1024 * 100,
+    /** Name shards are chosen by the upper bits of the name hash. */
+    NAME_SHARD_BITS = 6,
+    NAME_SHARD_COUNT = 1 << NAME_SHARD_BITS,
 };
 
 const int NONE = -1;
@@ -31,85 +64,539 @@ bool specific_flag_is_present(int flags, int specific_flag) {
     return (flags & specific_flag) != 0;
 }
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
+/**
+ * Block header and data come from the block pool, or the data is
+ * in the image in image mode. A block can be shared by clones and
+ * snapshots of a file and by files with the same content, so it is
+ * copied before a write if it has other references.
+ */
 struct block {
-    /** Block memory. */
-    char *memory;
-    /** How many bytes are occupied. */
-    int occupied;
-    /** Next block in the file. */
-    struct block *next;
-    /** Previous block in the file. */
-    struct block *prev;
-
-    /* PUT HERE OTHER MEMBERS */
-    int index;
+    /** Next block in the free list of the pool. Valid only for free blocks. */
+    struct block *next_free;
+    /** How many files and snapshots refer to the block. */
+    atomic_int refs;
+    /**
+     * How many mappings pin the block. A pinned block is copied before a write like a shared one, and is freed
+     * only when the last pin is gone.
+     */
+    atomic_int pins;
+    /** Block memory of block_size bytes. NULL while the block is compressed. */
+    char *_Atomic memory;
+    /** Compressed data of a cold block, see ufs_compress_cold_blocks(). */
+    char *compressed;
+    int compressed_size;
+    /** The block was used since the last compression of cold blocks. */
+    atomic_bool is_hot;
+    /** A sealed block is in the content table, so it is never written in place. */
+    bool is_sealed;
+    /** Number of the block in the image. Valid only in image mode. */
+    uint32_t image_number;
+    uint64_t content_hash;
 };
 
+/** The shared zero block. Holes of all files read from it and holes of mappings point to it. */
+static char zero_memory[MAX_BLOCK_SIZE];
+
+/** Block size of the FS. Always a power of two, so offsets are split with shifts and masks. */
+static int block_size = DEFAULT_BLOCK_SIZE;
+static int block_size_log2 = 12;
+
+/**
+ * Pool of blocks. Headers and memory of blocks are carved out of
+ * big slabs apart, so a compressed block gives its memory back and
+ * keeps the header. Freed headers and memory go to free lists to be
+ * reused by next allocations. Slabs are freed only when the FS is
+ * destroyed or the block size changes.
+ */
+static char **slabs = NULL;
+static int slab_count = 0;
+static int slab_capacity = 0;
+static size_t slab_byte_count = 0;
+static struct block *free_blocks = NULL;
+/** Free block memory. Each piece keeps the pointer to the next one in its first bytes. */
+static char *free_memory = NULL;
+static pthread_mutex_t block_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Blocks of the heap which are in use, and how many of them are compressed into how many bytes. */
+static size_t used_block_count = 0;
+static size_t compressed_block_count = 0;
+static size_t compressed_byte_count = 0;
+
+/** Files which are not deleted yet, including deleted ones with opened descriptors. */
+static atomic_int live_file_count = 0;
+
 struct file {
-    /** Double-linked list of file blocks. */
-    struct block *block_list;
     /**
-     * Last block in the list above for fast access to the end
-     * of file.
+     * Index of file blocks: block i keeps bytes starting from
+     * i * block_size, so any offset is found in O(1). NULL is a
+     * hole which reads as zeros. Bytes of the blocks beyond the
+     * file size are always zeros, so the file can grow without
+     * touching them.
+     */
+    struct block **blocks;
+    /**
+     * Length of the index. It ends at the last written block, the
+     * rest of the file up to its size is a hole, so growing a file
+     * is O(1) and blocks appear only on the first write to them.
      */
-    struct block *last_block;
+    int block_count;
+    int block_capacity;
+    /** File size in bytes. */
+    int size;
     /** How many file descriptors are opened on the file. */
     int refs;
     /** File name. */
     char *name;
-    /** Files are stored in a double-linked list. */
+    /** Files of a name shard are stored in a double-linked list. */
     struct file *next;
     struct file *prev;
 
     /* PUT HERE OTHER MEMBERS */
 
+    /** Protects everything above except the name. */
+    pthread_rwlock_t lock;
+
+    /** Double-linked list of the descriptors opened on the file. */
+    struct filedesc *descriptor_list;
+
     bool marked_for_deletion;
+    /** Cached hash of the name for the name shard index. */
+    unsigned int name_hash;
+
+    /** Number of the inode in the image, NONE when the FS is on the heap. */
+    int inode;
+    /** Copy of the inode index_root and of the root index block. */
+    uint32_t index_root;
+    uint32_t *index_blocks;
+};
+
+struct name_shard {
+    pthread_mutex_t lock;
+    /** List of the files of the shard. */
+    struct file *file_list;
+    /**
+     * Hash index of the files from file_list by name: open addressing with
+     * linear probing. Deleted files which still have opened descriptors are not
+     * here, so a new file with the same name can be created.
+     */
+    struct file **file_index;
+    int file_index_capacity;
+    int file_index_count;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+static struct name_shard name_shards[NAME_SHARD_COUNT] = {
+        [0 ... NAME_SHARD_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}
+};
 
 struct filedesc {
     struct file *file;
 
     /* PUT HERE OTHER MEMBERS */
     int index;
+    /** Descriptors of the same file are linked into a list. */
+    struct filedesc *next_on_file;
+    struct filedesc *prev_on_file;
 
-    struct block *current_block;
-    int block_offset;
+    /** Offset of the next read or write in the file. */
+    int position;
+    /** Serializes ufs_read(), ufs_write() and ufs_lseek() on the descriptor. */
+    pthread_mutex_t position_lock;
 
     int flags;
 };
 
-struct file *try_get_file_by_filename(char *filename) {
-    struct file *ptr = file_list;
-    while (ptr != NULL) {
-        if (strings_equal(ptr->name, filename))
-            return ptr;
-        ptr = ptr->next;
+unsigned int get_name_hash(const char *name) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const char *ptr = name; *ptr != '\0'; ++ptr) {
+        hash ^= (unsigned char) *ptr;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct name_shard *get_name_shard(unsigned int name_hash) {
+    return &name_shards[name_hash >> (32 - NAME_SHARD_BITS)];
+}
+
+int get_file_index_mask(const struct name_shard *shard) {
+    return shard->file_index_capacity - 1;
+}
+
+void insert_into_file_index_without_growth(struct name_shard *shard, struct file *file) {
+    int slot = (int) (file->name_hash & get_file_index_mask(shard));
+    while (shard->file_index[slot] != NULL)
+        slot = (slot + 1) & get_file_index_mask(shard);
+    shard->file_index[slot] = file;
+    shard->file_index_count++;
+}
+
+void index_file(struct name_shard *shard, struct file *file) {
+    const int INITIAL_CAPACITY = 16;
+    // Keep the load factor under 1/2, so the probe chains stay short
+    if ((shard->file_index_count + 1) * 2 > shard->file_index_capacity) {
+        struct file **old_index = shard->file_index;
+        int old_capacity = shard->file_index_capacity;
+        shard->file_index_capacity = old_capacity == 0 ? INITIAL_CAPACITY : old_capacity * 2;
+        shard->file_index = calloc(shard->file_index_capacity, sizeof(struct file *));
+        shard->file_index_count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_index[i] != NULL)
+                insert_into_file_index_without_growth(shard, old_index[i]);
+        }
+        free(old_index);
+    }
+    insert_into_file_index_without_growth(shard, file);
+}
+
+/** Home slot of the entry in @a slot of an open addressing table, or NONE if the slot is empty. */
+typedef int (*get_home_slot_f)(const void *table, int slot, int mask);
+/** Moves the entry of slot @a from to slot @a to, or empties @a to if @a from is NONE. */
+typedef void (*move_slot_f)(void *table, int to, int from);
+
+/**
+ * Backward shift deletion from an open addressing table with linear probing, so no tombstones are needed. Empties the
+ * @a hole and moves back the entries after it, which would not be found past the hole anymore.
+ */
+void backward_shift_delete(void *table, int mask, int hole, get_home_slot_f get_home, move_slot_f move) {
+    for (int next = (hole + 1) & mask;; next = (next + 1) & mask) {
+        int home = get_home(table, next, mask);
+        if (home == NONE)
+            break;
+        bool home_is_cyclically_in_hole_next_range = hole <= next ? (hole < home && home <= next)
+                                                                  : (hole < home || home <= next);
+        if (home_is_cyclically_in_hole_next_range)
+            continue;
+        move(table, hole, next);
+        hole = next;
+    }
+    move(table, hole, NONE);
+}
+
+int get_file_index_home(const void *table, int slot, int mask) {
+    struct file *file = ((struct file *const *) table)[slot];
+    return file == NULL ? NONE : (int) (file->name_hash & mask);
+}
+
+void move_file_index_slot(void *table, int to, int from) {
+    struct file **file_index = table;
+    file_index[to] = from == NONE ? NULL : file_index[from];
+}
+
+/** No-op if the file is not indexed. */
+void unindex_file(struct name_shard *shard, struct file *file) {
+    if (shard->file_index_count == 0)
+        return;
+    struct file **file_index = shard->file_index;
+    int mask = get_file_index_mask(shard);
+    int hole = (int) (file->name_hash & mask);
+    while (file_index[hole] != file) {
+        if (file_index[hole] == NULL)
+            return;
+        hole = (hole + 1) & mask;
+    }
+    backward_shift_delete(file_index, mask, hole, get_file_index_home, move_file_index_slot);
+    shard->file_index_count--;
+}
+
+/** The shard must be locked. */
+struct file *try_get_file_by_filename(struct name_shard *shard, unsigned int hash, const char *filename) {
+    if (shard->file_index_count == 0)
+        return NULL;
+    struct file **file_index = shard->file_index;
+    int mask = get_file_index_mask(shard);
+    for (int slot = (int) (hash & mask); file_index[slot] != NULL; slot = (slot + 1) & mask) {
+        if (file_index[slot]->name_hash == hash && strcmp(file_index[slot]->name, filename) == 0)
+            return file_index[slot];
     }
     return NULL;
 }
 
+/*
+ * Directories. A path is names joined by '/', the files with no '/' in their names are in the root. Files are
+ * found by the whole path in the name shards, so opening a file costs the same at any depth. Each directory keeps
+ * the names of its files and subdirectories in its own hash index: it checks that the parent of a new file exists,
+ * lists the directory and tells if it is empty. Directories are in memory only, an image keeps flat names where '/'
+ * is just a character.
+ */
+
+struct directory_entry {
+    /** NULL in a free slot. */
+    char *name;
+    unsigned int name_hash;
+    /** NULL for a file. */
+    struct directory *directory;
+};
+
+struct directory {
+    /** Paths are resolved locking the directories from the root down, a parent before its child. */
+    pthread_rwlock_t lock;
+    /** Entries by name: open addressing with linear probing, like the name shards. */
+    struct directory_entry *entries;
+    int entry_capacity;
+    int entry_count;
+};
+
+static struct directory root_directory = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+int throw_error(int specific_error);
+
+/** Like get_name_hash(), but of the first @a length bytes of @a name. */
+unsigned int get_component_hash(const char *name, size_t length) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Names in the path are not empty: it doesn't start or end with '/' and has no "//". */
+bool is_valid_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/')
+        return false;
+    for (const char *ptr = path; *ptr != '\0'; ++ptr) {
+        if (*ptr == '/' && (ptr[1] == '/' || ptr[1] == '\0'))
+            return false;
+    }
+    return true;
+}
+
+int get_entry_mask(const struct directory *directory) {
+    return directory->entry_capacity - 1;
+}
+
+/** Slot of the entry with the name, or the free slot where it would be. */
+int find_entry_slot(const struct directory *directory, const char *name, size_t length, unsigned int hash) {
+    int mask = get_entry_mask(directory);
+    int slot = (int) (hash & mask);
+    for (; directory->entries[slot].name != NULL; slot = (slot + 1) & mask) {
+        const struct directory_entry *entry = &directory->entries[slot];
+        if (entry->name_hash == hash && strncmp(entry->name, name, length) == 0 && entry->name[length] == '\0')
+            break;
+    }
+    return slot;
+}
+
+/** The directory must be locked. */
+struct directory_entry *find_entry(struct directory *directory, const char *name, size_t length) {
+    if (directory->entry_count == 0)
+        return NULL;
+    int slot = find_entry_slot(directory, name, length, get_component_hash(name, length));
+    return directory->entries[slot].name != NULL ? &directory->entries[slot] : NULL;
+}
+
+void insert_entry_without_growth(struct directory *directory, struct directory_entry entry) {
+    int slot = (int) (entry.name_hash & get_entry_mask(directory));
+    while (directory->entries[slot].name != NULL)
+        slot = (slot + 1) & get_entry_mask(directory);
+    directory->entries[slot] = entry;
+    directory->entry_count++;
+}
+
+/** The directory must be locked for writing and have no entry with the name. */
+void add_entry(struct directory *directory, const char *name, struct directory *subdirectory) {
+    const int INITIAL_CAPACITY = 8;
+    // Keep the load factor under 1/2, so the probe chains stay short
+    if ((directory->entry_count + 1) * 2 > directory->entry_capacity) {
+        struct directory_entry *old_entries = directory->entries;
+        int old_capacity = directory->entry_capacity;
+        directory->entry_capacity = old_capacity == 0 ? INITIAL_CAPACITY : old_capacity * 2;
+        directory->entries = calloc(directory->entry_capacity, sizeof(struct directory_entry));
+        directory->entry_count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_entries[i].name != NULL)
+                insert_entry_without_growth(directory, old_entries[i]);
+        }
+        free(old_entries);
+    }
+    insert_entry_without_growth(directory, (struct directory_entry) {
+            .name = strdup(name),
+            .name_hash = get_component_hash(name, strlen(name)),
+            .directory = subdirectory
+    });
+}
+
+int get_entry_home(const void *table, int slot, int mask) {
+    const struct directory_entry *entry = &((const struct directory_entry *) table)[slot];
+    return entry->name == NULL ? NONE : (int) (entry->name_hash & mask);
+}
+
+void move_entry_slot(void *table, int to, int from) {
+    struct directory_entry *entries = table;
+    if (from == NONE)
+        entries[to].name = NULL;
+    else
+        entries[to] = entries[from];
+}
+
+/** The directory must be locked for writing. */
+void remove_entry(struct directory *directory, struct directory_entry *entry) {
+    free(entry->name);
+    backward_shift_delete(directory->entries, get_entry_mask(directory), (int) (entry - directory->entries),
+                          get_entry_home, move_entry_slot);
+    directory->entry_count--;
+}
+
+void lock_directory(struct directory *directory, bool is_for_writing) {
+    if (is_for_writing)
+        pthread_rwlock_wrlock(&directory->lock);
+    else
+        pthread_rwlock_rdlock(&directory->lock);
+}
+
+/**
+ * Finds the directory where the last name of the valid @a path is, and points @a name to that name. Directories on
+ * the way are read-locked hand over hand, so none of them is removed meanwhile. The found one stays locked, for
+ * writing if @a is_for_writing. Returns NULL if some directory on the path doesn't exist.
+ */
+struct directory *lock_parent_directory(const char *path, bool is_for_writing, const char **name) {
+    struct directory *directory = &root_directory;
+    const char *slash = strchr(path, '/');
+    lock_directory(directory, is_for_writing && slash == NULL);
+    while (slash != NULL) {
+        struct directory_entry *entry = find_entry(directory, path, slash - path);
+        if (entry == NULL || entry->directory == NULL) {
+            pthread_rwlock_unlock(&directory->lock);
+            return NULL;
+        }
+        path = slash + 1;
+        slash = strchr(path, '/');
+        lock_directory(entry->directory, is_for_writing && slash == NULL);
+        pthread_rwlock_unlock(&directory->lock);
+        directory = entry->directory;
+    }
+    *name = path;
+    return directory;
+}
+
+/** Adds the entry of a new file to its directory. Returns false and sets the error code on failure. */
+bool add_file_entry(const char *path) {
+    if (!is_valid_path(path)) {
+        throw_error(UFS_ERR_INVALID_ARGUMENT);
+        return false;
+    }
+    const char *name;
+    struct directory *directory = lock_parent_directory(path, true, &name);
+    if (directory == NULL) {
+        throw_error(UFS_ERR_NO_FILE);
+        return false;
+    }
+    // The files of the directory are not here, their shards were checked. But there may be a subdirectory
+    bool is_added = find_entry(directory, name, strlen(name)) == NULL;
+    if (is_added)
+        add_entry(directory, name, NULL);
+    else
+        throw_error(UFS_ERR_EXISTS);
+    pthread_rwlock_unlock(&directory->lock);
+    return is_added;
+}
+
+void remove_file_entry(const char *path) {
+    const char *name;
+    struct directory *directory = lock_parent_directory(path, true, &name);
+    // A directory with files can't be removed, so it is there
+    remove_entry(directory, find_entry(directory, name, strlen(name)));
+    pthread_rwlock_unlock(&directory->lock);
+}
+
+/** Makes the missing directories on the way to a file. */
+void make_parent_directories(const char *path) {
+    char *prefix = strdup(path);
+    for (char *slash = strchr(prefix, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        bool exists = ufs_mkdir(prefix) == 0 || ufs_errno() == UFS_ERR_EXISTS;
+        *slash = '/';
+        if (!exists)
+            break;
+    }
+    free(prefix);
+}
+
+/** Frees the subdirectories and the entries. Nobody must use the directory. */
+void destroy_directory(struct directory *directory) {
+    for (int i = 0; i < directory->entry_capacity; ++i) {
+        struct directory_entry *entry = &directory->entries[i];
+        if (entry->name == NULL)
+            continue;
+        if (entry->directory != NULL) {
+            destroy_directory(entry->directory);
+            pthread_rwlock_destroy(&entry->directory->lock);
+            free(entry->directory);
+        }
+        free(entry->name);
+    }
+    free(directory->entries);
+    directory->entries = NULL;
+    directory->entry_capacity = 0;
+    directory->entry_count = 0;
+}
+
+struct snapshot_file {
+    char *name;
+    unsigned int name_hash;
+    /** Shared blocks of the file at the moment of the snapshot. */
+    struct block **blocks;
+    int block_count;
+    int size;
+};
+
+/** Files of the whole FS. Shares all the blocks with them, so it costs only metadata until the files change. */
+struct snapshot {
+    struct snapshot_file *files;
+    int file_count;
+    int file_capacity;
+};
+
+/** Snapshots by id. A deleted snapshot leaves NULL. */
+static struct snapshot **snapshots = NULL;
+static int snapshot_count = 0;
+static int snapshot_capacity = 0;
+static int live_snapshot_count = 0;
+#ifdef NEED_SNAPSHOTS
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/**
+ * A slot of the file descriptor table. An empty slot is a part of the
+ * free slot stack and keeps the index of the next free slot, so ufs_open()
+ * takes a slot in O(1) instead of scanning the table.
+ */
+struct filedesc_slot {
+    /** NULL when the slot is free. */
+    struct filedesc *descriptor;
+    /** Next free slot in the stack, NONE at its bottom. */
+    int next_free;
+};
+
 /**
  * An array of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
+ * closed, its slot is pushed to the free slot stack and is
  * taken by next ufs_open() call.
  */
-static struct filedesc **file_descriptors = NULL;
+static struct filedesc_slot *file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
+/** Top of the free slot stack. */
+static int free_file_descriptor_slot = NONE;
+static int open_file_descriptor_count = 0;
+static pthread_rwlock_t file_descriptor_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-int try_get_empty_file_descriptor_slot() {
-    for (int i = 0; i < file_descriptor_count; ++i) {
-        if (file_descriptors[i] == NULL)
-            return i;
-    }
-    return NONE;
+int pop_free_file_descriptor_slot() {
+    int slot = free_file_descriptor_slot;
+    if (slot != NONE)
+        free_file_descriptor_slot = file_descriptors[slot].next_free;
+    return slot;
+}
+
+void push_free_file_descriptor_slot(int slot) {
+    file_descriptors[slot].descriptor = NULL;
+    file_descriptors[slot].next_free = free_file_descriptor_slot;
+    free_file_descriptor_slot = slot;
 }
 
 int add_file_descriptor_at_the_end(struct filedesc *descriptor) {
@@ -117,15 +604,18 @@ int add_file_descriptor_at_the_end(struct filedesc *descriptor) {
     if (file_descriptors == NULL) {
         file_descriptor_capacity = 1;
         file_descriptor_count = 0;
-        file_descriptors = malloc(sizeof(struct filedesc *));
+        file_descriptors = malloc(sizeof(struct filedesc_slot));
     }
     if (file_descriptor_capacity == file_descriptor_count) {
         file_descriptor_capacity *= GROWTH_FACTOR;
-        file_descriptors = realloc(file_descriptors, sizeof(struct filedesc *) * file_descriptor_capacity);
+        file_descriptors = realloc(file_descriptors, sizeof(struct filedesc_slot) * file_descriptor_capacity);
     }
 
     int file_descriptor_index = file_descriptor_count;
-    file_descriptors[file_descriptor_index] = descriptor;
+    file_descriptors[file_descriptor_index] = (struct filedesc_slot) {
+            .descriptor = descriptor,
+            .next_free = NONE
+    };
     descriptor->index = file_descriptor_index;
 
     file_descriptor_count++;
@@ -134,63 +624,112 @@ int add_file_descriptor_at_the_end(struct filedesc *descriptor) {
 }
 
 int add_file_descriptor(struct filedesc *descriptor) {
-    int file_descriptor_index = try_get_empty_file_descriptor_slot();
+    pthread_rwlock_wrlock(&file_descriptor_lock);
+    int file_descriptor_index = pop_free_file_descriptor_slot();
     if (file_descriptor_index != NONE) {
         descriptor->index = file_descriptor_index;
-        file_descriptors[file_descriptor_index] = descriptor;
-        return file_descriptor_index;
+        file_descriptors[file_descriptor_index].descriptor = descriptor;
+    } else {
+        file_descriptor_index = add_file_descriptor_at_the_end(descriptor);
     }
-    return add_file_descriptor_at_the_end(descriptor);
+    open_file_descriptor_count++;
+    pthread_rwlock_unlock(&file_descriptor_lock);
+    return file_descriptor_index;
+}
+
+void remove_file_descriptor(struct filedesc *descriptor) {
+    pthread_rwlock_wrlock(&file_descriptor_lock);
+    push_free_file_descriptor_slot(descriptor->index);
+    open_file_descriptor_count--;
+    pthread_rwlock_unlock(&file_descriptor_lock);
 }
 
 struct filedesc *try_get_file_descriptor(int index) {
-    if (index < 0 || index >= file_descriptor_count)
-        return NULL;
-    return file_descriptors[index];
+    struct filedesc *descriptor = NULL;
+    pthread_rwlock_rdlock(&file_descriptor_lock);
+    if (index >= 0 && index < file_descriptor_count)
+        descriptor = file_descriptors[index].descriptor;
+    pthread_rwlock_unlock(&file_descriptor_lock);
+    return descriptor;
+}
+
+void link_descriptor_to_file(struct filedesc *descriptor) {
+    struct file *file = descriptor->file;
+    descriptor->prev_on_file = NULL;
+    descriptor->next_on_file = file->descriptor_list;
+    if (file->descriptor_list != NULL)
+        file->descriptor_list->prev_on_file = descriptor;
+    file->descriptor_list = descriptor;
+}
+
+void unlink_descriptor_from_file(struct filedesc *descriptor) {
+    struct file *file = descriptor->file;
+    if (descriptor == file->descriptor_list)
+        file->descriptor_list = descriptor->next_on_file;
+    if (descriptor->prev_on_file != NULL)
+        descriptor->prev_on_file->next_on_file = descriptor->next_on_file;
+    if (descriptor->next_on_file != NULL)
+        descriptor->next_on_file->prev_on_file = descriptor->prev_on_file;
 }
 
 void delete_file(struct file *file);
 
 void close_file_descriptor(struct filedesc *descriptor) {
+    remove_file_descriptor(descriptor);
     struct file *file = descriptor->file;
+    pthread_rwlock_wrlock(&file->lock);
+    unlink_descriptor_from_file(descriptor);
     file->refs--;
-    if (file->marked_for_deletion && file->refs == 0)
+    // ufs_delete() marks the file under the same lock, so only one of them sees it is the last reference
+    bool is_last_reference_to_deleted_file = file->marked_for_deletion && file->refs == 0;
+    pthread_rwlock_unlock(&file->lock);
+    if (is_last_reference_to_deleted_file)
         delete_file(file);
-    file_descriptors[descriptor->index] = NULL;
+    pthread_mutex_destroy(&descriptor->position_lock);
     free(descriptor);
 }
 
-struct file *create_file(const char *filename) {
-    struct block *first_block = malloc(sizeof(struct block));
-    *first_block = (struct block) {
+/** Makes an empty file which is not in any name shard. */
+struct file *allocate_file(const char *filename, unsigned int name_hash) {
+    struct file *file = malloc(sizeof(struct file));
+    *file = (struct file) {
             .next = NULL,
-            .prev = NULL,
-            .index = 0,
-            .memory = malloc(sizeof(char) * BLOCK_SIZE),
-            .occupied = 0
-    };
-
-    struct file *new_file_list = malloc(sizeof(struct file));
-    *new_file_list = (struct file) {
-            .next = file_list,
             .name = strdup(filename),
             .prev = NULL,
-            .block_list = first_block,
-            .last_block = first_block,
+            .blocks = NULL,
+            .block_count = 0,
+            .block_capacity = 0,
+            .size = 0,
             .refs = 0,
-            .marked_for_deletion = false
+            .descriptor_list = NULL,
+            .marked_for_deletion = false,
+            .name_hash = name_hash,
+            .inode = NONE,
+            .index_root = 0,
+            .index_blocks = NULL
     };
+    pthread_rwlock_init(&file->lock, NULL);
+    live_file_count++;
+    return file;
+}
 
-    if (file_list != NULL) {
-        file_list->prev = new_file_list;
+/** The shard must be locked. */
+struct file *create_file(struct name_shard *shard, const char *filename, unsigned int name_hash) {
+    struct file *new_file_list = allocate_file(filename, name_hash);
+    new_file_list->next = shard->file_list;
+    if (shard->file_list != NULL) {
+        shard->file_list->prev = new_file_list;
     }
-    file_list = new_file_list;
+    shard->file_list = new_file_list;
+    index_file(shard, new_file_list);
     return new_file_list;
 }
 
-void disconnect_file_from_file_list(struct file *file) {
-    if (file == file_list)
-        file_list = file->next;
+/** The shard must be locked. */
+void disconnect_file_from_file_list(struct name_shard *shard, struct file *file) {
+    unindex_file(shard, file);
+    if (file == shard->file_list)
+        shard->file_list = file->next;
 
     if (file->prev != NULL)
         file->prev->next = file->next;
@@ -201,210 +740,2901 @@ void disconnect_file_from_file_list(struct file *file) {
     file->next = NULL;
 }
 
-void delete_file(struct file *file) {
-    disconnect_file_from_file_list(file);
-    free(file->name);
-    struct block *ptr = file->block_list;
-    while (ptr != NULL) {
-        free(ptr->memory);
-        struct block *next = ptr->next;
-        free(ptr);
-        ptr = next;
-    }
-    free(file);
+int get_block_count_for_size(int size) {
+    return (size + block_size - 1) >> block_size_log2;
 }
 
-enum ufs_error_code
-ufs_errno() {
-    return ufs_error_code;
+/*
+ * Image mode. With UFS_IMAGE=<path> in the environment the FS lives in that file mapped into memory, so the files
+ * survive the process. The image is created on first use with UFS_IMAGE_SIZE_MB megabytes of data blocks (256 by
+ * default, the file is sparse). Its parts are aligned to the block size:
+ *
+ *     superblock | journal | block bitmap | block refs | inodes | name table | data blocks
+ *
+ * A mount maps the image, replays the journal and frees what the orphan lists name, so its time doesn't depend on the
+ * image size. Nothing is copied out of the image: the bitmap, the reference counts, the free block count and the name
+ * table are used right in the mapping. Files are loaded on their first open, and a block gets an in-memory header
+ * only when a loaded file or a mapping needs it. File data is read and written right in the mapping too.
+ *
+ * Metadata - the bitmap, the reference counts, the inodes, the name table and the index blocks of the files - changes
+ * only through the journal: every call changing it is a transaction which is written to the journal first and copied
+ * to its place in the image after that. Until then the words changed by the transaction are looked up in a small
+ * table, see image_read_word(). A transaction found in the journal on mount is replayed, a torn one fails its
+ * checksum and is dropped. A transaction is never split: the journal has room for the biggest call, a call which
+ * could take more is refused before it changes anything, and the calls doing several writes in a row commit between
+ * them when the room runs out. With UFS_IMAGE_SYNC=1 the journal and the image are also synced to the disk on every
+ * commit, so the FS survives a power loss, not only a crash of the process.
+ *
+ * In image mode metadata changes are serialized with the image lock, which is taken before any other lock.
+ * Snapshots live in memory only, so they are not supported there, and the block size is at least
+ * IMAGE_MIN_BLOCK_SIZE, so the two-level index of a file covers MAX_FILE_SIZE.
+ */
+
+enum {
+    IMAGE_MIN_BLOCK_SIZE = 4096,
+    IMAGE_DEFAULT_SIZE_MB = 256,
+    IMAGE_MAX_NAME_LENGTH = 255,
+    /** Least size of the journal. It is bigger on the images where one call can take more, see
+     * get_image_max_transaction_size(). */
+    IMAGE_JOURNAL_SIZE = 8 * 1024 * 1024,
+    /** Inode, orphan list and superblock changes of one call. */
+    IMAGE_MAX_INODE_RECORDS = 16,
+    /** A journal record is its offset in the image and length, then the data. */
+    IMAGE_RECORD_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t),
+};
+
+/** "UFSIMG02" */
+static const uint64_t IMAGE_MAGIC = 0x3230474d49534655ull;
+/** "UFSJRNL1" */
+static const uint64_t IMAGE_JOURNAL_MAGIC = 0x314c4e524a534655ull;
+
+struct image_superblock {
+    uint64_t magic;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    /** Power of two. */
+    uint32_t name_table_capacity;
+    /** First of the deleted files which still had descriptors, NONE if there are none. */
+    int32_t orphan_head;
+    uint32_t free_block_count;
+    uint64_t journal_offset;
+    uint64_t bitmap_offset;
+    uint64_t refs_offset;
+    uint64_t inode_offset;
+    uint64_t name_table_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    /**
+     * Number + 1 of the first block which lost its last reference while pinned by a mapping, 0 if there are none.
+     * The reference count of such a block keeps the number + 1 of the next one instead.
+     */
+    uint32_t pinned_orphan_head;
+    uint32_t reserved;
+};
+
+struct image_inode {
+    uint32_t is_used;
+    uint32_t size;
+    /**
+     * Number + 1 of the root index block, 0 if the file has no blocks. The root keeps numbers + 1 of index blocks,
+     * and they keep numbers + 1 of the data blocks, 0 for a hole.
+     */
+    uint32_t index_root;
+    /** Next in the orphan list. */
+    int32_t next_orphan;
+    char name[IMAGE_MAX_NAME_LENGTH + 1];
+};
+
+struct image_journal_header {
+    uint64_t magic;
+    uint64_t record_bytes;
+    uint64_t checksum;
+};
+
+struct image_dirty_word {
+    uint64_t offset;
+    uint32_t value;
+};
+
+struct image {
+    int fd;
+    char *base;
+    size_t size;
+    bool is_synchronous;
+    struct image_superblock *superblock;
+    /**
+     * Headers of the blocks of the loaded files and mappings by the block number, open addressing. Their memory
+     * points into the image, refs mirror the image ones. A header is made on first use and goes away with the block.
+     */
+    struct block **loaded_blocks;
+    int loaded_block_count;
+    int loaded_block_capacity;
+    /**
+     * Words of the bitmap, the reference counts, the name table and the superblock changed by the running
+     * transaction. Open addressing by the offset in the image, 0 is an empty slot.
+     */
+    struct image_dirty_word *dirty_words;
+    int dirty_word_count;
+    int dirty_word_capacity;
+    int free_word_hint;
+    int free_inode_hint;
+    /** The running transaction: space for the header, then the records. */
+    char *journal;
+    size_t journal_size;
+    /** Size of the journal in the image, the header included. */
+    size_t journal_capacity;
+    size_t max_transaction_size;
+    /** Offset of the last record in the journal, so writes to adjacent bytes merge into it. 0 if none. */
+    size_t last_record;
+    char *zeros;
+};
+
+/** NULL when the FS is on the heap. */
+static struct image *image = NULL;
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t *get_image_refs() {
+    return (uint32_t *) (image->base + image->superblock->refs_offset);
 }
 
-int throw_error(int specific_error) {
-    ufs_error_code = specific_error;
-    return -1;
+uint32_t *get_image_bitmap() {
+    return (uint32_t *) (image->base + image->superblock->bitmap_offset);
 }
 
-int
-ufs_open(const char *filename, int flags) {
-    struct file *referred_file = try_get_file_by_filename((char *) filename);
-    if (referred_file == NULL) {
-        if (!specific_flag_is_present(flags, UFS_CREATE))
-            return throw_error(UFS_ERR_NO_FILE);
-        referred_file = create_file(filename);
-    }
-    struct filedesc *file_descriptor = malloc(sizeof(struct filedesc));
-    *file_descriptor = (struct filedesc) {
-            .file = referred_file,
-            .current_block = referred_file->block_list,
-            .block_offset = 0,
-            .flags = flags
-    };
+/** Entries are inode numbers + 1, 0 for an empty slot. */
+uint32_t *get_image_name_table() {
+    return (uint32_t *) (image->base + image->superblock->name_table_offset);
+}
 
-    referred_file->refs++;
+struct image_inode *get_image_inode(int number) {
+    return (struct image_inode *) (image->base + image->superblock->inode_offset) + number;
+}
 
-    return add_file_descriptor(file_descriptor);
+uint32_t *get_image_block_words(uint32_t number) {
+    return (uint32_t *) (image->base + image->superblock->data_offset + ((size_t) number << block_size_log2));
 }
 
-void write_single_byte(struct filedesc *descriptor, char byte) {
-    descriptor->current_block->memory[descriptor->block_offset] = byte;
-    if (descriptor->file->last_block == descriptor->current_block
-        && descriptor->block_offset == (descriptor->file->last_block->occupied)) {
-        descriptor->file->last_block->occupied++;
-    }
+uint32_t get_image_block_number(const struct block *block) {
+    return block->image_number;
 }
 
-char read_single_byte(struct filedesc *descriptor) {
-    return descriptor->current_block->memory[descriptor->block_offset];
+int get_index_entries_per_block() {
+    return block_size / (int) sizeof(uint32_t);
 }
 
-void advance_descriptor(struct filedesc *descriptor) {
-    descriptor->block_offset++;
-    if (descriptor->block_offset == BLOCK_SIZE) {
-        struct block *next_block = descriptor->current_block->next;
-        if (next_block == NULL) {
-            // last in file, so we create new
-            next_block = malloc(sizeof(struct block));
-            *next_block = (struct block) {
-                    .next = NULL,
-                    .prev = descriptor->current_block,
-                    .index = descriptor->current_block->index + 1,
-                    .memory = malloc(sizeof(char) * BLOCK_SIZE),
-                    .occupied = 0
-            };
-            descriptor->current_block->next = next_block;
-            descriptor->file->last_block = next_block;
-        }
-        descriptor->current_block = next_block;
-        descriptor->block_offset = 0;
-    }
+/**
+ * Upper bound of the journal taken by one call. The biggest one is a clone over a file, which drops the blocks of
+ * one file of MAX_FILE_SIZE and references the blocks of another, and a delete can shift the whole name table.
+ */
+size_t get_image_max_transaction_size(const struct image_superblock *superblock) {
+    size_t small_record_size = IMAGE_RECORD_HEADER_SIZE + sizeof(uint32_t);
+    size_t entries_per_block = superblock->block_size / sizeof(uint32_t);
+    size_t block_count = MAX_FILE_SIZE / superblock->block_size + 1;
+    size_t index_block_count = (block_count + entries_per_block - 1) / entries_per_block + 1;
+    // A block changes its reference count, bitmap bit, index entry and the free block count, an index block is zeroed
+    // when allocated
+    size_t file_size = (block_count + index_block_count) * 4 * small_record_size +
+                       index_block_count * (IMAGE_RECORD_HEADER_SIZE + superblock->block_size);
+    size_t metadata_size = superblock->name_table_capacity * small_record_size +
+                           IMAGE_MAX_INODE_RECORDS * (IMAGE_RECORD_HEADER_SIZE + sizeof(struct image_inode));
+    return sizeof(struct image_journal_header) + 2 * file_size + metadata_size;
 }
 
-int write_via_descriptor(struct filedesc *descriptor, const char *buf, int size) {
-    int current_size = descriptor->current_block->index * BLOCK_SIZE + descriptor->block_offset;
-    int end_size = current_size + size;
-    if (end_size > MAX_FILE_SIZE)
-        return throw_error(UFS_ERR_NO_MEM);
+uint64_t get_checksum(const char *data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
 
-    for (int i = 0; i < size; ++i) {
-        write_single_byte(descriptor, buf[i]);
-        advance_descriptor(descriptor);
+bool write_to_image_file(int fd, const void *data, size_t size, uint64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t rc = pwrite(fd, (const char *) data + written, size - written, (off_t) (offset + written));
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return false;
+        written += rc;
     }
+    return true;
+}
 
-    return size;
+void apply_journal_records(const char *records, size_t size) {
+    size_t position = 0;
+    while (position + IMAGE_RECORD_HEADER_SIZE <= size) {
+        uint64_t offset;
+        uint32_t length;
+        memcpy(&offset, records + position, sizeof(offset));
+        memcpy(&length, records + position + sizeof(offset), sizeof(length));
+        if (offset + length > image->size || position + IMAGE_RECORD_HEADER_SIZE + length > size)
+            return;
+        memcpy(image->base + offset, records + position + IMAGE_RECORD_HEADER_SIZE, length);
+        position += IMAGE_RECORD_HEADER_SIZE + length;
+    }
 }
 
-int read_via_descriptor(struct filedesc *descriptor, char *buf, int size) {
-    int current_size = descriptor->current_block->index * BLOCK_SIZE + descriptor->block_offset;
-    int file_size_total = descriptor->file->last_block->index * BLOCK_SIZE + descriptor->file->last_block->occupied;
-    int bytes_left_to_read = file_size_total - current_size;
-    int read_count = (size > bytes_left_to_read ? bytes_left_to_read : size);
+void image_commit() {
+    if (image->journal_size == sizeof(struct image_journal_header))
+        return;
+    size_t record_bytes = image->journal_size - sizeof(struct image_journal_header);
+    struct image_journal_header header = {
+            .magic = IMAGE_JOURNAL_MAGIC,
+            .record_bytes = record_bytes,
+            .checksum = get_checksum(image->journal + sizeof(header), record_bytes)
+    };
+    memcpy(image->journal, &header, sizeof(header));
+    uint64_t journal_offset = image->superblock->journal_offset;
+    write_to_image_file(image->fd, image->journal, image->journal_size, journal_offset);
+    if (image->is_synchronous)
+        fdatasync(image->fd);
 
-    for (int i = 0; i < read_count; ++i) {
-        buf[i] = read_single_byte(descriptor);
-        advance_descriptor(descriptor);
-    }
+    apply_journal_records(image->journal + sizeof(header), record_bytes);
+    if (image->is_synchronous)
+        msync(image->base, image->size, MS_SYNC);
 
-    return read_count;
+    uint64_t no_magic = 0;
+    write_to_image_file(image->fd, &no_magic, sizeof(no_magic), journal_offset);
+    image->journal_size = sizeof(struct image_journal_header);
+    image->last_record = 0;
+    // The image has the changed words now. Most calls change a few, so a table grown by a big one is not kept
+    free(image->dirty_words);
+    image->dirty_words = NULL;
+    image->dirty_word_count = 0;
+    image->dirty_word_capacity = 0;
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size) {
-    struct filedesc *descriptor = try_get_file_descriptor(fd);
-    if (descriptor == NULL)
-        return throw_error(UFS_ERR_NO_FILE);
+/** Makes @a length bytes at @a destination in the image equal to @a data when the transaction commits. */
+void image_tx_write(void *destination, const void *data, uint32_t length) {
+    uint64_t offset = (uint64_t) ((char *) destination - image->base);
+    if (image->last_record != 0) {
+        char *record = image->journal + image->last_record;
+        uint64_t record_offset;
+        uint32_t record_length;
+        memcpy(&record_offset, record, sizeof(record_offset));
+        memcpy(&record_length, record + sizeof(record_offset), sizeof(record_length));
+        if (record_offset == offset && record_length == length) {
+            memcpy(record + IMAGE_RECORD_HEADER_SIZE, data, length);
+            return;
+        }
+        if (record_offset + record_length == offset && image->journal_size + length <= image->journal_capacity) {
+            memcpy(image->journal + image->journal_size, data, length);
+            image->journal_size += length;
+            record_length += length;
+            memcpy(record + sizeof(record_offset), &record_length, sizeof(record_length));
+            return;
+        }
+    }
+    // A commit here would leave a half of the call in the image on a crash. The calls are checked against
+    // get_image_max_transaction_size() before they change anything, see image_make_room_for_call()
+    assert(image->journal_size + IMAGE_RECORD_HEADER_SIZE + length <= image->journal_capacity);
+    char *record = image->journal + image->journal_size;
+    memcpy(record, &offset, sizeof(offset));
+    memcpy(record + sizeof(offset), &length, sizeof(length));
+    memcpy(record + IMAGE_RECORD_HEADER_SIZE, data, length);
+    image->last_record = image->journal_size;
+    image->journal_size += IMAGE_RECORD_HEADER_SIZE + length;
+}
 
-    if (specific_flag_is_present(descriptor->flags, UFS_READ_ONLY))
-        return throw_error(UFS_ERR_NO_PERMISSION);
+void image_replay_journal() {
+    struct image_journal_header header;
+    uint64_t journal_offset = image->superblock->journal_offset;
+    memcpy(&header, image->base + journal_offset, sizeof(header));
+    if (header.magic != IMAGE_JOURNAL_MAGIC || header.record_bytes > image->journal_capacity - sizeof(header))
+        return;
+    const char *records = image->base + journal_offset + sizeof(header);
+    if (get_checksum(records, header.record_bytes) == header.checksum)
+        apply_journal_records(records, header.record_bytes);
+    uint64_t no_magic = 0;
+    image_tx_write(image->base + journal_offset, &no_magic, sizeof(no_magic));
+    image_commit();
+}
 
-    return write_via_descriptor(descriptor, buf, (int) size);
+/**
+ * Commits the transaction of the previous calls in a row if the journal has no room for one more call. Returns false
+ * if even an empty journal has no room, then the call must fail before it changes anything.
+ */
+bool image_make_room_for_call() {
+    if (image->journal_size + image->max_transaction_size > image->journal_capacity)
+        image_commit();
+    return image->journal_size + image->max_transaction_size <= image->journal_capacity;
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size) {
-    struct filedesc *descriptor = try_get_file_descriptor(fd);
-    if (descriptor == NULL)
-        return throw_error(UFS_ERR_NO_FILE);
-    if (specific_flag_is_present(descriptor->flags, UFS_WRITE_ONLY))
-        return throw_error(UFS_ERR_NO_PERMISSION);
-    return read_via_descriptor(descriptor, buf, (int) size);
+int get_dirty_word_mask() {
+    return image->dirty_word_capacity - 1;
 }
 
-int
-ufs_close(int fd) {
-    struct filedesc *descriptor = try_get_file_descriptor(fd);
-    if (descriptor == NULL)
-        return throw_error(UFS_ERR_NO_FILE);
-    close_file_descriptor(descriptor);
-    return UFS_ERR_NO_ERR;
+int get_dirty_word_slot(uint64_t offset) {
+    return (int) (offset / sizeof(uint32_t)) & get_dirty_word_mask();
 }
 
-int
-ufs_delete(const char *filename) {
-    struct file *referred_file = try_get_file_by_filename((char *) filename);
-    if (referred_file == NULL)
-        return throw_error(UFS_ERR_NO_FILE);
-    disconnect_file_from_file_list(referred_file);
-    if (referred_file->refs == 0) {
-        delete_file(referred_file);
-    } else {
-        referred_file->marked_for_deletion = true;
-    }
-    return UFS_ERR_NO_ERR;
+void insert_dirty_word_without_growth(uint64_t offset, uint32_t value) {
+    int slot = get_dirty_word_slot(offset);
+    while (image->dirty_words[slot].offset != 0)
+        slot = (slot + 1) & get_dirty_word_mask();
+    image->dirty_words[slot] = (struct image_dirty_word) {.offset = offset, .value = value};
+    image->dirty_word_count++;
 }
 
-void
-ufs_destroy(void) {
-    for (int i = 0; i < file_descriptor_count; ++i) {
-        if (file_descriptors[i] != NULL)
-            close_file_descriptor(file_descriptors[i]);
+struct image_dirty_word *try_find_dirty_word(uint64_t offset) {
+    if (image->dirty_word_count == 0)
+        return NULL;
+    for (int slot = get_dirty_word_slot(offset); image->dirty_words[slot].offset != 0;
+         slot = (slot + 1) & get_dirty_word_mask()) {
+        if (image->dirty_words[slot].offset == offset)
+            return &image->dirty_words[slot];
     }
-    free(file_descriptors);
+    return NULL;
+}
 
-    while (file_list != NULL)
-        delete_file(file_list);
+/** Metadata word at @a word in the image as the running transaction sees it. */
+uint32_t image_read_word(const uint32_t *word) {
+    struct image_dirty_word *dirty_word = try_find_dirty_word((uint64_t) ((const char *) word - image->base));
+    return dirty_word != NULL ? dirty_word->value : *word;
 }
 
-void reduce_file_size(struct file *file, int new_size) {
-    struct block *new_last_block = file->last_block;
-    while (new_last_block->index * BLOCK_SIZE > new_size) {
-        new_last_block = new_last_block->prev;
+/** Like image_tx_write() of a metadata word, which image_read_word() sees before the commit. */
+void image_write_word(uint32_t *word, uint32_t value) {
+    const int INITIAL_CAPACITY = 64;
+    image_tx_write(word, &value, sizeof(value));
+    uint64_t offset = (uint64_t) ((char *) word - image->base);
+    struct image_dirty_word *dirty_word = try_find_dirty_word(offset);
+    if (dirty_word != NULL) {
+        dirty_word->value = value;
+        return;
     }
-
-    int new_occupied = new_size - new_last_block->index * BLOCK_SIZE;
-    new_last_block->occupied = new_occupied;
-    new_last_block->next = NULL;
-
-    for (int i = 0; i < file_descriptor_count; ++i) {
-        if (file_descriptors[i] == NULL)
-            continue;
-        if (file_descriptors[i]->file != file)
-            continue;
-        if (file_descriptors[i]->current_block->index < new_last_block->index)
-            continue;
-        if (file_descriptors[i]->current_block->index == new_last_block->index &&
-            file_descriptors[i]->block_offset <= new_occupied)
-            continue;
-        file_descriptors[i]->current_block = new_last_block;
-        file_descriptors[i]->block_offset = new_occupied;
+    // Keep the load factor under 1/2, so the probe chains stay short
+    if ((image->dirty_word_count + 1) * 2 > image->dirty_word_capacity) {
+        struct image_dirty_word *old_words = image->dirty_words;
+        int old_capacity = image->dirty_word_capacity;
+        image->dirty_word_capacity = old_capacity == 0 ? INITIAL_CAPACITY : old_capacity * 2;
+        image->dirty_words = calloc(image->dirty_word_capacity, sizeof(struct image_dirty_word));
+        image->dirty_word_count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_words[i].offset != 0)
+                insert_dirty_word_without_growth(old_words[i].offset, old_words[i].value);
+        }
+        free(old_words);
     }
+    insert_dirty_word_without_growth(offset, value);
+}
 
-    struct block *removal_ptr = file->last_block;
-    while (removal_ptr != new_last_block) {
-        struct block *next = removal_ptr->prev;
-        free(removal_ptr->memory);
-        free(removal_ptr);
-        removal_ptr = next;
-    }
-    file->last_block = new_last_block;
+void set_image_refs(uint32_t number, uint32_t refs) {
+    image_write_word(&get_image_refs()[number], refs);
+}
+
+void set_image_bitmap_bit(uint32_t number, bool is_used) {
+    uint32_t *word = &get_image_bitmap()[number / 32];
+    uint32_t bits = image_read_word(word);
+    image_write_word(word, is_used ? bits | 1u << (number % 32) : bits & ~(1u << (number % 32)));
+}
+
+uint32_t get_image_free_block_count() {
+    return image_read_word(&image->superblock->free_block_count);
+}
+
+void add_image_free_blocks(int count) {
+    image_write_word(&image->superblock->free_block_count, get_image_free_block_count() + count);
+}
+
+int get_loaded_block_mask() {
+    return image->loaded_block_capacity - 1;
+}
+
+void insert_loaded_block_without_growth(struct block *block) {
+    int slot = (int) (block->image_number & get_loaded_block_mask());
+    while (image->loaded_blocks[slot] != NULL)
+        slot = (slot + 1) & get_loaded_block_mask();
+    image->loaded_blocks[slot] = block;
+    image->loaded_block_count++;
+}
+
+void index_loaded_block(struct block *block) {
+    const int INITIAL_CAPACITY = 64;
+    // Keep the load factor under 1/2, so the probe chains stay short
+    if ((image->loaded_block_count + 1) * 2 > image->loaded_block_capacity) {
+        struct block **old_blocks = image->loaded_blocks;
+        int old_capacity = image->loaded_block_capacity;
+        image->loaded_block_capacity = old_capacity == 0 ? INITIAL_CAPACITY : old_capacity * 2;
+        image->loaded_blocks = calloc(image->loaded_block_capacity, sizeof(struct block *));
+        image->loaded_block_count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_blocks[i] != NULL)
+                insert_loaded_block_without_growth(old_blocks[i]);
+        }
+        free(old_blocks);
+    }
+    insert_loaded_block_without_growth(block);
+}
+
+int get_loaded_block_home(const void *table, int slot, int mask) {
+    struct block *block = ((struct block *const *) table)[slot];
+    return block == NULL ? NONE : (int) (block->image_number & mask);
+}
+
+void move_loaded_block_slot(void *table, int to, int from) {
+    struct block **blocks = table;
+    blocks[to] = from == NONE ? NULL : blocks[from];
+}
+
+void unindex_loaded_block(struct block *block) {
+    int mask = get_loaded_block_mask();
+    int hole = (int) (block->image_number & mask);
+    while (image->loaded_blocks[hole] != block)
+        hole = (hole + 1) & mask;
+    backward_shift_delete(image->loaded_blocks, mask, hole, get_loaded_block_home, move_loaded_block_slot);
+    image->loaded_block_count--;
+}
+
+struct block *pop_block_header();
+
+/** Header of a used block of the image, made on first use. */
+struct block *get_image_block(uint32_t number) {
+    if (image->loaded_block_count > 0) {
+        int mask = get_loaded_block_mask();
+        for (int slot = (int) (number & mask); image->loaded_blocks[slot] != NULL; slot = (slot + 1) & mask) {
+            if (image->loaded_blocks[slot]->image_number == number)
+                return image->loaded_blocks[slot];
+        }
+    }
+    pthread_mutex_lock(&block_pool_lock);
+    struct block *block = pop_block_header();
+    pthread_mutex_unlock(&block_pool_lock);
+    atomic_init(&block->refs, (int) image_read_word(&get_image_refs()[number]));
+    atomic_init(&block->pins, 0);
+    atomic_init(&block->memory, (char *) get_image_block_words(number));
+    atomic_init(&block->is_hot, true);
+    block->compressed = NULL;
+    block->is_sealed = false;
+    block->image_number = number;
+    index_loaded_block(block);
+    return block;
+}
+
+/** Marks a free block used with one reference. Returns NONE when the image is full. */
+int64_t image_allocate_block_number() {
+    if (get_image_free_block_count() == 0)
+        return NONE;
+    uint32_t block_count = image->superblock->block_count;
+    int word_count = (int) ((block_count + 31) / 32);
+    uint32_t *bitmap = get_image_bitmap();
+    for (int i = 0; i < word_count; ++i) {
+        int word = (image->free_word_hint + i) % word_count;
+        uint32_t bits = image_read_word(&bitmap[word]);
+        if (bits == ~0u)
+            continue;
+        uint32_t number = (uint32_t) word * 32 + __builtin_ctz(~bits);
+        // Bits past the last block are never used
+        if (number >= block_count)
+            continue;
+        image->free_word_hint = word;
+        add_image_free_blocks(-1);
+        set_image_bitmap_bit(number, true);
+        set_image_refs(number, 1);
+        return number;
+    }
+    return NONE;
+}
+
+/** Returns NULL when the image is full. Memory of a new block is not initialized. */
+struct block *image_allocate_block() {
+    int64_t number = image_allocate_block_number();
+    return number == NONE ? NULL : get_image_block((uint32_t) number);
+}
+
+/** The reference count of the block must be 0 already. */
+void image_free_block_number(uint32_t number) {
+    set_image_bitmap_bit(number, false);
+    add_image_free_blocks(1);
+}
+
+/** Called when the block has no references and pins anymore. Its header goes back to the pool. */
+void image_free_block(struct block *block) {
+    image_free_block_number(get_image_block_number(block));
+    unindex_loaded_block(block);
+}
+
+/** The block lost its last reference while pinned. The list lets a mount free it if the mapping is never unmapped. */
+void image_add_pinned_orphan(struct block *block) {
+    uint32_t *head = &image->superblock->pinned_orphan_head;
+    set_image_refs(get_image_block_number(block), image_read_word(head));
+    image_write_word(head, get_image_block_number(block) + 1);
+}
+
+void image_remove_pinned_orphan(struct block *block) {
+    uint32_t *refs = get_image_refs();
+    uint32_t *link = &image->superblock->pinned_orphan_head;
+    uint32_t number = get_image_block_number(block);
+    while (image_read_word(link) != number + 1) {
+        if (image_read_word(link) == 0)
+            return;
+        link = &refs[image_read_word(link) - 1];
+    }
+    image_write_word(link, image_read_word(&refs[number]));
+    set_image_refs(number, 0);
+}
+
+/**
+ * Index blocks belong to one file and are used only through the file index, so they get no headers. Returns number + 1
+ * of the new block, 0 when the image is full.
+ */
+uint32_t image_allocate_index_block() {
+    int64_t number = image_allocate_block_number();
+    if (number == NONE)
+        return 0;
+    image_tx_write(get_image_block_words((uint32_t) number), image->zeros, block_size);
+    return (uint32_t) number + 1;
+}
+
+void image_free_index_block(uint32_t number_plus_one) {
+    set_image_refs(number_plus_one - 1, 0);
+    image_free_block_number(number_plus_one - 1);
+}
+
+/** Points entry @a index of the file index to @a block. Returns false if there is no space for index blocks. */
+bool image_set_index_entry(struct file *file, int index, struct block *block) {
+    int entries_per_block = get_index_entries_per_block();
+    uint32_t value = block == NULL ? 0 : get_image_block_number(block) + 1;
+    if (file->index_root == 0) {
+        if (value == 0)
+            return true;
+        file->index_root = image_allocate_index_block();
+        if (file->index_root == 0)
+            return false;
+        file->index_blocks = calloc(entries_per_block, sizeof(uint32_t));
+    }
+    int slot = index / entries_per_block;
+    if (file->index_blocks[slot] == 0) {
+        if (value == 0)
+            return true;
+        file->index_blocks[slot] = image_allocate_index_block();
+        if (file->index_blocks[slot] == 0)
+            return false;
+        image_tx_write(&get_image_block_words(file->index_root - 1)[slot], &file->index_blocks[slot],
+                       sizeof(uint32_t));
+    }
+    image_tx_write(&get_image_block_words(file->index_blocks[slot] - 1)[index % entries_per_block], &value,
+                   sizeof(value));
+    return true;
+}
+
+/** Clears the index entries from @a new_block_count on and frees the index blocks which are not needed anymore. */
+void image_truncate_index(struct file *file, int new_block_count, int old_block_count) {
+    if (file->index_root == 0)
+        return;
+    int entries_per_block = get_index_entries_per_block();
+    int kept_index_blocks = (new_block_count + entries_per_block - 1) / entries_per_block;
+    // Only the last kept index block has entries to clear, the others are freed and zeroed on reuse
+    int clear_end = kept_index_blocks * entries_per_block < old_block_count ? kept_index_blocks * entries_per_block
+                                                                              : old_block_count;
+    for (int i = new_block_count; i < clear_end; ++i) {
+        if (file->index_blocks[i / entries_per_block] != 0)
+            image_set_index_entry(file, i, NULL);
+    }
+    int old_index_blocks = (old_block_count + entries_per_block - 1) / entries_per_block;
+    uint32_t no_block = 0;
+    for (int slot = kept_index_blocks; slot < old_index_blocks; ++slot) {
+        if (file->index_blocks[slot] == 0)
+            continue;
+        image_free_index_block(file->index_blocks[slot]);
+        file->index_blocks[slot] = 0;
+        image_tx_write(&get_image_block_words(file->index_root - 1)[slot], &no_block, sizeof(no_block));
+    }
+    if (new_block_count == 0) {
+        image_free_index_block(file->index_root);
+        file->index_root = 0;
+        free(file->index_blocks);
+        file->index_blocks = NULL;
+    }
+}
+
+void image_sync_inode(struct file *file) {
+    struct image_inode *inode = get_image_inode(file->inode);
+    uint32_t fields[] = {1, (uint32_t) file->size, file->index_root};
+    image_tx_write(inode, fields, sizeof(fields));
+}
+
+int image_find_inode(const char *filename, unsigned int name_hash) {
+    uint32_t *name_table = get_image_name_table();
+    uint32_t mask = image->superblock->name_table_capacity - 1;
+    for (uint32_t slot = name_hash & mask; image_read_word(&name_table[slot]) != 0; slot = (slot + 1) & mask) {
+        int number = (int) image_read_word(&name_table[slot]) - 1;
+        if (strcmp(get_image_inode(number)->name, filename) == 0)
+            return number;
+    }
+    return NONE;
+}
+
+void set_image_name_table_entry(uint32_t slot, uint32_t value) {
+    image_write_word(&get_image_name_table()[slot], value);
+}
+
+/** Gives the new file an inode and a name table entry. Returns false if there are no free inodes. */
+bool image_create_inode(struct file *file) {
+    int inode_count = (int) image->superblock->inode_count;
+    int number = NONE;
+    for (int i = 0; i < inode_count && number == NONE; ++i) {
+        int candidate = (image->free_inode_hint + i) % inode_count;
+        if (!get_image_inode(candidate)->is_used)
+            number = candidate;
+    }
+    if (number == NONE)
+        return false;
+    image->free_inode_hint = (number + 1) % inode_count;
+
+    struct image_inode inode = {.is_used = 1, .size = 0, .index_root = 0, .next_orphan = NONE};
+    memset(inode.name, 0, sizeof(inode.name));
+    strcpy(inode.name, file->name);
+    image_tx_write(get_image_inode(number), &inode, sizeof(inode));
+    file->inode = number;
+
+    uint32_t mask = image->superblock->name_table_capacity - 1;
+    uint32_t slot = file->name_hash & mask;
+    while (image_read_word(&get_image_name_table()[slot]) != 0)
+        slot = (slot + 1) & mask;
+    set_image_name_table_entry(slot, number + 1);
+    return true;
+}
+
+int get_image_name_home(const void *table, int slot, int mask) {
+    uint32_t entry = image_read_word(&((const uint32_t *) table)[slot]);
+    return entry == 0 ? NONE : (int) (get_name_hash(get_image_inode((int) entry - 1)->name) & mask);
+}
+
+/** Goes through the journal, like any change of the name table. */
+void move_image_name_slot(void *table, int to, int from) {
+    set_image_name_table_entry(to, from == NONE ? 0 : image_read_word(&((uint32_t *) table)[from]));
+}
+
+void image_unindex_name(struct file *file) {
+    uint32_t *name_table = get_image_name_table();
+    uint32_t mask = image->superblock->name_table_capacity - 1;
+    uint32_t hole = file->name_hash & mask;
+    while (image_read_word(&name_table[hole]) != (uint32_t) file->inode + 1) {
+        if (image_read_word(&name_table[hole]) == 0)
+            return;
+        hole = (hole + 1) & mask;
+    }
+    backward_shift_delete(name_table, (int) mask, (int) hole, get_image_name_home, move_image_name_slot);
+}
+
+/** The file is deleted, but still has descriptors. The orphan list lets a mount free it after a crash. */
+void image_add_orphan(struct file *file) {
+    int32_t next_orphan = image->superblock->orphan_head;
+    int32_t head = file->inode;
+    image_tx_write(&get_image_inode(file->inode)->next_orphan, &next_orphan, sizeof(next_orphan));
+    image_tx_write(&image->superblock->orphan_head, &head, sizeof(head));
+}
+
+void image_remove_orphan(struct file *file) {
+    int previous = NONE;
+    int number = image->superblock->orphan_head;
+    while (number != NONE && number != file->inode) {
+        previous = number;
+        number = get_image_inode(number)->next_orphan;
+    }
+    if (number == NONE)
+        return;
+    int32_t next_orphan = get_image_inode(number)->next_orphan;
+    if (previous == NONE)
+        image_tx_write(&image->superblock->orphan_head, &next_orphan, sizeof(next_orphan));
+    else
+        image_tx_write(&get_image_inode(previous)->next_orphan, &next_orphan, sizeof(next_orphan));
+}
+
+/** The blocks of the file must be already released. Commits, so the orphan list is not walked twice in one go. */
+void image_free_inode(struct file *file) {
+    if (file->marked_for_deletion)
+        image_remove_orphan(file);
+    uint32_t is_used = 0;
+    image_tx_write(&get_image_inode(file->inode)->is_used, &is_used, sizeof(is_used));
+    image_commit();
+}
+
+void lock_image_metadata() {
+    if (image != NULL)
+        pthread_mutex_lock(&image_lock);
+}
+
+void unlock_image_metadata() {
+    if (image == NULL)
+        return;
+    image_commit();
+    pthread_mutex_unlock(&image_lock);
+}
+
+size_t align_to(size_t offset, size_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+bool format_image(int fd) {
+    uint32_t image_block_size = block_size < IMAGE_MIN_BLOCK_SIZE ? IMAGE_MIN_BLOCK_SIZE : block_size;
+    const char *size_in_mb = getenv("UFS_IMAGE_SIZE_MB");
+    uint64_t data_size = (uint64_t) (size_in_mb != NULL ? atoi(size_in_mb) : IMAGE_DEFAULT_SIZE_MB) * 1024 * 1024;
+    struct image_superblock superblock = {
+            .magic = IMAGE_MAGIC,
+            .block_size = image_block_size,
+            .block_count = (uint32_t) (data_size / image_block_size),
+            .orphan_head = NONE,
+            .pinned_orphan_head = 0,
+            .reserved = 0
+    };
+    if (superblock.block_count == 0)
+        return false;
+    superblock.free_block_count = superblock.block_count;
+    superblock.inode_count = superblock.block_count / 4 > 64 ? superblock.block_count / 4 : 64;
+    superblock.name_table_capacity = 1;
+    while (superblock.name_table_capacity < superblock.inode_count * 2)
+        superblock.name_table_capacity *= 2;
+
+    size_t journal_size = get_image_max_transaction_size(&superblock);
+    if (journal_size < IMAGE_JOURNAL_SIZE)
+        journal_size = IMAGE_JOURNAL_SIZE;
+    superblock.journal_offset = image_block_size;
+    superblock.bitmap_offset = align_to(superblock.journal_offset + journal_size, image_block_size);
+    superblock.refs_offset = align_to(superblock.bitmap_offset + (superblock.block_count + 63) / 64 * 8,
+                                      image_block_size);
+    superblock.inode_offset = align_to(superblock.refs_offset + (uint64_t) superblock.block_count * sizeof(uint32_t),
+                                       image_block_size);
+    superblock.name_table_offset = align_to(
+            superblock.inode_offset + (uint64_t) superblock.inode_count * sizeof(struct image_inode),
+            image_block_size);
+    superblock.data_offset = align_to(
+            superblock.name_table_offset + (uint64_t) superblock.name_table_capacity * sizeof(uint32_t),
+            image_block_size);
+    superblock.image_size = superblock.data_offset + (uint64_t) superblock.block_count * image_block_size;
+
+    // Everything else starts as zeros, and a new file reads as zeros without taking disk space
+    if (ftruncate(fd, (off_t) superblock.image_size) != 0)
+        return false;
+    return write_to_image_file(fd, &superblock, sizeof(superblock), 0) && fdatasync(fd) == 0;
+}
+
+/** Makes an in-memory file of the inode. Its blocks are headers of the image blocks, which already count it. */
+void load_image_file_content(struct file *file, int inode_number) {
+    struct image_inode *inode = get_image_inode(inode_number);
+    file->inode = inode_number;
+    file->size = (int) inode->size;
+    // A file with no index is a hole as a whole
+    int block_count = inode->index_root != 0 ? get_block_count_for_size(file->size) : 0;
+    file->blocks = calloc(block_count > 0 ? block_count : 1, sizeof(struct block *));
+    file->block_count = block_count;
+    file->block_capacity = block_count > 0 ? block_count : 1;
+    if (inode->index_root == 0)
+        return;
+    int entries_per_block = get_index_entries_per_block();
+    file->index_root = inode->index_root;
+    file->index_blocks = malloc(block_size);
+    memcpy(file->index_blocks, get_image_block_words(file->index_root - 1), block_size);
+    for (int i = 0; i < block_count; ++i) {
+        uint32_t index_block = file->index_blocks[i / entries_per_block];
+        if (index_block == 0)
+            continue;
+        uint32_t entry = get_image_block_words(index_block - 1)[i % entries_per_block];
+        if (entry != 0)
+            file->blocks[i] = get_image_block(entry - 1);
+    }
+}
+
+/**
+ * Files deleted with opened descriptors and blocks deleted while pinned by a mapping by a process which didn't live to
+ * close and unmap them. Only the blocks and files of the orphan lists are visited.
+ */
+void clean_image_orphans() {
+    uint32_t *refs = get_image_refs();
+    uint32_t *pinned_orphan_head = &image->superblock->pinned_orphan_head;
+    for (uint32_t next = image_read_word(pinned_orphan_head); next != 0;) {
+        uint32_t number = next - 1;
+        next = image_read_word(&refs[number]);
+        // A commit on the way keeps the list consistent, the freed blocks are not on it anymore
+        image_make_room_for_call();
+        image_write_word(pinned_orphan_head, next);
+        set_image_refs(number, 0);
+        image_free_block_number(number);
+    }
+    image_commit();
+    for (int number = image->superblock->orphan_head; number != NONE;) {
+        int next_orphan = get_image_inode(number)->next_orphan;
+        struct file *file = allocate_file(get_image_inode(number)->name, 0);
+        load_image_file_content(file, number);
+        delete_file(file);
+        number = next_orphan;
+    }
+    int32_t no_orphans = NONE;
+    image_tx_write(&image->superblock->orphan_head, &no_orphans, sizeof(no_orphans));
+    image_commit();
+}
+
+bool mount_image(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    struct stat stat_buffer;
+    struct image_superblock superblock;
+    bool is_valid = fstat(fd, &stat_buffer) == 0 &&
+                    (stat_buffer.st_size > 0 || (format_image(fd) && fstat(fd, &stat_buffer) == 0)) &&
+                    pread(fd, &superblock, sizeof(superblock), 0) == sizeof(superblock) &&
+                    superblock.magic == IMAGE_MAGIC && superblock.block_size >= IMAGE_MIN_BLOCK_SIZE &&
+                    superblock.block_size <= MAX_BLOCK_SIZE &&
+                    (superblock.block_size & (superblock.block_size - 1)) == 0 &&
+                    superblock.bitmap_offset > superblock.journal_offset &&
+                    superblock.bitmap_offset - superblock.journal_offset >=
+                    get_image_max_transaction_size(&superblock) &&
+                    // A truncated image would crash on access to the mapping past the file end
+                    (uint64_t) stat_buffer.st_size >= superblock.image_size;
+    char *base = is_valid ? mmap(NULL, superblock.image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    image = calloc(1, sizeof(struct image));
+    char *journal = malloc(superblock.bitmap_offset - superblock.journal_offset);
+    char *zeros = calloc(superblock.block_size, 1);
+    if (image == NULL || journal == NULL || zeros == NULL) {
+        free(image);
+        free(journal);
+        free(zeros);
+        image = NULL;
+        munmap(base, superblock.image_size);
+        close(fd);
+        return false;
+    }
+    image->fd = fd;
+    image->base = base;
+    image->size = superblock.image_size;
+    const char *is_synchronous = getenv("UFS_IMAGE_SYNC");
+    image->is_synchronous = is_synchronous != NULL && strcmp(is_synchronous, "1") == 0;
+    image->superblock = (struct image_superblock *) base;
+    image->journal_capacity = superblock.bitmap_offset - superblock.journal_offset;
+    image->max_transaction_size = get_image_max_transaction_size(&superblock);
+    image->journal = journal;
+    image->journal_size = sizeof(struct image_journal_header);
+    image->last_record = 0;
+    image->zeros = zeros;
+    block_size = (int) superblock.block_size;
+    block_size_log2 = __builtin_ctz(superblock.block_size);
+    image_replay_journal();
+    clean_image_orphans();
+    return true;
+}
+
+void unmount_image() {
+    image_commit();
+    msync(image->base, image->size, MS_SYNC);
+    munmap(image->base, image->size);
+    close(image->fd);
+    // The headers themselves are in the block pool
+    free(image->loaded_blocks);
+    free(image->journal);
+    free(image->zeros);
+    free(image);
+    image = NULL;
+}
+
+static pthread_mutex_t initialization_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool is_initialized = false;
+
+/** Mounts the image on first use if UFS_IMAGE is set. */
+void ensure_initialized() {
+    if (atomic_load_explicit(&is_initialized, memory_order_acquire))
+        return;
+    pthread_mutex_lock(&initialization_lock);
+    if (!atomic_load_explicit(&is_initialized, memory_order_relaxed)) {
+        const char *path = getenv("UFS_IMAGE");
+        if (path != NULL && path[0] != '\0' && !mount_image(path))
+            fprintf(stderr, "userfs: can't mount image %s, the FS stays in memory\n", path);
+        atomic_store_explicit(&is_initialized, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&initialization_lock);
+}
+
+char *allocate_slab(size_t size) {
+    const int GROWTH_FACTOR = 2;
+    char *slab = malloc(size);
+    slab_byte_count += size;
+    if (slab_count == slab_capacity) {
+        slab_capacity = slab_capacity == 0 ? 1 : slab_capacity * GROWTH_FACTOR;
+        slabs = realloc(slabs, sizeof(char *) * slab_capacity);
+    }
+    slabs[slab_count++] = slab;
+    return slab;
+}
+
+void destroy_block_pool() {
+    for (int i = 0; i < slab_count; ++i)
+        free(slabs[i]);
+    free(slabs);
+    slabs = NULL;
+    slab_count = 0;
+    slab_capacity = 0;
+    slab_byte_count = 0;
+    free_blocks = NULL;
+    free_memory = NULL;
+    used_block_count = 0;
+    compressed_block_count = 0;
+    compressed_byte_count = 0;
+}
+
+/** The block pool must be locked. */
+char *pop_block_memory() {
+    if (free_memory == NULL) {
+        int pieces_per_slab = SLAB_SIZE / block_size > 0 ? SLAB_SIZE / block_size : 1;
+        char *slab = allocate_slab((size_t) pieces_per_slab * block_size);
+        for (int i = 0; i < pieces_per_slab; ++i) {
+            char *memory = slab + (size_t) i * block_size;
+            *(char **) memory = free_memory;
+            free_memory = memory;
+        }
+    }
+    char *memory = free_memory;
+    free_memory = *(char **) memory;
+    return memory;
+}
+
+/** The block pool must be locked. */
+void push_block_memory(char *memory) {
+    *(char **) memory = free_memory;
+    free_memory = memory;
+}
+
+/** The block pool must be locked. */
+struct block *pop_block_header() {
+    if (free_blocks == NULL) {
+        int blocks_per_slab = SLAB_SIZE / sizeof(struct block);
+        struct block *slab = (struct block *) allocate_slab(sizeof(struct block) * blocks_per_slab);
+        for (int i = 0; i < blocks_per_slab; ++i) {
+            slab[i].next_free = free_blocks;
+            free_blocks = &slab[i];
+        }
+    }
+    struct block *block = free_blocks;
+    free_blocks = block->next_free;
+    return block;
+}
+
+/** Memory of a new block is not initialized. Returns NULL only when the image is full. */
+struct block *create_block() {
+    if (image != NULL)
+        return image_allocate_block();
+    pthread_mutex_lock(&block_pool_lock);
+    struct block *block = pop_block_header();
+    atomic_init(&block->memory, pop_block_memory());
+    used_block_count++;
+    pthread_mutex_unlock(&block_pool_lock);
+    atomic_init(&block->refs, 1);
+    atomic_init(&block->pins, 0);
+    atomic_init(&block->is_hot, true);
+    block->compressed = NULL;
+    block->is_sealed = false;
+    return block;
+}
+
+void unindex_sealed_block(struct block *block);
+
+/** Returns the block with no references and pins to the pool. The block pool must be locked. */
+void free_block(struct block *block) {
+    if (image != NULL) {
+        image_free_block(block);
+        block->next_free = free_blocks;
+        free_blocks = block;
+        return;
+    }
+    if (block->compressed != NULL) {
+        free(block->compressed);
+        compressed_block_count--;
+        compressed_byte_count -= block->compressed_size;
+    } else {
+        push_block_memory(block->memory);
+    }
+    used_block_count--;
+    block->next_free = free_blocks;
+    free_blocks = block;
+}
+
+/** Drops a reference to the block, the last one returns it to the pool. The block pool must be locked. */
+void release_block(struct block *block) {
+    if (block == NULL)
+        return;
+    int refs_left = atomic_fetch_sub(&block->refs, 1) - 1;
+    if (image != NULL && refs_left == 0 && atomic_load(&block->pins) > 0)
+        image_add_pinned_orphan(block);
+    else if (image != NULL)
+        set_image_refs(get_image_block_number(block), refs_left);
+    // A pinned block stays, but nobody is going to find its content anymore
+    if (refs_left == 0 && block->is_sealed)
+        unindex_sealed_block(block);
+    if (refs_left == 0 && atomic_load(&block->pins) == 0)
+        free_block(block);
+}
+
+/** Drops a pin of the block, frees it if it has no references anymore. The block pool must be locked. */
+void unpin_block(struct block *block) {
+    if (block == NULL)
+        return;
+    if (atomic_fetch_sub(&block->pins, 1) != 1 || atomic_load(&block->refs) != 0)
+        return;
+    if (image != NULL)
+        image_remove_pinned_orphan(block);
+    free_block(block);
+}
+
+/** Returns an array of @a block_count blocks of the file with a new reference to each. */
+struct block **share_blocks(struct block **blocks, int block_count) {
+    struct block **copy = malloc(sizeof(struct block *) * (block_count > 0 ? block_count : 1));
+    for (int i = 0; i < block_count; ++i) {
+        copy[i] = blocks[i];
+        if (copy[i] == NULL)
+            continue;
+        int refs = atomic_fetch_add(&copy[i]->refs, 1) + 1;
+        if (image != NULL)
+            set_image_refs(get_image_block_number(copy[i]), refs);
+    }
+    return copy;
+}
+
+void release_blocks(struct block **blocks, int block_count) {
+    pthread_mutex_lock(&block_pool_lock);
+    for (int i = 0; i < block_count; ++i)
+        release_block(blocks[i]);
+    pthread_mutex_unlock(&block_pool_lock);
+    free(blocks);
+}
+
+/*
+ * Deduplication and compression, for the heap only. With ufs_set_dedup() on, a block which a write fills up to its
+ * end is sealed: it is hashed and looked up in the content table. If a block with the same content is there, the
+ * file takes it and the new one is freed. Sealed blocks are never written in place, the next write copies them like
+ * shared ones. ufs_compress_cold_blocks() compresses the blocks nobody used since its previous call with a built-in
+ * LZ77 codec in the LZ4 block format, and the first use of a compressed block inflates it back.
+ */
+
+enum {
+    LZ_MIN_MATCH = 4,
+    LZ_HASH_BITS = 12,
+    LZ_MAX_OFFSET = 65535,
+    /** Lengths from this one on continue in the next bytes. */
+    LZ_LENGTH_MASK = 15,
+    /** End of block rules of LZ4: the last bytes are literals, and the last match starts this far from the end. */
+    LZ_LAST_LITERALS = 5,
+    LZ_MATCH_START_LIMIT = 12,
+};
+
+static atomic_bool is_dedup_enabled = false;
+/**
+ * Sealed blocks by content hash: open addressing with linear probing, like the name index. Protected by the block
+ * pool lock.
+ */
+static struct block **sealed_blocks = NULL;
+static int sealed_block_capacity = 0;
+static int sealed_block_count = 0;
+
+int write_lz_length(unsigned char *destination, int position, int length) {
+    if (length < LZ_LENGTH_MASK)
+        return position;
+    for (length -= LZ_LENGTH_MASK; length >= 255; length -= 255)
+        destination[position++] = 255;
+    destination[position++] = (unsigned char) length;
+    return position;
+}
+
+/** Worst size of a sequence with @a literal_count literals and a match of @a match_length bytes. */
+int get_lz_sequence_bound(int literal_count, int match_length) {
+    return 1 + literal_count / 255 + 1 + literal_count + 2 + match_length / 255 + 1;
+}
+
+/** Returns the compressed size, or 0 if it is not less than @a capacity. */
+int lz_compress(const unsigned char *source, int size, unsigned char *destination, int capacity) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    int anchor = 0;
+    int position = 0;
+    int written = 0;
+    while (position + LZ_MATCH_START_LIMIT <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, source + position, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = position;
+        if (candidate < 0 || position - candidate > LZ_MAX_OFFSET ||
+            memcmp(source + candidate, source + position, LZ_MIN_MATCH) != 0) {
+            position++;
+            continue;
+        }
+        int match_length = LZ_MIN_MATCH;
+        while (position + match_length < size - LZ_LAST_LITERALS &&
+               source[candidate + match_length] == source[position + match_length])
+            match_length++;
+
+        int literal_count = position - anchor;
+        if (written + get_lz_sequence_bound(literal_count, match_length) >= capacity)
+            return 0;
+        int extra_match_length = match_length - LZ_MIN_MATCH;
+        destination[written++] = (unsigned char) (
+                (literal_count < LZ_LENGTH_MASK ? literal_count : LZ_LENGTH_MASK) << 4 |
+                (extra_match_length < LZ_LENGTH_MASK ? extra_match_length : LZ_LENGTH_MASK));
+        written = write_lz_length(destination, written, literal_count);
+        memcpy(destination + written, source + anchor, literal_count);
+        written += literal_count;
+        int offset = position - candidate;
+        destination[written++] = (unsigned char) (offset & 0xff);
+        destination[written++] = (unsigned char) (offset >> 8);
+        written = write_lz_length(destination, written, extra_match_length);
+        position += match_length;
+        anchor = position;
+    }
+    // The last sequence has only literals
+    int literal_count = size - anchor;
+    if (written + get_lz_sequence_bound(literal_count, 0) >= capacity)
+        return 0;
+    destination[written++] = (unsigned char) ((literal_count < LZ_LENGTH_MASK ? literal_count : LZ_LENGTH_MASK) << 4);
+    written = write_lz_length(destination, written, literal_count);
+    memcpy(destination + written, source + anchor, literal_count);
+    return written + literal_count;
+}
+
+/** Returns -1 if the length runs past the end of the source. */
+int read_lz_length(const unsigned char *source, int source_size, int *position, int length) {
+    if (length < LZ_LENGTH_MASK)
+        return length;
+    unsigned char next;
+    do {
+        if (*position >= source_size)
+            return -1;
+        next = source[(*position)++];
+        length += next;
+    } while (next == 255);
+    return length;
+}
+
+/** Returns false if the data doesn't decompress into exactly @a size bytes. */
+bool lz_decompress(const unsigned char *source, int source_size, unsigned char *destination, int size) {
+    int position = 0;
+    int written = 0;
+    while (position < source_size) {
+        int token = source[position++];
+        int literal_count = read_lz_length(source, source_size, &position, token >> 4);
+        if (literal_count < 0 || written + literal_count > size || position + literal_count > source_size)
+            return false;
+        memcpy(destination + written, source + position, literal_count);
+        position += literal_count;
+        written += literal_count;
+        if (position == source_size)
+            break;
+        if (position + 2 > source_size)
+            return false;
+        int offset = source[position] | source[position + 1] << 8;
+        position += 2;
+        int match_length = read_lz_length(source, source_size, &position, token & LZ_LENGTH_MASK);
+        if (match_length < 0)
+            return false;
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > written || written + match_length > size)
+            return false;
+        if (offset >= match_length) {
+            memcpy(destination + written, destination + written - offset, match_length);
+        } else {
+            // The match overlaps the bytes it produces, so it goes byte by byte
+            for (int i = 0; i < match_length; ++i)
+                destination[written + i] = destination[written - offset + i];
+        }
+        written += match_length;
+    }
+    return written == size;
+}
+
+/** Gives a compressed block its memory back. The block pool must be locked. */
+void inflate_block(struct block *block) {
+    if (block->compressed == NULL)
+        return;
+    char *memory = pop_block_memory();
+    lz_decompress((unsigned char *) block->compressed, block->compressed_size, (unsigned char *) memory, block_size);
+    free(block->compressed);
+    block->compressed = NULL;
+    compressed_block_count--;
+    compressed_byte_count -= block->compressed_size;
+    atomic_store_explicit(&block->memory, memory, memory_order_release);
+}
+
+/** Memory of the block to read or write. Marks the block used and inflates a compressed one. */
+char *get_block_memory(struct block *block) {
+    if (!atomic_load_explicit(&block->is_hot, memory_order_relaxed))
+        atomic_store_explicit(&block->is_hot, true, memory_order_relaxed);
+    char *memory = atomic_load_explicit(&block->memory, memory_order_acquire);
+    if (memory != NULL)
+        return memory;
+    pthread_mutex_lock(&block_pool_lock);
+    inflate_block(block);
+    pthread_mutex_unlock(&block_pool_lock);
+    return block->memory;
+}
+
+/** Makes a compressed copy of the block and frees its memory. The block pool must be locked. */
+bool compress_block(struct block *block, unsigned char *buffer) {
+    // Not worth it if it saves less than 1/8
+    int size = lz_compress((unsigned char *) block->memory, block_size, buffer, block_size - block_size / 8);
+    if (size == 0)
+        return false;
+    block->compressed = malloc(size);
+    memcpy(block->compressed, buffer, size);
+    block->compressed_size = size;
+    push_block_memory(block->memory);
+    atomic_store_explicit(&block->memory, NULL, memory_order_relaxed);
+    compressed_block_count++;
+    compressed_byte_count += size;
+    return true;
+}
+
+uint64_t get_content_hash(const char *memory) {
+    uint64_t hash = 0;
+    for (int i = 0; i < block_size; i += (int) sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, memory + i, sizeof(word));
+        hash = ((hash << 31 | hash >> 33) ^ word) * 0x9e3779b97f4a7c15ull;
+    }
+    return hash ^ hash >> 32;
+}
+
+int get_sealed_block_mask() {
+    return sealed_block_capacity - 1;
+}
+
+void insert_sealed_block_without_growth(struct block *block) {
+    int slot = (int) (block->content_hash & get_sealed_block_mask());
+    while (sealed_blocks[slot] != NULL)
+        slot = (slot + 1) & get_sealed_block_mask();
+    sealed_blocks[slot] = block;
+    sealed_block_count++;
+}
+
+/** The block pool must be locked. */
+void index_sealed_block(struct block *block) {
+    const int INITIAL_CAPACITY = 64;
+    // Keep the load factor under 1/2, so the probe chains stay short
+    if ((sealed_block_count + 1) * 2 > sealed_block_capacity) {
+        struct block **old_blocks = sealed_blocks;
+        int old_capacity = sealed_block_capacity;
+        sealed_block_capacity = old_capacity == 0 ? INITIAL_CAPACITY : old_capacity * 2;
+        sealed_blocks = calloc(sealed_block_capacity, sizeof(struct block *));
+        sealed_block_count = 0;
+        for (int i = 0; i < old_capacity; ++i) {
+            if (old_blocks[i] != NULL)
+                insert_sealed_block_without_growth(old_blocks[i]);
+        }
+        free(old_blocks);
+    }
+    insert_sealed_block_without_growth(block);
+    block->is_sealed = true;
+}
+
+int get_sealed_block_home(const void *table, int slot, int mask) {
+    struct block *block = ((struct block *const *) table)[slot];
+    return block == NULL ? NONE : (int) (block->content_hash & mask);
+}
+
+void move_sealed_block_slot(void *table, int to, int from) {
+    struct block **blocks = table;
+    blocks[to] = from == NONE ? NULL : blocks[from];
+}
+
+/** The block pool must be locked. */
+void unindex_sealed_block(struct block *block) {
+    int mask = get_sealed_block_mask();
+    int hole = (int) (block->content_hash & mask);
+    while (sealed_blocks[hole] != block)
+        hole = (hole + 1) & mask;
+    backward_shift_delete(sealed_blocks, mask, hole, get_sealed_block_home, move_sealed_block_slot);
+    sealed_block_count--;
+    block->is_sealed = false;
+}
+
+/** A sealed block with the same content as @a memory, or NULL. The block pool must be locked. */
+struct block *find_sealed_block(uint64_t content_hash, const char *memory) {
+    if (sealed_block_count == 0)
+        return NULL;
+    int mask = get_sealed_block_mask();
+    for (int slot = (int) (content_hash & mask); sealed_blocks[slot] != NULL; slot = (slot + 1) & mask) {
+        struct block *candidate = sealed_blocks[slot];
+        if (candidate->content_hash != content_hash)
+            continue;
+        inflate_block(candidate);
+        if (memcmp(candidate->memory, memory, block_size) == 0)
+            return candidate;
+    }
+    return NULL;
+}
+
+/** The block is full and belongs only to the file. The file must be locked for writing. */
+void seal_block(struct file *file, int block_index) {
+    struct block *block = file->blocks[block_index];
+    uint64_t content_hash = get_content_hash(block->memory);
+    pthread_mutex_lock(&block_pool_lock);
+    struct block *twin = find_sealed_block(content_hash, block->memory);
+    if (twin != NULL) {
+        atomic_fetch_add(&twin->refs, 1);
+        file->blocks[block_index] = twin;
+        release_block(block);
+    } else {
+        block->content_hash = content_hash;
+        index_sealed_block(block);
+    }
+    pthread_mutex_unlock(&block_pool_lock);
+}
+
+void destroy_sealed_blocks() {
+    free(sealed_blocks);
+    sealed_blocks = NULL;
+    sealed_block_capacity = 0;
+    sealed_block_count = 0;
+    atomic_store(&is_dedup_enabled, false);
+}
+
+/** Makes the file have exactly @a block_count blocks. Freed blocks are at the end, new ones are holes. */
+void set_block_count(struct file *file, int block_count) {
+    const int GROWTH_FACTOR = 2;
+    if (file->block_count > block_count) {
+        int old_block_count = file->block_count;
+        pthread_mutex_lock(&block_pool_lock);
+        while (file->block_count > block_count)
+            release_block(file->blocks[--file->block_count]);
+        if (image != NULL)
+            image_truncate_index(file, block_count, old_block_count);
+        pthread_mutex_unlock(&block_pool_lock);
+    }
+    if (block_count > file->block_capacity) {
+        int new_capacity = file->block_capacity == 0 ? 1 : file->block_capacity;
+        while (new_capacity < block_count)
+            new_capacity *= GROWTH_FACTOR;
+        file->blocks = realloc(file->blocks, sizeof(struct block *) * new_capacity);
+        file->block_capacity = new_capacity;
+    }
+    while (file->block_count < block_count)
+        file->blocks[file->block_count++] = NULL;
+}
+
+/** Frees the memory of the file, but not its blocks. */
+void forget_file(struct file *file) {
+    free(file->name);
+    free(file->blocks);
+    free(file->index_blocks);
+    pthread_rwlock_destroy(&file->lock);
+    free(file);
+    live_file_count--;
+}
+
+/** The file must be already disconnected from its name shard and have no descriptors. */
+void delete_file(struct file *file) {
+    set_block_count(file, 0);
+    if (file->inode != NONE)
+        image_free_inode(file);
+    forget_file(file);
+}
+
+/*
+ * Stats and tracing. Each thread counts its operations into its own stripe of counters. Only the owner writes to a
+ * stripe, so it adds with a plain load and store instead of an atomic read-modify-write, and threads don't fight for
+ * the cache lines. ufs_stats() sums the stripes up. Reading the clock costs as much as a small read, so
+ * only every LATENCY_SAMPLE_PERIOD-th call of a thread is timed. The trace is a ring of the last operations behind a
+ * mutex, it is for debugging and costs nothing while off. While it is on, every call is timed.
+ */
+
+enum {
+    LATENCY_SAMPLE_PERIOD = 16,
+    TRACE_NAME_SIZE = 32,
+};
+
+struct op_counters {
+    atomic_size_t count;
+    atomic_size_t error_count;
+    atomic_size_t byte_count;
+    atomic_size_t latency_buckets[UFS_LATENCY_BUCKET_COUNT];
+};
+
+struct stat_stripe {
+    struct op_counters ops[UFS_OP_COUNT];
+    struct stat_stripe *next;
+    struct stat_stripe *prev;
+};
+
+/** Stripes of the running threads. A stripe of an exited thread is added to the retired counters and freed. */
+static struct stat_stripe *stat_stripes = NULL;
+static struct op_counters retired_op_counters[UFS_OP_COUNT];
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stat_stripe_key;
+static pthread_once_t stat_stripe_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stat_stripe *thread_stat_stripe = NULL;
+static __thread unsigned int thread_op_count = 0;
+
+struct trace_record {
+    uint64_t time_ns;
+    uint64_t latency_ns;
+    enum ufs_op op;
+    enum ufs_error_code error;
+    int fd;
+    size_t size;
+    ssize_t result;
+    /** File name of ufs_open() and ufs_delete(), cut to fit. */
+    char name[TRACE_NAME_SIZE];
+};
+
+static atomic_bool is_tracing = false;
+/** The last trace_capacity operations, the oldest is at trace_count % trace_capacity when the ring is full. */
+static struct trace_record *trace_ring = NULL;
+static int trace_capacity = 0;
+static uint64_t trace_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const OP_NAMES[UFS_OP_COUNT] = {
+        [UFS_OP_OPEN] = "open",
+        [UFS_OP_READ] = "read",
+        [UFS_OP_WRITE] = "write",
+        [UFS_OP_DELETE] = "delete",
+        [UFS_OP_RESIZE] = "resize",
+};
+
+uint64_t get_time_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Adds to a counter of the own stripe, or to a counter protected by the stat lock. */
+void add_to_counter(atomic_size_t *counter, size_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+void add_op_counters(struct op_counters *destination, struct op_counters *source) {
+    add_to_counter(&destination->count, atomic_load_explicit(&source->count, memory_order_relaxed));
+    add_to_counter(&destination->error_count, atomic_load_explicit(&source->error_count, memory_order_relaxed));
+    add_to_counter(&destination->byte_count, atomic_load_explicit(&source->byte_count, memory_order_relaxed));
+    for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i) {
+        add_to_counter(&destination->latency_buckets[i],
+                       atomic_load_explicit(&source->latency_buckets[i], memory_order_relaxed));
+    }
+}
+
+/** Destructor of the stripe of an exiting thread. */
+void retire_stat_stripe(void *arg) {
+    struct stat_stripe *stripe = arg;
+    pthread_mutex_lock(&stat_lock);
+    for (int i = 0; i < UFS_OP_COUNT; ++i)
+        add_op_counters(&retired_op_counters[i], &stripe->ops[i]);
+    if (stripe->prev != NULL)
+        stripe->prev->next = stripe->next;
+    else
+        stat_stripes = stripe->next;
+    if (stripe->next != NULL)
+        stripe->next->prev = stripe->prev;
+    pthread_mutex_unlock(&stat_lock);
+    free(stripe);
+}
+
+void create_stat_stripe_key() {
+    pthread_key_create(&stat_stripe_key, retire_stat_stripe);
+}
+
+struct stat_stripe *get_stat_stripe() {
+    if (thread_stat_stripe != NULL)
+        return thread_stat_stripe;
+    pthread_once(&stat_stripe_key_once, create_stat_stripe_key);
+    struct stat_stripe *stripe = calloc(1, sizeof(struct stat_stripe));
+    pthread_mutex_lock(&stat_lock);
+    stripe->next = stat_stripes;
+    if (stat_stripes != NULL)
+        stat_stripes->prev = stripe;
+    stat_stripes = stripe;
+    pthread_mutex_unlock(&stat_lock);
+    pthread_setspecific(stat_stripe_key, stripe);
+    thread_stat_stripe = stripe;
+    return stripe;
+}
+
+/** Start time of an operation, or 0 if its latency is not measured. */
+uint64_t start_op() {
+    if (thread_op_count++ % LATENCY_SAMPLE_PERIOD == 0 || atomic_load_explicit(&is_tracing, memory_order_relaxed))
+        return get_time_ns();
+    return 0;
+}
+
+/** Bucket 0 is for 0 ns, bucket i for [2^(i - 1), 2^i) ns, the last one takes all the longer latencies too. */
+int get_latency_bucket(uint64_t latency_ns) {
+    int bucket = latency_ns == 0 ? 0 : 64 - __builtin_clzll(latency_ns);
+    return bucket < UFS_LATENCY_BUCKET_COUNT ? bucket : UFS_LATENCY_BUCKET_COUNT - 1;
+}
+
+void trace_op(enum ufs_op op, uint64_t start_ns, uint64_t latency_ns, int fd, const char *name, size_t size,
+              ssize_t result) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_ring != NULL) {
+        struct trace_record *record = &trace_ring[trace_count++ % trace_capacity];
+        *record = (struct trace_record) {
+                .time_ns = start_ns,
+                .latency_ns = latency_ns,
+                .op = op,
+                .error = result < 0 ? ufs_error_code : UFS_ERR_NO_ERR,
+                .fd = fd,
+                .size = size,
+                .result = result
+        };
+        if (name != NULL)
+            snprintf(record->name, TRACE_NAME_SIZE, "%s", name);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Counts the operation which started at @a start_ns from start_op() and returned @a result. @a fd is NONE and @a name
+ * is NULL if the operation has none of them.
+ */
+void record_op(enum ufs_op op, uint64_t start_ns, int fd, const char *name, size_t size, ssize_t result) {
+    struct op_counters *counters = &get_stat_stripe()->ops[op];
+    add_to_counter(&counters->count, 1);
+    if (result < 0)
+        add_to_counter(&counters->error_count, 1);
+    else if (op == UFS_OP_READ || op == UFS_OP_WRITE)
+        add_to_counter(&counters->byte_count, result);
+    if (start_ns == 0)
+        return;
+    uint64_t latency_ns = get_time_ns() - start_ns;
+    add_to_counter(&counters->latency_buckets[get_latency_bucket(latency_ns)], 1);
+    if (atomic_load_explicit(&is_tracing, memory_order_relaxed))
+        trace_op(op, start_ns, latency_ns, fd, name, size, result);
+}
+
+void reset_op_counters(struct op_counters *counters) {
+    atomic_store(&counters->count, 0);
+    atomic_store(&counters->error_count, 0);
+    atomic_store(&counters->byte_count, 0);
+    for (int i = 0; i < UFS_LATENCY_BUCKET_COUNT; ++i)
+        atomic_store(&counters->latency_buckets[i], 0);
+}
+
+/** Resets the counters. The stripes stay, their threads keep pointers to them. */
+void destroy_stats() {
+    pthread_mutex_lock(&stat_lock);
+    for (int i = 0; i < UFS_OP_COUNT; ++i) {
+        reset_op_counters(&retired_op_counters[i]);
+        for (struct stat_stripe *stripe = stat_stripes; stripe != NULL; stripe = stripe->next)
+            reset_op_counters(&stripe->ops[i]);
+    }
+    pthread_mutex_unlock(&stat_lock);
+    ufs_trace_stop();
+    pthread_mutex_lock(&trace_lock);
+    free(trace_ring);
+    trace_ring = NULL;
+    trace_capacity = 0;
+    trace_count = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+enum ufs_error_code
+ufs_errno() {
+    return ufs_error_code;
+}
+
+int throw_error(int specific_error) {
+    ufs_error_code = specific_error;
+    return -1;
+}
+
+/** Like try_get_file_by_filename(), but in image mode also loads a file which is not opened yet. */
+struct file *try_find_file(struct name_shard *shard, unsigned int name_hash, const char *filename) {
+    struct file *file = try_get_file_by_filename(shard, name_hash, filename);
+    if (file != NULL || image == NULL)
+        return file;
+    int inode = image_find_inode(filename, name_hash);
+    if (inode == NONE)
+        return NULL;
+    file = create_file(shard, filename, name_hash);
+    load_image_file_content(file, inode);
+    return file;
+}
+
+/** Like create_file(), but also makes the file in the image. Returns NULL and sets the error code on failure. */
+struct file *create_new_file(struct name_shard *shard, const char *filename, unsigned int name_hash) {
+    if (image != NULL && strlen(filename) > IMAGE_MAX_NAME_LENGTH) {
+        throw_error(UFS_ERR_INVALID_ARGUMENT);
+        return NULL;
+    }
+    if (image == NULL && !add_file_entry(filename))
+        return NULL;
+    struct file *file = create_file(shard, filename, name_hash);
+    if (image != NULL && !image_create_inode(file)) {
+        disconnect_file_from_file_list(shard, file);
+        delete_file(file);
+        throw_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    return file;
+}
+
+int open_file(const char *filename, int flags) {
+    unsigned int name_hash = get_name_hash(filename);
+    struct name_shard *shard = get_name_shard(name_hash);
+    pthread_mutex_lock(&shard->lock);
+    struct file *referred_file = try_find_file(shard, name_hash, filename);
+    if (referred_file == NULL) {
+        if (!specific_flag_is_present(flags, UFS_CREATE)) {
+            pthread_mutex_unlock(&shard->lock);
+            return throw_error(UFS_ERR_NO_FILE);
+        }
+        referred_file = create_new_file(shard, filename, name_hash);
+        if (referred_file == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+    }
+    struct filedesc *file_descriptor = malloc(sizeof(struct filedesc));
+    *file_descriptor = (struct filedesc) {
+            .file = referred_file,
+            .position = 0,
+            .flags = flags
+    };
+    pthread_mutex_init(&file_descriptor->position_lock, NULL);
+
+    // The reference is taken under the shard lock, so ufs_delete() can't free the file in between
+    pthread_rwlock_wrlock(&referred_file->lock);
+    referred_file->refs++;
+    link_descriptor_to_file(file_descriptor);
+    pthread_rwlock_unlock(&referred_file->lock);
+    pthread_mutex_unlock(&shard->lock);
+
+    return add_file_descriptor(file_descriptor);
+}
+
+int
+ufs_open(const char *filename, int flags) {
+    uint64_t start_ns = start_op();
+    ensure_initialized();
+    lock_image_metadata();
+    int fd = open_file(filename, flags);
+    unlock_image_metadata();
+    record_op(UFS_OP_OPEN, start_ns, fd, filename, 0, fd);
+    return fd;
+}
+
+
+/** How many bytes starting from @a position lie in the same block, but no more than @a bytes_left. */
+int get_contiguous_span(int position, int bytes_left) {
+    int bytes_left_in_block = block_size - (position & (block_size - 1));
+    return bytes_left < bytes_left_in_block ? bytes_left : bytes_left_in_block;
+}
+
+char *get_file_memory_at(struct file *file, int position) {
+    return get_block_memory(file->blocks[position >> block_size_log2]) + (position & (block_size - 1));
+}
+
+/** NULL for a hole, including the part of the file past the end of its index. */
+struct block *get_file_block(const struct file *file, int block_index) {
+    return block_index < file->block_count ? file->blocks[block_index] : NULL;
+}
+
+/** Like get_file_memory_at(), but a hole gives the shared zero block. */
+const char *get_readable_memory_at(struct file *file, int position) {
+    if (get_file_block(file, position >> block_size_log2) == NULL)
+        return zero_memory;
+    return get_file_memory_at(file, position);
+}
+
+/**
+ * Makes the block at @a block_index belong only to the file, copying a shared one. A hole becomes a new block.
+ * Bytes from @a offset to @a offset + @a span are going to be overwritten, so they are not copied or zeroed.
+ * Returns false if the image is full.
+ */
+bool make_block_writable(struct file *file, int block_index, int offset, int span) {
+    struct block **block = &file->blocks[block_index];
+    // With the file locked for writing nobody can add a reference or a pin, so 1 and 0 can't change. A sealed block
+    // may be found by its content at any moment, so it is never changed
+    if (*block != NULL && atomic_load(&(*block)->refs) == 1 && atomic_load(&(*block)->pins) == 0 &&
+        !(*block)->is_sealed)
+        return true;
+    struct block *new_block = create_block();
+    if (new_block == NULL)
+        return false;
+    if (image != NULL && !image_set_index_entry(file, block_index, new_block)) {
+        release_block(new_block);
+        return false;
+    }
+    if (*block == NULL) {
+        memset(new_block->memory, 0, offset);
+        memset(new_block->memory + offset + span, 0, block_size - offset - span);
+    } else {
+        const char *memory = get_block_memory(*block);
+        memcpy(new_block->memory, memory, offset);
+        memcpy(new_block->memory + offset + span, memory + offset + span, block_size - offset - span);
+        pthread_mutex_lock(&block_pool_lock);
+        release_block(*block);
+        pthread_mutex_unlock(&block_pool_lock);
+    }
+    *block = new_block;
+    return true;
+}
+
+int write_to_file(struct file *file, int position, const char *buf, size_t size) {
+    if ((long long) position + (long long) size > MAX_FILE_SIZE)
+        return throw_error(UFS_ERR_NO_MEM);
+    // Vectored and ring writes run in one transaction
+    if (image != NULL && !image_make_room_for_call())
+        return throw_error(UFS_ERR_NO_MEM);
+    int end_size = position + (int) size;
+    if (get_block_count_for_size(end_size) > file->block_count)
+        set_block_count(file, get_block_count_for_size(end_size));
+
+    int written = 0;
+    while (written < (int) size) {
+        int span = get_contiguous_span(position, (int) size - written);
+        if (!make_block_writable(file, position >> block_size_log2, position & (block_size - 1), span))
+            break;
+        memcpy(get_file_memory_at(file, position), buf + written, span);
+        written += span;
+        position += span;
+        if ((position & (block_size - 1)) == 0 && atomic_load_explicit(&is_dedup_enabled, memory_order_relaxed))
+            seal_block(file, (position >> block_size_log2) - 1);
+    }
+    if (position > file->size)
+        file->size = position;
+    // After a failed write the index may go past the file end. Blocks there are holes, so they are dropped with no harm
+    if (file->block_count > get_block_count_for_size(file->size))
+        set_block_count(file, get_block_count_for_size(file->size));
+    if (file->inode != NONE)
+        image_sync_inode(file);
+    if (written == 0 && size > 0)
+        return throw_error(UFS_ERR_NO_MEM);
+    return written;
+}
+
+int read_from_file(struct file *file, int position, char *buf, size_t size) {
+    if (position >= file->size)
+        return 0;
+    int bytes_left_to_read = file->size - position;
+    int read_count = (size > (size_t) bytes_left_to_read ? bytes_left_to_read : (int) size);
+
+    int read_so_far = 0;
+    while (read_so_far < read_count) {
+        int span = get_contiguous_span(position, read_count - read_so_far);
+        memcpy(buf + read_so_far, get_readable_memory_at(file, position), span);
+        read_so_far += span;
+        position += span;
+    }
+
+    return read_count;
+}
+
+int write_via_descriptor(struct filedesc *descriptor, const char *buf, size_t size) {
+    lock_image_metadata();
+    pthread_mutex_lock(&descriptor->position_lock);
+    pthread_rwlock_wrlock(&descriptor->file->lock);
+    int written = write_to_file(descriptor->file, descriptor->position, buf, size);
+    if (written > 0)
+        descriptor->position += written;
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+    unlock_image_metadata();
+    return written;
+}
+
+int read_via_descriptor(struct filedesc *descriptor, char *buf, size_t size) {
+    pthread_mutex_lock(&descriptor->position_lock);
+    pthread_rwlock_rdlock(&descriptor->file->lock);
+    int read_count = read_from_file(descriptor->file, descriptor->position, buf, size);
+    descriptor->position += read_count;
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+    return read_count;
+}
+
+int write_by_fd(int fd, const char *buf, size_t size) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+
+    if (specific_flag_is_present(descriptor->flags, UFS_READ_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+
+    return write_via_descriptor(descriptor, buf, size);
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size) {
+    uint64_t start_ns = start_op();
+    ssize_t written = write_by_fd(fd, buf, size);
+    record_op(UFS_OP_WRITE, start_ns, fd, NULL, size, written);
+    return written;
+}
+
+int read_by_fd(int fd, char *buf, size_t size) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_WRITE_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    return read_via_descriptor(descriptor, buf, size);
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size) {
+    uint64_t start_ns = start_op();
+    ssize_t read_count = read_by_fd(fd, buf, size);
+    record_op(UFS_OP_READ, start_ns, fd, NULL, size, read_count);
+    return read_count;
+}
+
+int
+ufs_close(int fd) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    lock_image_metadata();
+    close_file_descriptor(descriptor);
+    unlock_image_metadata();
+    return UFS_ERR_NO_ERR;
+}
+
+int delete_by_name(const char *filename) {
+    ensure_initialized();
+    unsigned int name_hash = get_name_hash(filename);
+    struct name_shard *shard = get_name_shard(name_hash);
+    lock_image_metadata();
+    pthread_mutex_lock(&shard->lock);
+    struct file *referred_file = try_find_file(shard, name_hash, filename);
+    if (referred_file == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        unlock_image_metadata();
+        return throw_error(UFS_ERR_NO_FILE);
+    }
+    disconnect_file_from_file_list(shard, referred_file);
+    if (image != NULL)
+        image_unindex_name(referred_file);
+    else
+        remove_file_entry(filename);
+    pthread_rwlock_wrlock(&referred_file->lock);
+    referred_file->marked_for_deletion = true;
+    bool has_descriptors = referred_file->refs > 0;
+    pthread_rwlock_unlock(&referred_file->lock);
+    pthread_mutex_unlock(&shard->lock);
+    if (!has_descriptors)
+        delete_file(referred_file);
+    else if (image != NULL)
+        image_add_orphan(referred_file);
+    unlock_image_metadata();
+    return UFS_ERR_NO_ERR;
 }
 
 int
-ufs_resize(int fd, size_t new_size) {
+ufs_delete(const char *filename) {
+    uint64_t start_ns = start_op();
+    int result = delete_by_name(filename);
+    record_op(UFS_OP_DELETE, start_ns, NONE, filename, 0, result);
+    return result;
+}
+
+void free_snapshot(struct snapshot *snapshot) {
+    if (snapshot == NULL)
+        return;
+    for (int i = 0; i < snapshot->file_count; ++i) {
+        free(snapshot->files[i].name);
+        release_blocks(snapshot->files[i].blocks, snapshot->files[i].block_count);
+    }
+    free(snapshot->files);
+    free(snapshot);
+}
+
+void
+ufs_destroy(void) {
+    lock_image_metadata();
+    for (int i = 0; i < file_descriptor_count; ++i) {
+        if (file_descriptors[i].descriptor != NULL)
+            close_file_descriptor(file_descriptors[i].descriptor);
+    }
+    free(file_descriptors);
+    file_descriptors = NULL;
+    file_descriptor_count = 0;
+    file_descriptor_capacity = 0;
+    free_file_descriptor_slot = NONE;
+    open_file_descriptor_count = 0;
+
+    for (int i = 0; i < snapshot_count; ++i)
+        free_snapshot(snapshots[i]);
+    free(snapshots);
+    snapshots = NULL;
+    snapshot_count = 0;
+    snapshot_capacity = 0;
+    live_snapshot_count = 0;
+
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        struct name_shard *shard = &name_shards[i];
+        while (shard->file_list != NULL) {
+            struct file *file = shard->file_list;
+            disconnect_file_from_file_list(shard, file);
+            // Files of the image stay there
+            if (file->inode != NONE)
+                forget_file(file);
+            else
+                delete_file(file);
+        }
+        free(shard->file_index);
+        shard->file_index = NULL;
+        shard->file_index_capacity = 0;
+        shard->file_index_count = 0;
+    }
+    destroy_directory(&root_directory);
+    if (image != NULL) {
+        unmount_image();
+        pthread_mutex_unlock(&image_lock);
+    }
+    atomic_store(&is_initialized, false);
+    destroy_sealed_blocks();
+    destroy_block_pool();
+    destroy_stats();
+    block_size = DEFAULT_BLOCK_SIZE;
+    block_size_log2 = 12;
+}
+
+/** Gives the file a new content, taking the ownership of @a blocks. The file must be locked for writing. */
+void replace_file_content(struct file *file, struct block **blocks, int block_count, int size) {
+    struct block **old_blocks = file->blocks;
+    int old_block_count = file->block_count;
+    if (file->inode != NONE)
+        image_truncate_index(file, 0, old_block_count);
+    file->blocks = blocks;
+    file->block_count = block_count;
+    file->block_capacity = block_count > 0 ? block_count : 1;
+    file->size = size;
+    for (struct filedesc *descriptor = file->descriptor_list; descriptor != NULL;
+         descriptor = descriptor->next_on_file) {
+        if (descriptor->position > size)
+            descriptor->position = size;
+    }
+    release_blocks(old_blocks, old_block_count);
+    if (file->inode == NONE)
+        return;
+    // The caller made sure the image has space for the index
+    for (int i = 0; i < block_count; ++i) {
+        if (blocks[i] != NULL)
+            image_set_index_entry(file, i, blocks[i]);
+    }
+    image_sync_inode(file);
+}
+
+/** Like set_file_content_by_name(), but the shard of the name must be locked. */
+bool set_file_content_in_shard(struct name_shard *shard, const char *filename, unsigned int name_hash,
+                               struct block **blocks, int block_count, int size) {
+    struct file *file = try_find_file(shard, name_hash, filename);
+    if (file == NULL)
+        file = create_new_file(shard, filename, name_hash);
+    if (file == NULL) {
+        release_blocks(blocks, block_count);
+        return false;
+    }
+    pthread_rwlock_wrlock(&file->lock);
+    replace_file_content(file, blocks, block_count, size);
+    pthread_rwlock_unlock(&file->lock);
+    return true;
+}
+
+/**
+ * Creates the file if needed and gives it the content. On failure the blocks are released and the error code is
+ * set.
+ */
+bool set_file_content_by_name(const char *filename, unsigned int name_hash, struct block **blocks, int block_count,
+                              int size) {
+    struct name_shard *shard = get_name_shard(name_hash);
+    pthread_mutex_lock(&shard->lock);
+    bool is_set = set_file_content_in_shard(shard, filename, name_hash, blocks, block_count, size);
+    pthread_mutex_unlock(&shard->lock);
+    return is_set;
+}
+
+/** Returns false if the image is full, then the file doesn't change. */
+bool reduce_file_size(struct file *file, int new_size) {
+    // Keep the bytes beyond the file end zeroed. The block is copied first, so a full image leaves the file intact
+    int new_block_count = get_block_count_for_size(new_size);
+    int tail_size = (new_block_count << block_size_log2) - new_size;
+    if (tail_size > 0 && get_file_block(file, new_block_count - 1) != NULL) {
+        if (!make_block_writable(file, new_block_count - 1, block_size - tail_size, tail_size))
+            return false;
+        memset(get_file_memory_at(file, new_size), 0, tail_size);
+    }
+    if (file->block_count > new_block_count)
+        set_block_count(file, new_block_count);
+    file->size = new_size;
+    if (file->inode != NONE)
+        image_sync_inode(file);
+
+    for (struct filedesc *descriptor = file->descriptor_list; descriptor != NULL;
+         descriptor = descriptor->next_on_file) {
+        if (descriptor->position > new_size)
+            descriptor->position = new_size;
+    }
+    return true;
+}
+
+/** Grows the file with a hole in O(1): the index stays as it is. */
+void extend_file_size(struct file *file, int new_size) {
+    file->size = new_size;
+    if (file->inode != NONE)
+        image_sync_inode(file);
+}
+
+int resize_by_fd(int fd, size_t new_size) {
     struct filedesc *descriptor = try_get_file_descriptor(fd);
     if (descriptor == NULL)
         return throw_error(UFS_ERR_NO_FILE);
     if (new_size >= MAX_FILE_SIZE)
         return throw_error(UFS_ERR_NO_MEM);
-    reduce_file_size(descriptor->file, new_size);
+    struct file *file = descriptor->file;
+    lock_image_metadata();
+    pthread_rwlock_wrlock(&file->lock);
+    bool is_resized = true;
+    if ((int) new_size < file->size)
+        is_resized = reduce_file_size(file, (int) new_size);
+    else
+        extend_file_size(file, (int) new_size);
+    pthread_rwlock_unlock(&file->lock);
+    unlock_image_metadata();
+    if (!is_resized)
+        return throw_error(UFS_ERR_NO_MEM);
+    return 0;
+}
+
+int
+ufs_resize(int fd, size_t new_size) {
+    uint64_t start_ns = start_op();
+    int result = resize_by_fd(fd, new_size);
+    record_op(UFS_OP_RESIZE, start_ns, fd, NULL, new_size, result);
+    return result;
+}
+
+off_t
+ufs_lseek(int fd, off_t offset, int whence) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (whence != UFS_SEEK_SET && whence != UFS_SEEK_CUR && whence != UFS_SEEK_END)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+
+    pthread_mutex_lock(&descriptor->position_lock);
+    // Resize moves positions under the file lock
+    pthread_rwlock_rdlock(&descriptor->file->lock);
+    off_t base = 0;
+    if (whence == UFS_SEEK_CUR)
+        base = descriptor->position;
+    else if (whence == UFS_SEEK_END)
+        base = descriptor->file->size;
+    off_t new_position = base + offset;
+    int error = UFS_ERR_NO_ERR;
+    if (new_position < 0)
+        error = UFS_ERR_INVALID_ARGUMENT;
+    else if (new_position > MAX_FILE_SIZE)
+        error = UFS_ERR_NO_MEM;
+    else
+        descriptor->position = (int) new_position;
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+
+    if (error != UFS_ERR_NO_ERR)
+        return throw_error(error);
+    return new_position;
+}
+
+int pread_by_fd(int fd, char *buf, size_t size, off_t offset) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_WRITE_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    if (offset < 0)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    if (offset > MAX_FILE_SIZE)
+        return 0;
+    pthread_rwlock_rdlock(&descriptor->file->lock);
+    int read_count = read_from_file(descriptor->file, (int) offset, buf, size);
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    return read_count;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, off_t offset) {
+    uint64_t start_ns = start_op();
+    ssize_t read_count = pread_by_fd(fd, buf, size, offset);
+    record_op(UFS_OP_READ, start_ns, fd, NULL, size, read_count);
+    return read_count;
+}
+
+int pwrite_by_fd(int fd, const char *buf, size_t size, off_t offset) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_READ_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    if (offset < 0)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    if (offset > MAX_FILE_SIZE)
+        return throw_error(UFS_ERR_NO_MEM);
+    lock_image_metadata();
+    pthread_rwlock_wrlock(&descriptor->file->lock);
+    int written = write_to_file(descriptor->file, (int) offset, buf, size);
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    unlock_image_metadata();
+    return written;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, off_t offset) {
+    uint64_t start_ns = start_op();
+    ssize_t written = pwrite_by_fd(fd, buf, size, offset);
+    record_op(UFS_OP_WRITE, start_ns, fd, NULL, size, written);
+    return written;
+}
+
+struct ufs_mapping {
+    /** Pinned blocks of the spans, NULL for holes. */
+    struct block **blocks;
+    int block_count;
+};
+
+/** Fills @a spans with pinned blocks of the file. Returns how many bytes are mapped. The file must be locked. */
+int map_file_range(struct file *file, int position, size_t size, struct ufs_span *spans, int span_count,
+                   int *filled_span_count, struct ufs_mapping **mapping) {
+    *filled_span_count = 0;
+    *mapping = NULL;
+    if (position >= file->size || size == 0 || span_count <= 0)
+        return 0;
+    int bytes_left = file->size - position < (long long) size ? file->size - position : (int) size;
+    int max_span_count = get_block_count_for_size(bytes_left) + 1;
+    if (span_count > max_span_count)
+        span_count = max_span_count;
+    struct ufs_mapping *new_mapping = malloc(sizeof(struct ufs_mapping));
+    new_mapping->blocks = malloc(sizeof(struct block *) * span_count);
+    new_mapping->block_count = 0;
+    int mapped = 0;
+    while (bytes_left > 0 && new_mapping->block_count < span_count) {
+        int span = get_contiguous_span(position, bytes_left);
+        struct block *block = get_file_block(file, position >> block_size_log2);
+        // A write would need the file write lock, so the block can't be replaced while it is pinned
+        if (block != NULL)
+            atomic_fetch_add(&block->pins, 1);
+        spans[new_mapping->block_count] = (struct ufs_span) {
+                .data = get_readable_memory_at(file, position),
+                .size = span
+        };
+        new_mapping->blocks[new_mapping->block_count++] = block;
+        mapped += span;
+        position += span;
+        bytes_left -= span;
+    }
+    *filled_span_count = new_mapping->block_count;
+    *mapping = new_mapping;
+    return mapped;
+}
+
+int
+ufs_map_range(int fd, off_t offset, size_t size, struct ufs_span *spans, int span_count,
+              struct ufs_mapping **mapping) {
+    *mapping = NULL;
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_WRITE_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    if (offset < 0)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    if (offset > MAX_FILE_SIZE)
+        return 0;
+    int filled_span_count;
+    pthread_rwlock_rdlock(&descriptor->file->lock);
+    map_file_range(descriptor->file, (int) offset, size, spans, span_count, &filled_span_count, mapping);
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    return filled_span_count;
+}
+
+int
+ufs_read_iov(int fd, size_t size, struct ufs_span *spans, int span_count, struct ufs_mapping **mapping) {
+    *mapping = NULL;
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_WRITE_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    int filled_span_count;
+    pthread_mutex_lock(&descriptor->position_lock);
+    pthread_rwlock_rdlock(&descriptor->file->lock);
+    descriptor->position += map_file_range(descriptor->file, descriptor->position, size, spans, span_count,
+                                           &filled_span_count, mapping);
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+    return filled_span_count;
+}
+
+void
+ufs_unmap(struct ufs_mapping *mapping) {
+    if (mapping == NULL)
+        return;
+    // The last pin of a deleted block frees it, which is a metadata change in image mode
+    lock_image_metadata();
+    pthread_mutex_lock(&block_pool_lock);
+    for (int i = 0; i < mapping->block_count; ++i)
+        unpin_block(mapping->blocks[i]);
+    pthread_mutex_unlock(&block_pool_lock);
+    unlock_image_metadata();
+    free(mapping->blocks);
+    free(mapping);
+}
+
+ssize_t
+ufs_write_iov(int fd, const struct ufs_span *spans, int span_count) {
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    if (specific_flag_is_present(descriptor->flags, UFS_READ_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+
+    lock_image_metadata();
+    pthread_mutex_lock(&descriptor->position_lock);
+    pthread_rwlock_wrlock(&descriptor->file->lock);
+    ssize_t total_written = 0;
+    for (int i = 0; i < span_count; ++i) {
+        if (spans[i].size == 0)
+            continue;
+        int written = write_to_file(descriptor->file, descriptor->position, spans[i].data, spans[i].size);
+        if (written < 0 && total_written == 0)
+            total_written = -1;
+        if (written <= 0)
+            break;
+        descriptor->position += written;
+        total_written += written;
+        if ((size_t) written < spans[i].size)
+            break;
+    }
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+    unlock_image_metadata();
+    return total_written;
+}
+
+#ifdef NEED_BLOCK_SIZE
+
+int
+ufs_set_block_size(size_t new_block_size) {
+    if (new_block_size < MIN_BLOCK_SIZE || new_block_size > MAX_BLOCK_SIZE ||
+        (new_block_size & (new_block_size - 1)) != 0)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    // The image has its block size from the moment it is made
+    if (image != NULL && (int) new_block_size != block_size)
+        return throw_error(UFS_ERR_NOT_EMPTY);
+    if (live_file_count > 0 || live_snapshot_count > 0)
+        return throw_error(UFS_ERR_NOT_EMPTY);
+    if ((int) new_block_size == block_size)
+        return 0;
+    // Pooled blocks have the old size
+    destroy_block_pool();
+    block_size = (int) new_block_size;
+    block_size_log2 = 0;
+    while ((1 << block_size_log2) < block_size)
+        block_size_log2++;
+    return 0;
+}
+
+#endif
+
+int
+ufs_set_dedup(int is_enabled) {
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    atomic_store(&is_dedup_enabled, is_enabled != 0);
+    return 0;
+}
+
+int
+ufs_compress_cold_blocks(void) {
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    unsigned char *buffer = malloc(block_size);
+    int compressed_count = 0;
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        pthread_mutex_lock(&name_shards[i].lock);
+        for (struct file *file = name_shards[i].file_list; file != NULL; file = file->next) {
+            // Readers use the block memory without the pool lock, so the file is locked for writing. Only blocks
+            // of this file alone with no pins are compressed, nobody else can read them meanwhile
+            pthread_rwlock_wrlock(&file->lock);
+            pthread_mutex_lock(&block_pool_lock);
+            for (int j = 0; j < file->block_count; ++j) {
+                struct block *block = file->blocks[j];
+                if (block == NULL || atomic_load(&block->refs) != 1 || atomic_load(&block->pins) != 0 ||
+                    block->memory == NULL)
+                    continue;
+                // A block used since the previous call only becomes cold
+                if (atomic_exchange(&block->is_hot, false))
+                    continue;
+                if (compress_block(block, buffer))
+                    compressed_count++;
+            }
+            pthread_mutex_unlock(&block_pool_lock);
+            pthread_rwlock_unlock(&file->lock);
+        }
+        pthread_mutex_unlock(&name_shards[i].lock);
+    }
+    free(buffer);
+    return compressed_count;
+}
+
+int
+ufs_get_space_stats(struct ufs_space_stats *stats) {
+    ensure_initialized();
+    memset(stats, 0, sizeof(*stats));
+    if (image != NULL) {
+        // Not all the files are loaded, the inodes know the sizes of all of them
+        lock_image_metadata();
+        for (uint32_t i = 0; i < image->superblock->inode_count; ++i) {
+            struct image_inode *inode = get_image_inode((int) i);
+            if (inode->is_used)
+                stats->logical_bytes += inode->size;
+        }
+        stats->block_count = image->superblock->block_count - get_image_free_block_count();
+        stats->physical_bytes = stats->block_count * block_size;
+        unlock_image_metadata();
+        return 0;
+    }
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        pthread_mutex_lock(&name_shards[i].lock);
+        for (struct file *file = name_shards[i].file_list; file != NULL; file = file->next) {
+            pthread_rwlock_rdlock(&file->lock);
+            stats->logical_bytes += file->size;
+            pthread_rwlock_unlock(&file->lock);
+        }
+        pthread_mutex_unlock(&name_shards[i].lock);
+    }
+    pthread_mutex_lock(&block_pool_lock);
+    stats->block_count = used_block_count;
+    stats->sealed_block_count = sealed_block_count;
+    stats->compressed_block_count = compressed_block_count;
+    stats->physical_bytes = (used_block_count - compressed_block_count) * block_size + compressed_byte_count;
+    pthread_mutex_unlock(&block_pool_lock);
+    return 0;
+}
+
+int
+ufs_mkdir(const char *path) {
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    if (!is_valid_path(path))
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    const char *name;
+    struct directory *parent = lock_parent_directory(path, true, &name);
+    if (parent == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    bool exists = find_entry(parent, name, strlen(name)) != NULL;
+    if (!exists) {
+        struct directory *directory = calloc(1, sizeof(struct directory));
+        pthread_rwlock_init(&directory->lock, NULL);
+        add_entry(parent, name, directory);
+    }
+    pthread_rwlock_unlock(&parent->lock);
+    return exists ? throw_error(UFS_ERR_EXISTS) : 0;
+}
+
+int
+ufs_rmdir(const char *path) {
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    if (!is_valid_path(path))
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    const char *name;
+    struct directory *parent = lock_parent_directory(path, true, &name);
+    if (parent == NULL)
+        return throw_error(UFS_ERR_NO_FILE);
+    struct directory_entry *entry = find_entry(parent, name, strlen(name));
+    if (entry == NULL || entry->directory == NULL) {
+        pthread_rwlock_unlock(&parent->lock);
+        return throw_error(UFS_ERR_NO_FILE);
+    }
+    struct directory *directory = entry->directory;
+    // Somebody may still hold the directory, having passed the parent before. Nobody new can get to it
+    pthread_rwlock_wrlock(&directory->lock);
+    bool is_empty = directory->entry_count == 0;
+    pthread_rwlock_unlock(&directory->lock);
+    if (is_empty)
+        remove_entry(parent, entry);
+    pthread_rwlock_unlock(&parent->lock);
+    if (!is_empty)
+        return throw_error(UFS_ERR_NOT_EMPTY);
+    free(directory->entries);
+    pthread_rwlock_destroy(&directory->lock);
+    free(directory);
+    return 0;
+}
+
+int
+ufs_readdir(const char *path, struct ufs_dirent **entries) {
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    struct directory *directory = &root_directory;
+    if (path[0] == '\0') {
+        pthread_rwlock_rdlock(&directory->lock);
+    } else {
+        if (!is_valid_path(path))
+            return throw_error(UFS_ERR_INVALID_ARGUMENT);
+        const char *name;
+        struct directory *parent = lock_parent_directory(path, false, &name);
+        if (parent == NULL)
+            return throw_error(UFS_ERR_NO_FILE);
+        struct directory_entry *entry = find_entry(parent, name, strlen(name));
+        if (entry == NULL || entry->directory == NULL) {
+            pthread_rwlock_unlock(&parent->lock);
+            return throw_error(UFS_ERR_NO_FILE);
+        }
+        directory = entry->directory;
+        pthread_rwlock_rdlock(&directory->lock);
+        pthread_rwlock_unlock(&parent->lock);
+    }
+    // One allocation for the entries and their names after them
+    size_t size = sizeof(struct ufs_dirent) * directory->entry_count;
+    for (int i = 0; i < directory->entry_capacity; ++i) {
+        if (directory->entries[i].name != NULL)
+            size += strlen(directory->entries[i].name) + 1;
+    }
+    struct ufs_dirent *result = malloc(size > 0 ? size : 1);
+    char *names = (char *) (result + directory->entry_count);
+    int count = 0;
+    for (int i = 0; i < directory->entry_capacity; ++i) {
+        const struct directory_entry *entry = &directory->entries[i];
+        if (entry->name == NULL)
+            continue;
+        size_t name_size = strlen(entry->name) + 1;
+        memcpy(names, entry->name, name_size);
+        result[count++] = (struct ufs_dirent) {.name = names, .is_directory = entry->directory != NULL};
+        names += name_size;
+    }
+    pthread_rwlock_unlock(&directory->lock);
+    *entries = result;
+    return count;
+}
+
+#ifdef NEED_SNAPSHOTS
+
+int
+ufs_clone(const char *source_name, const char *destination_name) {
+    ensure_initialized();
+    unsigned int source_hash = get_name_hash(source_name);
+    struct name_shard *shard = get_name_shard(source_hash);
+    lock_image_metadata();
+    pthread_mutex_lock(&shard->lock);
+    struct file *source = try_find_file(shard, source_hash, source_name);
+    if (source == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        unlock_image_metadata();
+        return throw_error(UFS_ERR_NO_FILE);
+    }
+    pthread_rwlock_rdlock(&source->lock);
+    int block_count = source->block_count;
+    int size = source->size;
+    // The index of the clone needs its own blocks
+    int entries_per_block = image != NULL ? get_index_entries_per_block() : 1;
+    if (image != NULL &&
+        get_image_free_block_count() < (uint32_t) ((block_count + entries_per_block - 1) / entries_per_block + 1)) {
+        pthread_rwlock_unlock(&source->lock);
+        pthread_mutex_unlock(&shard->lock);
+        unlock_image_metadata();
+        return throw_error(UFS_ERR_NO_MEM);
+    }
+    struct block **blocks = share_blocks(source->blocks, block_count);
+    pthread_rwlock_unlock(&source->lock);
+    pthread_mutex_unlock(&shard->lock);
+
+    bool is_cloned = set_file_content_by_name(destination_name, get_name_hash(destination_name), blocks, block_count,
+                                              size);
+    unlock_image_metadata();
+    return is_cloned ? 0 : -1;
+}
+
+void add_file_to_snapshot(struct snapshot *snapshot, struct file *file) {
+    const int GROWTH_FACTOR = 2;
+    if (snapshot->file_count == snapshot->file_capacity) {
+        snapshot->file_capacity = snapshot->file_capacity == 0 ? 1 : snapshot->file_capacity * GROWTH_FACTOR;
+        snapshot->files = realloc(snapshot->files, sizeof(struct snapshot_file) * snapshot->file_capacity);
+    }
+    pthread_rwlock_rdlock(&file->lock);
+    snapshot->files[snapshot->file_count++] = (struct snapshot_file) {
+            .name = strdup(file->name),
+            .name_hash = file->name_hash,
+            .blocks = share_blocks(file->blocks, file->block_count),
+            .block_count = file->block_count,
+            .size = file->size
+    };
+    pthread_rwlock_unlock(&file->lock);
+}
+
+int
+ufs_snapshot_create(void) {
+    const int GROWTH_FACTOR = 2;
+    ensure_initialized();
+    if (image != NULL)
+        return throw_error(UFS_ERR_NOT_IMPLEMENTED);
+    struct snapshot *snapshot = calloc(1, sizeof(struct snapshot));
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i) {
+        pthread_mutex_lock(&name_shards[i].lock);
+        for (struct file *file = name_shards[i].file_list; file != NULL; file = file->next)
+            add_file_to_snapshot(snapshot, file);
+        pthread_mutex_unlock(&name_shards[i].lock);
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_count == snapshot_capacity) {
+        snapshot_capacity = snapshot_capacity == 0 ? 1 : snapshot_capacity * GROWTH_FACTOR;
+        snapshots = realloc(snapshots, sizeof(struct snapshot *) * snapshot_capacity);
+    }
+    int id = snapshot_count++;
+    snapshots[id] = snapshot;
+    live_snapshot_count++;
+    pthread_mutex_unlock(&snapshot_lock);
+    return id;
+}
+
+/** Like ufs_delete() of every file. The shard must be locked. */
+void delete_all_files_of_shard(struct name_shard *shard) {
+    while (shard->file_list != NULL) {
+        struct file *file = shard->file_list;
+        disconnect_file_from_file_list(shard, file);
+        remove_file_entry(file->name);
+        pthread_rwlock_wrlock(&file->lock);
+        file->marked_for_deletion = true;
+        bool has_descriptors = file->refs > 0;
+        pthread_rwlock_unlock(&file->lock);
+        if (!has_descriptors)
+            delete_file(file);
+    }
+}
+
+int
+ufs_snapshot_restore(int id) {
+    // Snapshots are in memory only, so there are none in image mode
+    pthread_mutex_lock(&snapshot_lock);
+    if (id < 0 || id >= snapshot_count || snapshots[id] == NULL) {
+        pthread_mutex_unlock(&snapshot_lock);
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    }
+    struct snapshot *snapshot = snapshots[id];
+    // All the shards are locked, in their order, till the end, so nobody sees the files half restored or creates
+    // one which the restore overwrites. Directories are locked after the shards everywhere.
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i)
+        pthread_mutex_lock(&name_shards[i].lock);
+    for (int i = 0; i < NAME_SHARD_COUNT; ++i)
+        delete_all_files_of_shard(&name_shards[i]);
+    for (int i = 0; i < snapshot->file_count; ++i) {
+        struct snapshot_file *file = &snapshot->files[i];
+        // Directories are not in snapshots, so the ones removed since then are made again
+        make_parent_directories(file->name);
+        set_file_content_in_shard(get_name_shard(file->name_hash), file->name, file->name_hash,
+                                  share_blocks(file->blocks, file->block_count), file->block_count, file->size);
+    }
+    for (int i = NAME_SHARD_COUNT - 1; i >= 0; --i)
+        pthread_mutex_unlock(&name_shards[i].lock);
+    pthread_mutex_unlock(&snapshot_lock);
+    return 0;
+}
+
+int
+ufs_snapshot_delete(int id) {
+    pthread_mutex_lock(&snapshot_lock);
+    if (id < 0 || id >= snapshot_count || snapshots[id] == NULL) {
+        pthread_mutex_unlock(&snapshot_lock);
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    }
+    free_snapshot(snapshots[id]);
+    snapshots[id] = NULL;
+    live_snapshot_count--;
+    pthread_mutex_unlock(&snapshot_lock);
+    return 0;
+}
+
+#endif
+
+int
+ufs_stats(struct ufs_stats *stats) {
+    struct ufs_space_stats space_stats;
+    ufs_get_space_stats(&space_stats);
+    memset(stats, 0, sizeof(*stats));
+    stats->file_count = live_file_count;
+    stats->block_count = space_stats.block_count;
+    stats->file_bytes = space_stats.logical_bytes;
+    stats->used_bytes = space_stats.physical_bytes;
+    if (image != NULL) {
+        stats->allocated_bytes = (size_t) image->superblock->block_count * block_size;
+    } else {
+        pthread_mutex_lock(&block_pool_lock);
+        stats->allocated_bytes = slab_byte_count + compressed_byte_count;
+        pthread_mutex_unlock(&block_pool_lock);
+    }
+    pthread_rwlock_rdlock(&file_descriptor_lock);
+    stats->descriptor_count = open_file_descriptor_count;
+    stats->descriptor_capacity = file_descriptor_capacity;
+    pthread_rwlock_unlock(&file_descriptor_lock);
+
+    struct op_counters sums[UFS_OP_COUNT];
+    pthread_mutex_lock(&stat_lock);
+    for (int i = 0; i < UFS_OP_COUNT; ++i) {
+        reset_op_counters(&sums[i]);
+        add_op_counters(&sums[i], &retired_op_counters[i]);
+        for (struct stat_stripe *stripe = stat_stripes; stripe != NULL; stripe = stripe->next)
+            add_op_counters(&sums[i], &stripe->ops[i]);
+    }
+    pthread_mutex_unlock(&stat_lock);
+    for (int i = 0; i < UFS_OP_COUNT; ++i) {
+        stats->ops[i].count = sums[i].count;
+        stats->ops[i].error_count = sums[i].error_count;
+        stats->ops[i].byte_count = sums[i].byte_count;
+        for (int j = 0; j < UFS_LATENCY_BUCKET_COUNT; ++j)
+            stats->ops[i].latency_buckets[j] = sums[i].latency_buckets[j];
+    }
+    return 0;
+}
+
+int
+ufs_trace_start(int capacity) {
+    if (capacity <= 0)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    struct trace_record *ring = calloc(capacity, sizeof(struct trace_record));
+    pthread_mutex_lock(&trace_lock);
+    free(trace_ring);
+    trace_ring = ring;
+    trace_capacity = capacity;
+    trace_count = 0;
+    pthread_mutex_unlock(&trace_lock);
+    atomic_store(&is_tracing, true);
     return 0;
-}
\ No newline at end of file
+}
+
+void
+ufs_trace_stop(void) {
+    atomic_store(&is_tracing, false);
+}
+
+int
+ufs_trace_dump(int fd) {
+    pthread_mutex_lock(&trace_lock);
+    int count = trace_count < (uint64_t) trace_capacity ? (int) trace_count : trace_capacity;
+    uint64_t first = trace_count - count;
+    for (int i = 0; i < count; ++i) {
+        const struct trace_record *record = &trace_ring[(first + i) % trace_capacity];
+        dprintf(fd, "%llu.%09llu %s fd=%d size=%zu result=%zd error=%d latency_ns=%llu%s%s\n",
+                (unsigned long long) (record->time_ns / 1000000000),
+                (unsigned long long) (record->time_ns % 1000000000), OP_NAMES[record->op], record->fd, record->size,
+                record->result, (int) record->error, (unsigned long long) record->latency_ns,
+                record->name[0] != '\0' ? " name=" : "", record->name);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return count;
+}
+
+/**
+ * Rings of operations. The caller fills submission entries and submits them in a batch, they are run in the order of
+ * submission inline or on the worker thread, and their completions come back in the same order. So the completion of
+ * operation i is in slot i too, and at most capacity operations are in flight until reaped. Reads and writes of one
+ * descriptor which go in a row are run as one: the descriptor is looked up and locked once for all of them.
+ */
+struct ufs_ring {
+    struct ufs_sqe *sqes;
+    struct ufs_cqe *cqes;
+    /** Capacity - 1, capacity is a power of two. Operation i is in slot i & mask. */
+    unsigned int mask;
+    /** Operations handed out by ufs_ring_get_sqe(). */
+    unsigned int sqe_count;
+    /** Protected by the lock. */
+    unsigned int submitted_count;
+    unsigned int completed_count;
+    unsigned int reaped_count;
+    bool has_worker;
+    bool is_stopping;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted_cond;
+    pthread_cond_t completed_cond;
+};
+
+void complete_sqe(struct ufs_ring *ring, unsigned int number, ssize_t result) {
+    ring->cqes[number & ring->mask] = (struct ufs_cqe) {
+            .user_data = ring->sqes[number & ring->mask].user_data,
+            .result = result,
+            .error = result < 0 ? ufs_error_code : UFS_ERR_NO_ERR
+    };
+}
+
+bool is_io_sqe(const struct ufs_sqe *sqe) {
+    return sqe->op == UFS_RING_READ || sqe->op == UFS_RING_WRITE;
+}
+
+/** A read or a write of a run. The descriptor position and the file are locked. */
+ssize_t run_io_sqe(struct filedesc *descriptor, const struct ufs_sqe *sqe) {
+    bool is_write = sqe->op == UFS_RING_WRITE;
+    if (specific_flag_is_present(descriptor->flags, is_write ? UFS_READ_ONLY : UFS_WRITE_ONLY))
+        return throw_error(UFS_ERR_NO_PERMISSION);
+    if (sqe->offset < -1)
+        return throw_error(UFS_ERR_INVALID_ARGUMENT);
+    bool is_positional = sqe->offset != -1;
+    off_t position = is_positional ? sqe->offset : descriptor->position;
+    if (position > MAX_FILE_SIZE)
+        return is_write ? throw_error(UFS_ERR_NO_MEM) : 0;
+    int result = is_write ? write_to_file(descriptor->file, (int) position, sqe->data, sqe->size)
+                          : read_from_file(descriptor->file, (int) position, sqe->buf, sqe->size);
+    if (!is_positional && result > 0)
+        descriptor->position += result;
+    return result;
+}
+
+/** Runs the reads and writes of one descriptor in a row from @a first. Returns the number of the next operation. */
+unsigned int run_io_sqes(struct ufs_ring *ring, unsigned int first, unsigned int last) {
+    int fd = ring->sqes[first & ring->mask].fd;
+    bool has_writes = false;
+    unsigned int end = first;
+    for (; end != last; ++end) {
+        const struct ufs_sqe *sqe = &ring->sqes[end & ring->mask];
+        if (!is_io_sqe(sqe) || sqe->fd != fd)
+            break;
+        has_writes |= sqe->op == UFS_RING_WRITE;
+    }
+    struct filedesc *descriptor = try_get_file_descriptor(fd);
+    if (descriptor == NULL) {
+        throw_error(UFS_ERR_NO_FILE);
+        for (unsigned int i = first; i != end; ++i)
+            complete_sqe(ring, i, -1);
+        return end;
+    }
+    // The same locks as of ufs_write() and ufs_read(), but once for the run
+    if (has_writes)
+        lock_image_metadata();
+    pthread_mutex_lock(&descriptor->position_lock);
+    if (has_writes)
+        pthread_rwlock_wrlock(&descriptor->file->lock);
+    else
+        pthread_rwlock_rdlock(&descriptor->file->lock);
+    for (unsigned int i = first; i != end; ++i) {
+        const struct ufs_sqe *sqe = &ring->sqes[i & ring->mask];
+        uint64_t start_ns = start_op();
+        ssize_t result = run_io_sqe(descriptor, sqe);
+        record_op(sqe->op == UFS_RING_WRITE ? UFS_OP_WRITE : UFS_OP_READ, start_ns, fd, NULL, sqe->size, result);
+        complete_sqe(ring, i, result);
+    }
+    pthread_rwlock_unlock(&descriptor->file->lock);
+    pthread_mutex_unlock(&descriptor->position_lock);
+    if (has_writes)
+        unlock_image_metadata();
+    return end;
+}
+
+/** Runs the submitted operations from @a first to @a last and fills their completions. */
+void run_sqes(struct ufs_ring *ring, unsigned int first, unsigned int last) {
+    unsigned int number = first;
+    while (number != last) {
+        const struct ufs_sqe *sqe = &ring->sqes[number & ring->mask];
+        if (is_io_sqe(sqe)) {
+            number = run_io_sqes(ring, number, last);
+            continue;
+        }
+        ssize_t result;
+        if (sqe->op == UFS_RING_OPEN)
+            result = ufs_open(sqe->filename, sqe->flags);
+        else if (sqe->op == UFS_RING_CLOSE)
+            result = ufs_close(sqe->fd);
+        else
+            result = throw_error(UFS_ERR_INVALID_ARGUMENT);
+        complete_sqe(ring, number++, result);
+    }
+}
+
+void *run_ring_worker(void *arg) {
+    struct ufs_ring *ring = arg;
+    pthread_mutex_lock(&ring->lock);
+    while (true) {
+        while (ring->completed_count == ring->submitted_count && !ring->is_stopping)
+            pthread_cond_wait(&ring->submitted_cond, &ring->lock);
+        // The submitted operations are run before stopping
+        if (ring->completed_count == ring->submitted_count)
+            break;
+        unsigned int first = ring->completed_count;
+        unsigned int last = ring->submitted_count;
+        pthread_mutex_unlock(&ring->lock);
+        run_sqes(ring, first, last);
+        pthread_mutex_lock(&ring->lock);
+        ring->completed_count = last;
+        pthread_cond_broadcast(&ring->completed_cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+struct ufs_ring *
+ufs_ring_create(int capacity, int flags) {
+    const int MAX_CAPACITY = 1 << 20;
+    if (capacity <= 0 || capacity > MAX_CAPACITY) {
+        throw_error(UFS_ERR_INVALID_ARGUMENT);
+        return NULL;
+    }
+    ensure_initialized();
+    unsigned int rounded_capacity = 1;
+    while (rounded_capacity < (unsigned int) capacity)
+        rounded_capacity *= 2;
+    struct ufs_ring *ring = calloc(1, sizeof(struct ufs_ring));
+    ring->sqes = calloc(rounded_capacity, sizeof(struct ufs_sqe));
+    ring->cqes = calloc(rounded_capacity, sizeof(struct ufs_cqe));
+    ring->mask = rounded_capacity - 1;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->submitted_cond, NULL);
+    pthread_cond_init(&ring->completed_cond, NULL);
+    ring->has_worker = specific_flag_is_present(flags, UFS_RING_WORKER);
+    if (ring->has_worker)
+        pthread_create(&ring->worker, NULL, run_ring_worker, ring);
+    return ring;
+}
+
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring) {
+    // Each operation keeps its slot until its completion is reaped
+    if (ring->sqe_count - ring->reaped_count > ring->mask)
+        return NULL;
+    struct ufs_sqe *sqe = &ring->sqes[ring->sqe_count++ & ring->mask];
+    *sqe = (struct ufs_sqe) {.offset = -1};
+    return sqe;
+}
+
+int
+ufs_ring_submit(struct ufs_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    unsigned int first = ring->submitted_count;
+    unsigned int last = ring->sqe_count;
+    ring->submitted_count = last;
+    if (ring->has_worker)
+        pthread_cond_signal(&ring->submitted_cond);
+    pthread_mutex_unlock(&ring->lock);
+    if (!ring->has_worker) {
+        run_sqes(ring, first, last);
+        pthread_mutex_lock(&ring->lock);
+        ring->completed_count = last;
+        pthread_mutex_unlock(&ring->lock);
+    }
+    return (int) (last - first);
+}
+
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count, int wait_count) {
+    pthread_mutex_lock(&ring->lock);
+    // Waiting for more than there is in flight would never end
+    unsigned int in_flight_count = ring->submitted_count - ring->reaped_count;
+    unsigned int target = wait_count < count ? wait_count : count;
+    if (wait_count < 0 || target > in_flight_count)
+        target = in_flight_count;
+    while (ring->completed_count - ring->reaped_count < target)
+        pthread_cond_wait(&ring->completed_cond, &ring->lock);
+    unsigned int ready_count = ring->completed_count - ring->reaped_count;
+    int reaped = ready_count < (unsigned int) count ? (int) ready_count : count;
+    for (int i = 0; i < reaped; ++i)
+        cqes[i] = ring->cqes[(ring->reaped_count + i) & ring->mask];
+    ring->reaped_count += reaped;
+    pthread_mutex_unlock(&ring->lock);
+    return reaped;
+}
+
+void
+ufs_ring_destroy(struct ufs_ring *ring) {
+    if (ring->has_worker) {
+        pthread_mutex_lock(&ring->lock);
+        ring->is_stopping = true;
+        pthread_cond_signal(&ring->submitted_cond);
+        pthread_mutex_unlock(&ring->lock);
+        pthread_join(ring->worker, NULL);
+    }
+    pthread_cond_destroy(&ring->completed_cond);
+    pthread_cond_destroy(&ring->submitted_cond);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->cqes);
+    free(ring->sqes);
+    free(ring);
+}
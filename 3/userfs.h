@@ -5,8 +5,13 @@
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * has an unique file name. With NEED_DIRECTORIES the name is a
+ * path of names joined by '/', and a file can be created only in
+ * an existing directory. Names with no '/' are in the root.
+ *
+ * With UFS_IMAGE=<path> in the environment the FS is kept in that
+ * file instead and survives the process. See userfs.c for the
+ * details.
  */
 
 /**
@@ -20,11 +25,60 @@
  *
  *     #define NEED_RESIZE
  *
+ * To allow positional I/O via ufs_lseek(), ufs_pread() and
+ * ufs_pwrite() define this:
+ *
+ *     #define NEED_POSITIONAL_IO
+ *
+ * To allow zero-copy I/O via ufs_map_range(), ufs_read_iov() and
+ * ufs_write_iov() define this:
+ *
+ *     #define NEED_ZERO_COPY_IO
+ *
+ * To allow deduplication and compression of blocks via
+ * ufs_set_dedup(), ufs_compress_cold_blocks() and
+ * ufs_get_space_stats() define this:
+ *
+ *     #define NEED_DEDUP
+ *
+ * To allow directories via ufs_mkdir(), ufs_rmdir() and
+ * ufs_readdir() define this:
+ *
+ *     #define NEED_DIRECTORIES
+ *
+ * To allow stats and tracing via ufs_stats() and ufs_trace_*()
+ * define this:
+ *
+ *     #define NEED_STATS
+ *
+ * To allow batches of operations via rings of ufs_ring_*() define
+ * this:
+ *
+ *     #define NEED_ASYNC_IO
+ *
+ * To allow changing the block size via ufs_set_block_size() define
+ * this:
+ *
+ *     #define NEED_BLOCK_SIZE
+ *
+ * To allow copy-on-write clones and snapshots via ufs_clone() and
+ * ufs_snapshot_*() define this:
+ *
+ *     #define NEED_SNAPSHOTS
+ *
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
 #define NEED_OPEN_FLAGS
 #define NEED_RESIZE
+#define NEED_POSITIONAL_IO
+#define NEED_ZERO_COPY_IO
+#define NEED_DEDUP
+#define NEED_DIRECTORIES
+#define NEED_STATS
+#define NEED_ASYNC_IO
+#define NEED_BLOCK_SIZE
+#define NEED_SNAPSHOTS
 /**
  * Flags for ufs_open call.
  */
@@ -66,8 +120,208 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+
+	UFS_ERR_INVALID_ARGUMENT,
+	UFS_ERR_NOT_EMPTY,
+	UFS_ERR_EXISTS,
+};
+
+#ifdef NEED_POSITIONAL_IO
+
+/**
+ * Where ufs_lseek() counts the offset from.
+ */
+enum ufs_seek_whence {
+	/** From the file beginning. */
+	UFS_SEEK_SET = 0,
+	/** From the current descriptor position. */
+	UFS_SEEK_CUR,
+	/** From the file end. */
+	UFS_SEEK_END,
+};
+
+#endif
+
+#ifdef NEED_ZERO_COPY_IO
+
+/**
+ * A piece of a file in memory, or a buffer for ufs_write_iov().
+ */
+struct ufs_span {
+	const char *data;
+	size_t size;
+};
+
+/**
+ * Blocks of a file pinned by ufs_map_range() or ufs_read_iov().
+ */
+struct ufs_mapping;
+
+#endif
+
+#ifdef NEED_DEDUP
+
+/**
+ * Space taken by the FS, see ufs_get_space_stats().
+ */
+struct ufs_space_stats {
+	/** Sum of the file sizes, holes included. */
+	size_t logical_bytes;
+	/**
+	 * Memory of the blocks in use. A compressed block counts
+	 * by its compressed size.
+	 */
+	size_t physical_bytes;
+	/** Blocks in use. Blocks shared by files count once. */
+	size_t block_count;
+	/** Blocks which can be found by their content. */
+	size_t sealed_block_count;
+	size_t compressed_block_count;
+};
+
+#endif
+
+#ifdef NEED_DIRECTORIES
+
+/**
+ * An entry of a directory from ufs_readdir().
+ */
+struct ufs_dirent {
+	/** Name in the directory, without the path. */
+	const char *name;
+	int is_directory;
+};
+
+#endif
+
+#ifdef NEED_STATS
+
+/**
+ * Operations counted by ufs_stats().
+ */
+enum ufs_op {
+	/** ufs_open(). */
+	UFS_OP_OPEN = 0,
+	/** ufs_read() and ufs_pread(). */
+	UFS_OP_READ,
+	/** ufs_write() and ufs_pwrite(). */
+	UFS_OP_WRITE,
+	/** ufs_delete(). */
+	UFS_OP_DELETE,
+	/** ufs_resize(). */
+	UFS_OP_RESIZE,
+	UFS_OP_COUNT,
+};
+
+enum {
+	UFS_LATENCY_BUCKET_COUNT = 32,
+};
+
+struct ufs_op_stats {
+	size_t count;
+	/** Calls which returned -1. */
+	size_t error_count;
+	/** Bytes read or written. */
+	size_t byte_count;
+	/**
+	 * Latency histogram. Bucket 0 counts the calls of 0 ns, bucket
+	 * i the ones from 2^(i - 1) to 2^i ns. The last bucket counts
+	 * all the longer calls too. Timing is not free, so only every
+	 * 16th call of each thread is timed, and all the calls while
+	 * the trace is on.
+	 */
+	size_t latency_buckets[UFS_LATENCY_BUCKET_COUNT];
+};
+
+/**
+ * What the FS has and does, see ufs_stats().
+ */
+struct ufs_stats {
+	/** Files, including deleted ones with opened descriptors. */
+	size_t file_count;
+	/** Blocks in use. */
+	size_t block_count;
+	/** Sum of the sizes of the files which are not deleted. */
+	size_t file_bytes;
+	/** Memory of the blocks in use. */
+	size_t used_bytes;
+	/**
+	 * Memory taken for the blocks, including the free ones kept
+	 * for reuse. In an image it is the image data size.
+	 */
+	size_t allocated_bytes;
+	/** Opened descriptors and the size of the descriptor table. */
+	int descriptor_count;
+	int descriptor_capacity;
+	struct ufs_op_stats ops[UFS_OP_COUNT];
+};
+
+#endif
+
+#ifdef NEED_ASYNC_IO
+
+/**
+ * Operations of a ring, see ufs_ring_submit().
+ */
+enum ufs_ring_op {
+	/** ufs_open() of filename with flags. */
+	UFS_RING_OPEN = 0,
+	/** ufs_close() of fd. */
+	UFS_RING_CLOSE,
+	/** Read of size bytes from fd into buf. */
+	UFS_RING_READ,
+	/** Write of size bytes of data into fd. */
+	UFS_RING_WRITE,
+};
+
+/**
+ * Flags for ufs_ring_create().
+ */
+enum ufs_ring_flags {
+	/**
+	 * Run the operations on a thread of the ring instead of in
+	 * ufs_ring_submit().
+	 */
+	UFS_RING_WORKER = 1,
+};
+
+/**
+ * Submission entry, an operation to run.
+ */
+struct ufs_sqe {
+	/** One of enum ufs_ring_op. */
+	int op;
+	int fd;
+	const char *filename;
+	int flags;
+	char *buf;
+	const char *data;
+	size_t size;
+	/**
+	 * Offset for read and write like in ufs_pread() and
+	 * ufs_pwrite(), or -1 for the descriptor position like in
+	 * ufs_read() and ufs_write().
+	 */
+	off_t offset;
+	/** Is copied to the completion to tell which one it is. */
+	unsigned long long user_data;
+};
+
+/**
+ * Completion entry, a result of an operation.
+ */
+struct ufs_cqe {
+	unsigned long long user_data;
+	/** What the sync call would return. */
+	ssize_t result;
+	/** Error code when the result is -1. */
+	enum ufs_error_code error;
 };
 
+struct ufs_ring;
+
+#endif
+
 /** Get code of the last error. */
 enum ufs_error_code
 ufs_errno();
@@ -80,7 +334,11 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or the directory of a new file doesn't
+ *       exist.
+ *     - UFS_ERR_INVALID_ARGUMENT - a new file has an empty name
+ *       in its path.
+ *     - UFS_ERR_EXISTS - there is a directory with the name.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -142,8 +400,9 @@ ufs_delete(const char *filename);
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
+ * file size is less than @a new_size, then the file grows with a
+ * hole in O(1): it reads as zeros and gets blocks only when they
+ * are written. Positions of opened file descriptors are not
  * changed. If the current size is bigger than @a new_size, then
  * the blocks are truncated. Opened file descriptors behind the
  * new file size should proceed from the new file end.
@@ -161,6 +420,400 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+#ifdef NEED_POSITIONAL_IO
+
+/**
+ * Move the position of the file descriptor. It is allowed to move
+ * beyond the file end - a write there extends the file, and the
+ * gap reads as zeros without taking any memory.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of enum ufs_seek_whence.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - bad @a whence or the new
+ *       position is negative.
+ *     - UFS_ERR_NO_MEM - the new position is beyond the max file
+ *       size.
+ */
+off_t
+ufs_lseek(int fd, off_t offset, int whence);
+
+/**
+ * Read data from the file at @a offset. The descriptor position
+ * is not changed.
+ *
+ * @retval >= 0 How many bytes were read, 0 beyond the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is write-only.
+ *     - UFS_ERR_INVALID_ARGUMENT - @a offset is negative.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * Write data to the file at @a offset. The descriptor position is
+ * not changed. A write beyond the file end leaves a hole reading
+ * as zeros.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is read-only.
+ *     - UFS_ERR_INVALID_ARGUMENT - @a offset is negative.
+ *     - UFS_ERR_NO_MEM - the write goes beyond the max file size.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, off_t offset);
+
+#endif
+
+#ifdef NEED_ZERO_COPY_IO
+
+/**
+ * Get the file data at @a offset without copying it. Each span
+ * points right into a file block, holes point to zeros. The
+ * blocks are pinned until ufs_unmap(): writes, resizes and
+ * deletion of the file don't change the spans, the file gets
+ * copies of the pinned blocks instead. The descriptor position is
+ * not changed.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in the file.
+ * @param size How many bytes to map.
+ * @param spans Array to fill with the spans.
+ * @param span_count Size of @a spans. Mapping stops when they
+ *        end, a span is never longer than a block.
+ * @param[out] mapping Handle for ufs_unmap(). NULL if nothing is
+ *             mapped.
+ *
+ * @retval >= 0 How many spans were filled, 0 beyond the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is write-only.
+ *     - UFS_ERR_INVALID_ARGUMENT - @a offset is negative.
+ */
+int
+ufs_map_range(int fd, off_t offset, size_t size, struct ufs_span *spans,
+	      int span_count, struct ufs_mapping **mapping);
+
+/**
+ * Like ufs_map_range(), but from the descriptor position. The
+ * position moves past the mapped bytes.
+ */
+int
+ufs_read_iov(int fd, size_t size, struct ufs_span *spans, int span_count,
+	     struct ufs_mapping **mapping);
+
+/**
+ * Unpin the blocks of a mapping. Its spans become invalid. All
+ * mappings must be unpinned before ufs_destroy().
+ *
+ * @param mapping Mapping from ufs_map_range() or ufs_read_iov().
+ *        NULL is ignored.
+ */
+void
+ufs_unmap(struct ufs_mapping *mapping);
+
+/**
+ * Write the buffers of @a spans one after another from the
+ * descriptor position, as a single write.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_PERMISSION - the file is read-only.
+ *     - UFS_ERR_NO_MEM - the write goes beyond the max file size.
+ */
+ssize_t
+ufs_write_iov(int fd, const struct ufs_span *spans, int span_count);
+
+#endif
+
+#ifdef NEED_DEDUP
+
+/**
+ * Turn deduplication of blocks on or off. While it is on, each
+ * block filled by a write up to its end is looked up by its
+ * content, and if the FS already has a block with the same
+ * content, the file shares it instead of keeping its own. A write
+ * to a shared block copies it, like after ufs_clone(). Turning it
+ * off keeps the blocks shared. ufs_destroy() turns it off.
+ *
+ * @param is_enabled Non-zero to turn it on.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NOT_IMPLEMENTED - the FS is in an image.
+ */
+int
+ufs_set_dedup(int is_enabled);
+
+/**
+ * Compress the blocks which were not read or written since the
+ * previous call. The first access to a compressed block inflates
+ * it back. Blocks shared by several files or mapped with
+ * ufs_map_range() are not compressed, neither are the ones which
+ * save less than 1/8 of their size. Operations on a file wait
+ * while its blocks are compressed.
+ *
+ * @retval >= 0 How many blocks were compressed.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NOT_IMPLEMENTED - the FS is in an image.
+ */
+int
+ufs_compress_cold_blocks(void);
+
+/**
+ * Get how many bytes the files have and how much memory they
+ * take. In an image the blocks are never shared by content or
+ * compressed, so only the first three stats are filled.
+ *
+ * @retval 0 Success.
+ */
+int
+ufs_get_space_stats(struct ufs_space_stats *stats);
+
+#endif
+
+#ifdef NEED_DIRECTORIES
+
+/**
+ * Make a directory. Its parent must exist.
+ *
+ * @param path Names joined by '/', with no empty ones.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - the parent directory doesn't exist.
+ *     - UFS_ERR_EXISTS - there is a file or a directory with
+ *       the name.
+ *     - UFS_ERR_INVALID_ARGUMENT - an empty name in the path.
+ *     - UFS_ERR_NOT_IMPLEMENTED - the FS is in an image.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Remove an empty directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has files or
+ *       directories.
+ *     - UFS_ERR_INVALID_ARGUMENT - an empty name in the path.
+ *     - UFS_ERR_NOT_IMPLEMENTED - the FS is in an image.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * List the files and directories of a directory, in no
+ * particular order. Deleted files with opened descriptors are not
+ * listed.
+ *
+ * @param path Path of the directory, "" for the root.
+ * @param[out] entries Array of the entries. Free it with free(),
+ *             the names are inside.
+ *
+ * @retval >= 0 How many entries there are.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_INVALID_ARGUMENT - an empty name in the path.
+ *     - UFS_ERR_NOT_IMPLEMENTED - the FS is in an image.
+ */
+int
+ufs_readdir(const char *path, struct ufs_dirent **entries);
+
+#endif
+
+#ifdef NEED_SNAPSHOTS
+
+/**
+ * Make @a destination_name a copy of @a source_name. The copy
+ * shares all the blocks with the source, so it costs only the
+ * metadata, and the blocks are copied only when one of the files
+ * writes to them. If the destination exists, its content is
+ * replaced and its descriptors behind the new file end move to
+ * the end.
+ *
+ * @param source_name Name of an existing file.
+ * @param destination_name Name of the copy.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no source file.
+ */
+int
+ufs_clone(const char *source_name, const char *destination_name);
+
+/**
+ * Take a snapshot of all the files. Like ufs_clone(), it shares
+ * the blocks with the files. Each file is captured consistently,
+ * but files changed while the snapshot is taken may be captured
+ * before or after the change.
+ *
+ * @retval >= 0 Snapshot id.
+ */
+int
+ufs_snapshot_create(void);
+
+/**
+ * Replace all the files with the files of the snapshot. The
+ * current files are deleted like with ufs_delete(), so their
+ * opened descriptors keep working on the old content. The
+ * snapshot stays and can be restored again. Concurrent calls
+ * see either the old files or the restored ones.
+ *
+ * @param id Snapshot id from ufs_snapshot_create().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - no such snapshot.
+ */
+int
+ufs_snapshot_restore(int id);
+
+/**
+ * Delete the snapshot and release its blocks.
+ *
+ * @param id Snapshot id from ufs_snapshot_create().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - no such snapshot.
+ */
+int
+ufs_snapshot_delete(int id);
+
+#endif
+
+#ifdef NEED_BLOCK_SIZE
+
+/**
+ * Set size of the file blocks. Bigger blocks take less memory for
+ * metadata and make big sequential I/O faster, smaller ones waste
+ * less memory on small files. Can be changed only while there are
+ * no files and snapshots. ufs_destroy() resets the default size of 4 KiB.
+ *
+ * @param new_block_size Power of two from 512 B to 1 MiB.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - bad block size.
+ *     - UFS_ERR_NOT_EMPTY - the FS has files or snapshots.
+ */
+int
+ufs_set_block_size(size_t new_block_size);
+
+#endif
+
+#ifdef NEED_STATS
+
+/**
+ * Get the stats of the FS. Operations are counted since the start
+ * or the last ufs_destroy().
+ *
+ * @retval 0 Success.
+ */
+int
+ufs_stats(struct ufs_stats *stats);
+
+/**
+ * Start recording the operations counted by ufs_stats() into a
+ * ring of the last @a capacity ones. Starting again empties the
+ * ring.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - @a capacity is not positive.
+ */
+int
+ufs_trace_start(int capacity);
+
+/**
+ * Stop recording the operations. The recorded ones stay for
+ * ufs_trace_dump() until the next ufs_trace_start() or
+ * ufs_destroy().
+ */
+void
+ufs_trace_stop(void);
+
+/**
+ * Write the recorded operations to @a fd as text, one per line,
+ * the oldest first. A line has the start time in seconds, the
+ * operation name, its descriptor, size, result, error code,
+ * latency and the file name for open and delete.
+ *
+ * @param fd Descriptor of the OS, not of the FS.
+ * @retval >= 0 How many operations were written.
+ */
+int
+ufs_trace_dump(int fd);
+
+#endif
+
+#ifdef NEED_ASYNC_IO
+
+/**
+ * Create a ring to run batches of operations. The operations run
+ * in the order of submission, and their completions come in the
+ * same order. Reads and writes of one descriptor in a row take
+ * its locks once, so many small ones are cheaper than the sync
+ * calls. A ring must be used by one thread at a time and be
+ * destroyed before ufs_destroy().
+ *
+ * @param capacity How many operations can be in flight, from
+ *     getting their entries till reaping their completions. It
+ *     is rounded up to a power of two.
+ * @param flags Bitwise OR of enum ufs_ring_flags.
+ * @retval not NULL The ring.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARGUMENT - bad capacity.
+ */
+struct ufs_ring *
+ufs_ring_create(int capacity, int flags);
+
+/**
+ * Get a submission entry to fill. It is zeroed, with offset -1.
+ *
+ * @retval not NULL The entry.
+ * @retval NULL The ring is full, reap some completions first.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Submit all the entries got since the last submission. Without
+ * UFS_RING_WORKER they are run right here.
+ *
+ * @retval >= 0 How many operations were submitted.
+ */
+int
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Take the completions of the operations, the oldest first.
+ *
+ * @param cqes Array for the completions.
+ * @param count Size of @a cqes.
+ * @param wait_count How many completions to wait for, but not
+ *     more than there are operations submitted and not reaped.
+ *     -1 waits for all of them.
+ * @retval >= 0 How many completions were taken.
+ */
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count,
+	      int wait_count);
+
+/**
+ * Destroy the ring. The submitted operations are run before, the
+ * ones which are got but not submitted are dropped.
+ */
+void
+ufs_ring_destroy(struct ufs_ring *ring);
+
+#endif
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
@@ -0,0 +1,331 @@
+#include "thread_pool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Throughput benchmarks of the thread pool. Not a part of the tests - the
+ * numbers depend on the machine. Build with 'make bench' and run ./bench.
+ */
+
+static double
+now_seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *
+empty_f(void *arg)
+{
+	return arg;
+}
+
+struct spawn_arg {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+};
+
+static void *
+spawn_f(void *arg)
+{
+	struct spawn_arg *a = (struct spawn_arg *) arg;
+	for (int i = 0; i < a->count; ++i)
+		thread_pool_push_task(a->pool, a->tasks[i]);
+	return arg;
+}
+
+/*
+ * Empty tasks pushed by the main thread, and by a few tasks, each pushing
+ * its share. Then all of them are joined.
+ */
+static void
+bench_empty_tasks(void)
+{
+	const int task_count = 100000, spawner_count = 4;
+	const int thread_counts[] = {1, 2, 4, 8, 16, TPOOL_MAX_THREADS};
+	struct thread_task **tasks = malloc(sizeof(*tasks) * task_count);
+	for (int i = 0; i < task_count; ++i)
+		thread_task_new(&tasks[i], empty_f, NULL);
+	struct thread_task *spawners[spawner_count];
+	struct spawn_arg spawn_args[spawner_count];
+	void *result;
+
+	printf("%-12s %16s %16s\n", "threads", "main, tasks/s",
+	       "tasks, tasks/s");
+	for (size_t i = 0; i < sizeof(thread_counts) /
+	     sizeof(thread_counts[0]); ++i) {
+		struct thread_pool *pool;
+		thread_pool_new(thread_counts[i], &pool);
+		double start = now_seconds();
+		for (int j = 0; j < task_count; ++j)
+			thread_pool_push_task(pool, tasks[j]);
+		for (int j = 0; j < task_count; ++j)
+			thread_task_join(tasks[j], &result);
+		double main_time = now_seconds() - start;
+
+		int share = task_count / spawner_count;
+		start = now_seconds();
+		for (int j = 0; j < spawner_count; ++j) {
+			spawn_args[j] = (struct spawn_arg) {
+				.pool = pool,
+				.tasks = tasks + j * share,
+				.count = share,
+			};
+			thread_task_new(&spawners[j], spawn_f, &spawn_args[j]);
+			thread_pool_push_task(pool, spawners[j]);
+		}
+		for (int j = 0; j < spawner_count; ++j) {
+			thread_task_join(spawners[j], &result);
+			thread_task_delete(spawners[j]);
+		}
+		for (int j = 0; j < share * spawner_count; ++j)
+			thread_task_join(tasks[j], &result);
+		double spawn_time = now_seconds() - start;
+		thread_pool_delete(pool);
+		printf("%-12d %16.0f %16.0f\n", thread_counts[i],
+		       task_count / main_time,
+		       share * spawner_count / spawn_time);
+	}
+	for (int i = 0; i < task_count; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+}
+
+struct producer_arg {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+	/* Push latencies, ns. */
+	double *latencies;
+};
+
+static void *
+producer_f(void *arg)
+{
+	struct producer_arg *a = (struct producer_arg *) arg;
+	void *result;
+	/* In rounds, to stay under TPOOL_MAX_TASKS. */
+	const int round_size = 1000;
+	for (int done = 0; done < a->count; done += round_size) {
+		for (int i = done; i < done + round_size; ++i) {
+			double start = now_seconds();
+			thread_pool_push_task(a->pool, a->tasks[i]);
+			a->latencies[i] = (now_seconds() - start) * 1e9;
+		}
+		for (int i = done; i < done + round_size; ++i)
+			thread_task_join(a->tasks[i], &result);
+	}
+	return NULL;
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Latency of a push with several threads pushing into one pool at once.
+ */
+static void
+bench_push_latency(void)
+{
+	const int producer_counts[] = {1, 4, 8};
+	const int push_count = 100000, thread_count = 4;
+
+	printf("%-12s %12s %12s %12s\n", "producers", "p50, ns", "p99, ns",
+	       "p99.9, ns");
+	for (size_t i = 0; i < sizeof(producer_counts) /
+	     sizeof(producer_counts[0]); ++i) {
+		int producer_count = producer_counts[i];
+		struct thread_pool *pool;
+		thread_pool_new(thread_count, &pool);
+		pthread_t producers[producer_count];
+		struct producer_arg args[producer_count];
+		int share = push_count / producer_count / 1000 * 1000;
+		double *latencies = malloc(sizeof(*latencies) * share *
+					   producer_count);
+		for (int j = 0; j < producer_count; ++j) {
+			args[j] = (struct producer_arg) {
+				.pool = pool,
+				.tasks = malloc(sizeof(*args[j].tasks) * share),
+				.count = share,
+				.latencies = latencies + j * share,
+			};
+			for (int k = 0; k < share; ++k)
+				thread_task_new(&args[j].tasks[k], empty_f, NULL);
+		}
+		for (int j = 0; j < producer_count; ++j)
+			pthread_create(&producers[j], NULL, producer_f, &args[j]);
+		for (int j = 0; j < producer_count; ++j) {
+			pthread_join(producers[j], NULL);
+			for (int k = 0; k < share; ++k)
+				thread_task_delete(args[j].tasks[k]);
+			free(args[j].tasks);
+		}
+		thread_pool_delete(pool);
+		int total = share * producer_count;
+		qsort(latencies, total, sizeof(*latencies), compare_doubles);
+		printf("%-12d %12.0f %12.0f %12.0f\n", producer_count,
+		       latencies[total / 2], latencies[total / 100 * 99],
+		       latencies[total / 1000 * 999]);
+		free(latencies);
+	}
+}
+
+/*
+ * Join of a task which is finished already, and the whole push-run-join
+ * round trip of one task at a time.
+ */
+static void
+bench_join(void)
+{
+	const int task_count = 100000;
+	struct thread_task **tasks = malloc(sizeof(*tasks) * task_count);
+	for (int i = 0; i < task_count; ++i)
+		thread_task_new(&tasks[i], empty_f, NULL);
+	struct thread_pool *pool;
+	thread_pool_new(4, &pool);
+	void *result;
+
+	for (int i = 0; i < task_count; ++i)
+		thread_pool_push_task(pool, tasks[i]);
+	for (int i = 0; i < task_count; ++i) {
+		while (!thread_task_is_finished(tasks[i]))
+			sched_yield();
+	}
+	double start = now_seconds();
+	for (int i = 0; i < task_count; ++i)
+		thread_task_join(tasks[i], &result);
+	double join_time = now_seconds() - start;
+
+	start = now_seconds();
+	for (int i = 0; i < task_count; ++i) {
+		thread_pool_push_task(pool, tasks[i]);
+		thread_task_join(tasks[i], &result);
+	}
+	double round_trip_time = now_seconds() - start;
+	printf("%-24s %10.0f ns\n", "join of a finished task",
+	       join_time / task_count * 1e9);
+	printf("%-24s %10.0f ns\n", "push and join", round_trip_time /
+	       task_count * 1e9);
+
+	thread_pool_delete(pool);
+	for (int i = 0; i < task_count; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+}
+
+/*
+ * Graphs of a task, a fan of tasks after it and a task after the fan, run
+ * by joins of each level before pushing the next one, and as dependencies.
+ */
+static void
+bench_graph(void)
+{
+	enum { FAN_COUNT = 16 };
+	const int graph_count = 10000;
+	struct thread_task *first, *fan[FAN_COUNT], *last;
+	thread_task_new(&first, empty_f, NULL);
+	thread_task_new(&last, empty_f, NULL);
+	for (int i = 0; i < FAN_COUNT; ++i)
+		thread_task_new(&fan[i], empty_f, NULL);
+	struct thread_pool *pool;
+	thread_pool_new(4, &pool);
+	void *result;
+
+	double start = now_seconds();
+	for (int i = 0; i < graph_count; ++i) {
+		thread_pool_push_task(pool, first);
+		thread_task_join(first, &result);
+		for (int j = 0; j < FAN_COUNT; ++j)
+			thread_pool_push_task(pool, fan[j]);
+		for (int j = 0; j < FAN_COUNT; ++j)
+			thread_task_join(fan[j], &result);
+		thread_pool_push_task(pool, last);
+		thread_task_join(last, &result);
+	}
+	double join_time = now_seconds() - start;
+
+	start = now_seconds();
+	for (int i = 0; i < graph_count; ++i) {
+		for (int j = 0; j < FAN_COUNT; ++j) {
+			thread_task_then(first, fan[j]);
+			thread_task_then(fan[j], last);
+		}
+		thread_pool_push_task(pool, last);
+		for (int j = 0; j < FAN_COUNT; ++j)
+			thread_pool_push_task(pool, fan[j]);
+		thread_pool_push_task(pool, first);
+		thread_task_join(last, &result);
+		thread_task_join(first, &result);
+		for (int j = 0; j < FAN_COUNT; ++j)
+			thread_task_join(fan[j], &result);
+	}
+	double graph_time = now_seconds() - start;
+	printf("%-24s %14s\n", "1 -> 16 -> 1 graph", "graphs/s");
+	printf("%-24s %14.0f\n", "joins", graph_count / join_time);
+	printf("%-24s %14.0f\n", "dependencies", graph_count / graph_time);
+
+	thread_pool_delete(pool);
+	thread_task_delete(first);
+	thread_task_delete(last);
+	for (int i = 0; i < FAN_COUNT; ++i)
+		thread_task_delete(fan[i]);
+}
+
+/*
+ * Empty tasks pushed and joined one by one, and as one batch.
+ */
+static void
+bench_batch(void)
+{
+	const int task_count = 100000;
+	const int thread_counts[] = {1, 4, TPOOL_MAX_THREADS};
+	struct thread_task **tasks = malloc(sizeof(*tasks) * task_count);
+	for (int i = 0; i < task_count; ++i)
+		thread_task_new(&tasks[i], empty_f, NULL);
+	void *result;
+
+	printf("%-12s %16s %16s\n", "threads", "single, tasks/s",
+	       "batch, tasks/s");
+	for (size_t i = 0; i < sizeof(thread_counts) /
+	     sizeof(thread_counts[0]); ++i) {
+		struct thread_pool *pool;
+		thread_pool_new(thread_counts[i], &pool);
+		double start = now_seconds();
+		for (int j = 0; j < task_count; ++j)
+			thread_pool_push_task(pool, tasks[j]);
+		for (int j = 0; j < task_count; ++j)
+			thread_task_join(tasks[j], &result);
+		double single_time = now_seconds() - start;
+
+		start = now_seconds();
+		thread_pool_push_tasks(pool, tasks, task_count);
+		thread_task_join_all(tasks, task_count, NULL);
+		double batch_time = now_seconds() - start;
+		thread_pool_delete(pool);
+		printf("%-12d %16.0f %16.0f\n", thread_counts[i],
+		       task_count / single_time, task_count / batch_time);
+	}
+	for (int i = 0; i < task_count; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+}
+
+int
+main(void)
+{
+	bench_empty_tasks();
+	bench_push_latency();
+	bench_join();
+	bench_graph();
+	bench_batch();
+	return 0;
+}
@@ -243,6 +243,52 @@ test_thread_pool_max_tasks(void)
 }
 
 
+struct push_from_task_arg {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+	int counter;
+};
+
+static void *
+task_push_children_f(void *arg)
+{
+	struct push_from_task_arg *a = (struct push_from_task_arg *) arg;
+	for (int i = 0; i < a->count; ++i) {
+		if (thread_task_new(&a->tasks[i], task_incr_f, &a->counter) != 0 ||
+		    thread_pool_push_task(a->pool, a->tasks[i]) != 0)
+			return NULL;
+	}
+	return arg;
+}
+
+static void
+test_push_from_task(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct push_from_task_arg arg = {.pool = p, .count = 1000};
+	arg.tasks = malloc(sizeof(*arg.tasks) * arg.count);
+	unit_fail_if(thread_task_new(&t, task_push_children_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(result == &arg, "a task pushed tasks");
+	unit_fail_if(thread_task_delete(t) != 0);
+	for (int i = 0; i < arg.count; ++i) {
+		unit_fail_if(thread_task_join(arg.tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(arg.tasks[i]) != 0);
+	}
+	unit_check(arg.counter == arg.count, "tasks of a task are finished");
+	free(arg.tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_timed_join(void)
 {
@@ -349,6 +395,213 @@ test_detach_long(void)
 #endif
 }
 
+struct step_arg {
+	int *log;
+	int *log_size;
+	int step;
+};
+
+static void *
+task_log_step_f(void *arg)
+{
+	struct step_arg *a = (struct step_arg *) arg;
+	int i = __atomic_fetch_add(a->log_size, 1, __ATOMIC_RELAXED);
+	a->log[i] = a->step;
+	return arg;
+}
+
+static void
+test_dependencies(void)
+{
+#ifdef NEED_DEPENDENCIES
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { STEP_COUNT = 3, FAN_COUNT = 10 };
+	int log[STEP_COUNT + FAN_COUNT];
+	int log_size = 0;
+	struct step_arg args[STEP_COUNT + FAN_COUNT];
+	struct thread_task *steps[STEP_COUNT + FAN_COUNT];
+	void *result;
+	for (int i = 0; i < STEP_COUNT + FAN_COUNT; ++i) {
+		args[i] = (struct step_arg) {log, &log_size, i};
+		unit_fail_if(thread_task_new(&steps[i], task_log_step_f,
+					     &args[i]) != 0);
+	}
+	unit_check(thread_task_depends_on(steps[0], steps[0]) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no dependency on itself");
+	/*
+	 * A chain pushed from the end.
+	 */
+	unit_fail_if(thread_task_then(steps[0], steps[1]) != 0);
+	unit_fail_if(thread_task_then(steps[1], steps[2]) != 0);
+	unit_check(thread_task_delete(steps[1]) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't delete a waiting task");
+	for (int i = STEP_COUNT - 1; i >= 0; --i)
+		unit_fail_if(thread_pool_push_task(p, steps[i]) != 0);
+	unit_check(thread_task_depends_on(steps[2], steps[0]) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't add to a pushed task");
+	unit_fail_if(thread_task_join(steps[2], &result) != 0);
+	unit_check(log_size == STEP_COUNT && log[0] == 0 && log[1] == 1 &&
+		   log[2] == 2, "chain runs in order");
+	/*
+	 * A finished and not joined task doesn't hold anybody.
+	 */
+	unit_fail_if(thread_task_then(steps[1], steps[2]) != 0);
+	unit_fail_if(thread_pool_push_task(p, steps[2]) != 0);
+	unit_fail_if(thread_task_join(steps[2], &result) != 0);
+	unit_check(log_size == STEP_COUNT + 1, "finished dependency");
+	unit_fail_if(thread_task_join(steps[0], &result) != 0);
+	unit_fail_if(thread_task_join(steps[1], &result) != 0);
+	/*
+	 * Fan-out and fan-in: the first step, then all the others, then
+	 * when_all.
+	 */
+	log_size = 0;
+	struct thread_task *all;
+	unit_check(thread_task_when_all(&all, steps + STEP_COUNT, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative count");
+	for (int i = STEP_COUNT; i < STEP_COUNT + FAN_COUNT; ++i)
+		unit_fail_if(thread_task_depends_on(steps[i], steps[0]) != 0);
+	unit_fail_if(thread_task_when_all(&all, steps + STEP_COUNT,
+					  FAN_COUNT) != 0);
+	unit_fail_if(thread_pool_push_task(p, all) != 0);
+	for (int i = STEP_COUNT + FAN_COUNT - 1; i >= STEP_COUNT; --i)
+		unit_fail_if(thread_pool_push_task(p, steps[i]) != 0);
+	usleep(1000);
+	unit_check(log_size == 0 && !thread_task_is_finished(all),
+		   "nothing runs before the first step");
+	unit_fail_if(thread_pool_push_task(p, steps[0]) != 0);
+	unit_fail_if(thread_task_join(all, &result) != 0);
+	unit_check(log_size == FAN_COUNT + 1 && log[0] == 0,
+		   "all the steps are finished");
+	unit_fail_if(thread_task_delete(all) != 0);
+	for (int i = 0; i < STEP_COUNT + FAN_COUNT; ++i) {
+		if (i != 1 && i != 2)
+			unit_fail_if(thread_task_join(steps[i], &result) != 0);
+	}
+	/*
+	 * A deleted dependency doesn't hold anybody, before the push of
+	 * the dependent task and after it.
+	 */
+	log_size = 0;
+	unit_fail_if(thread_task_then(steps[0], steps[1]) != 0);
+	unit_fail_if(thread_task_then(steps[0], steps[2]) != 0);
+	unit_fail_if(thread_pool_push_task(p, steps[2]) != 0);
+	unit_fail_if(thread_task_delete(steps[0]) != 0);
+	unit_fail_if(thread_pool_push_task(p, steps[1]) != 0);
+	unit_fail_if(thread_task_join(steps[1], &result) != 0);
+	unit_fail_if(thread_task_join(steps[2], &result) != 0);
+	unit_check(log_size == 2, "deleted dependency");
+	for (int i = 1; i < STEP_COUNT + FAN_COUNT; ++i)
+		unit_fail_if(thread_task_delete(steps[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+struct push_all_arg {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+};
+
+static void *
+task_push_all_f(void *arg)
+{
+	struct push_all_arg *a = (struct push_all_arg *) arg;
+	int rc = thread_pool_push_tasks(a->pool, a->tasks, a->count);
+	return (void *) (intptr_t) rc;
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	enum { TASK_COUNT = 100 };
+	struct thread_task *tasks[TASK_COUNT];
+	void *results[TASK_COUNT];
+	int counter = 0;
+	for (int i = 0; i < TASK_COUNT; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &counter) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative count");
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	unit_check(thread_task_join_all(tasks, TASK_COUNT, results) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "join_all of not pushed tasks");
+
+	struct thread_task *twice[] = {tasks[0], tasks[1], tasks[0]};
+	unit_check(thread_pool_push_tasks(p, twice, 3) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a task twice in a batch");
+	unit_check(thread_task_join_all(twice, 2, NULL) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "nothing of it is pushed");
+	unit_check(thread_pool_push_tasks(p, tasks, TASK_COUNT) == 0,
+		   "push a batch");
+	unit_check(thread_task_join_all(twice, 3, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "join_all of a task twice");
+	unit_check(thread_pool_thread_count(p) <= 3, "threads are limited");
+	unit_check(thread_task_join_all(tasks, TASK_COUNT, results) == 0,
+		   "join_all");
+	bool is_ok = counter == TASK_COUNT;
+	for (int i = 0; i < TASK_COUNT; ++i)
+		is_ok = is_ok && results[i] == &counter;
+	unit_check(is_ok, "all the tasks are run once");
+	unit_check(thread_task_join_all(tasks, TASK_COUNT, NULL) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "joined tasks are not in the pool");
+	/*
+	 * A batch which doesn't fit is not pushed at all.
+	 */
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	struct thread_task **many = malloc(sizeof(*many) * TPOOL_MAX_TASKS);
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i)
+		unit_fail_if(thread_task_new(&many[i], task_incr_f,
+					     &counter) != 0);
+	unit_check(thread_pool_push_tasks(p, many, TPOOL_MAX_TASKS) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too many tasks in a batch");
+	unit_check(thread_task_join_all(many, 1, NULL) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "nothing of the batch is pushed");
+	for (int i = 0; i < TPOOL_MAX_TASKS; ++i)
+		unit_fail_if(thread_task_delete(many[i]) != 0);
+	free(many);
+	unit_fail_if(thread_task_join_all(tasks, 1, NULL) != 0);
+	/*
+	 * A batch pushed by a task, into its own worker.
+	 */
+	counter = 0;
+	struct push_all_arg arg = {p, tasks, TASK_COUNT};
+	struct thread_task *pusher;
+	void *result;
+	unit_fail_if(thread_task_new(&pusher, task_push_all_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, pusher) != 0);
+	unit_fail_if(thread_task_join(pusher, &result) != 0);
+	unit_check(result == 0, "push a batch from a task");
+	unit_fail_if(thread_task_join_all(tasks, TASK_COUNT, NULL) != 0);
+	unit_check(counter == TASK_COUNT, "the batch of a task is run");
+	unit_fail_if(thread_task_delete(pusher) != 0);
+#ifdef NEED_DEPENDENCIES
+	/*
+	 * A task of a batch which waits for a task later in the batch.
+	 */
+	counter = 0;
+	unit_fail_if(thread_task_then(tasks[TASK_COUNT - 1], tasks[0]) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, TASK_COUNT) != 0);
+	unit_fail_if(thread_task_join_all(tasks, TASK_COUNT, NULL) != 0);
+	unit_check(counter == TASK_COUNT, "batch with a dependency");
+#endif
+
+	for (int i = 0; i < TASK_COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -358,9 +611,12 @@ main(void)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_push_from_task();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_dependencies();
+	test_push_tasks();
 
 	unit_test_finish();
 	return 0;
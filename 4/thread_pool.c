@@ -1,101 +1,495 @@
 #include "thread_pool.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
-#include <asm-generic/errno.h>
+#include <linux/futex.h>
+#include <errno.h>
 
 const int SUCCESS = 0;
-const int NONE = -1;
+
+/**
+ * Stage of a task is in the low bits of its state word, and flags are in the others. A task goes through the stages
+ * one by one, so a transition is an increment which keeps the flags. Joiners sleep on the word as on a futex, so
+ * a join takes no lock, and a join of a finished task is just a load.
+ */
+enum {
+    TASK_CREATED = 0,
+    TASK_PUSHED,
+    TASK_RUNNING,
+    TASK_FINISHED,
+    TASK_JOINED,
+    TASK_STAGE_MASK = 7,
+    // Somebody sleeps on the state, so the worker has to wake it
+    TASK_HAS_WAITERS = 8,
+    // The worker deletes the task when it is finished
+    TASK_IS_DETACHED = 16,
+    // Met already in the array of a batch call, which catches tasks listed twice
+    TASK_IS_LISTED = 32,
+};
+
+struct task_link {
+    // The task to release, or NULL for a thread_task_join_all() waiting on join_count
+    struct thread_task *task;
+    _Atomic int *join_count;
+    struct task_link *next;
+};
 
 struct thread_task {
     thread_task_f function;
     void *arg;
     void *result;
 
-    bool finished;
-    bool assigned;
-    bool scheduled_for_deletion;
-
-    // lock not needed since now we use pool's mutex for everything
-    // pthread_mutex_t lock;
-    pthread_cond_t has_just_finished_cond;
+    _Atomic int state;
+    // Dependencies to finish before the task can run, plus one until the task is pushed
+    _Atomic int pending_dependency_count;
+    // Tasks waiting for this one, or finished_successors when it is finished
+    struct task_link *_Atomic successors;
 
     struct thread_pool *parent_pool;
-    int index_in_parent_pool;
 };
 
-const int TASK_APPEARS_EVENT = 0, TASKS_ENDED_EVENT = 1;
+// Successors of a finished task. The tasks made dependent on it then don't wait.
+static struct task_link finished_successors;
+
+/**
+ * Chase-Lev deque of a worker. The owner pushes and pops tasks at the bottom, the other workers steal them from the
+ * top. A full array is replaced by a twice bigger one. The old arrays are kept until the pool is deleted, because
+ * thieves can still read them.
+ */
+struct task_array {
+    long capacity;
+    struct task_array *previous;
+    struct thread_task *_Atomic tasks[];
+};
+
+struct task_deque {
+    _Atomic long top;
+    _Atomic long bottom;
+    struct task_array *_Atomic array;
+};
+
+struct thread_worker {
+    struct thread_pool *pool;
+    struct task_deque deque;
+    bool is_idle;
+    // Where to start looking for a task to steal
+    unsigned int steal_seed;
+};
+
+/**
+ * Bounded lock-free MPMC queue of Vyukov. Each slot has a sequence number which tells whose turn it is: the slot of
+ * position i is free for the producer of i when the number is i, and has a task for the consumer of i when it is
+ * i + 1. The consumer makes it i + capacity for the producer of the next lap. So the producers and the consumers
+ * contend only on their own end, and the tasks are taken in the order of pushing.
+ */
+struct task_slot {
+    _Atomic long sequence;
+    struct thread_task *task;
+};
+
+enum {
+    INITIAL_DEQUE_CAPACITY = 256,
+    // Not less than TPOOL_MAX_TASKS, so the queue is never full
+    TASK_QUEUE_CAPACITY = 1 << 17,
+    CACHE_LINE_SIZE = 64,
+};
+
+_Static_assert((int) TASK_QUEUE_CAPACITY >= (int) TPOOL_MAX_TASKS, "the task queue must fit all the tasks");
+
+struct task_queue {
+    struct task_slot *slots;
+    char head_padding[CACHE_LINE_SIZE];
+    _Atomic long head;
+    char tail_padding[CACHE_LINE_SIZE];
+    _Atomic long tail;
+    char end_padding[CACHE_LINE_SIZE];
+};
 
 struct thread_pool {
     pthread_t *threads;
+    struct thread_worker *workers;
 
     int max_thread_count;
-    int thread_count;
-    struct thread_task **tasks;
-    int unassigned_tasks_count;
-    int running_tasks_count;
-    int pushed_tasks_count;
+    _Atomic int thread_count;
+    _Atomic int idle_thread_count;
+    // Pushed and not joined yet, limited by TPOOL_MAX_TASKS
+    _Atomic int pushed_tasks_count;
+    // Pushed and not finished yet, the pool can't be deleted with them
+    _Atomic int unfinished_tasks_count;
+
+    // Tasks pushed not by the workers
+    struct task_queue queue;
+
+    // Protects thread creation
     pthread_mutex_t lock;
-    pthread_cond_t thread_update_cond;
-    int thread_update_event; // TASK_APPEARS_EVENT | TASKS_ENDED_EVENT | NONE
+    /**
+     * Eventcount for sleeping of the workers. A worker reads the epoch, counts itself sleeping, looks for a task once
+     * more and sleeps on the epoch futex. A push after that bumps the epoch, so the worker either sees the task or
+     * doesn't fall asleep.
+     */
+    _Atomic int wake_epoch;
+    /**
+     * Sleeping workers in the high half, and the woken ones which are not awake yet in the low half, so the pushes
+     * don't wake the same sleeper again and again. They are in one word to change both at once, and so there are
+     * never more woken workers than sleeping ones.
+     */
+    _Atomic uint64_t sleep_state;
+    _Atomic bool is_stopping;
 };
 
-void swap_tasks_in_pool(struct thread_task *task1, struct thread_task *task2) {
-    struct thread_pool *parent_pool = task1->parent_pool;
-    int index1 = task1->index_in_parent_pool;
-    int index2 = task2->index_in_parent_pool;
+static __thread struct thread_worker *current_worker = NULL;
 
-    parent_pool->tasks[index1] = task2;
-    task2->index_in_parent_pool = index1;
+struct task_array *task_array_new(long capacity) {
+    struct task_array *array = calloc(1, sizeof(struct task_array) + capacity * sizeof(struct thread_task *));
+    array->capacity = capacity;
+    return array;
+}
 
-    parent_pool->tasks[index2] = task1;
-    task1->index_in_parent_pool = index2;
+struct thread_task *task_array_get(struct task_array *array, long index) {
+    return atomic_load_explicit(&array->tasks[index & (array->capacity - 1)], memory_order_relaxed);
 }
 
-void thread_task_join_no_lock(struct thread_task *task);
+void task_array_put(struct task_array *array, long index, struct thread_task *task) {
+    atomic_store_explicit(&array->tasks[index & (array->capacity - 1)], task, memory_order_relaxed);
+}
 
-void *execute_thread(void *arg) {
-    struct thread_pool *pool = (struct thread_pool *) arg;
+void task_deque_push(struct task_deque *deque, struct thread_task *task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct task_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (bottom - top >= array->capacity) {
+        struct task_array *bigger = task_array_new(array->capacity * 2);
+        for (long i = top; i < bottom; ++i)
+            task_array_put(bigger, i, task_array_get(array, i));
+        bigger->previous = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+    task_array_put(array, bottom, task);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+}
 
-    while (true) {
-        pthread_mutex_lock(&pool->lock);
-        while (pool->unassigned_tasks_count == 0) {
+struct thread_task *task_deque_pop(struct task_deque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct task_array *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    struct thread_task *task = task_array_get(array, bottom);
+    if (top == bottom) {
+        // The last task, the thieves can take it too
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+struct thread_task *task_deque_steal(struct task_deque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+    struct task_array *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    struct thread_task *task = task_array_get(array, top);
+    // Lost to the owner or another thief
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+void set_worker_idle(struct thread_worker *worker, bool is_idle) {
+    if (worker->is_idle == is_idle)
+        return;
+    worker->is_idle = is_idle;
+    atomic_fetch_add(&worker->pool->idle_thread_count, is_idle ? 1 : -1);
+}
+
+int futex_wait(_Atomic int *futex, int value) {
+    return syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/** Like futex_wait() but till the @a deadline of the real time clock. NULL means forever. */
+int futex_wait_until(_Atomic int *futex, int value, const struct timespec *deadline) {
+    if (deadline == NULL)
+        return futex_wait(futex, value);
+    return syscall(SYS_futex, futex, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, value, deadline, NULL,
+                   FUTEX_BITSET_MATCH_ANY);
+}
 
-            pthread_cond_wait(&pool->thread_update_cond, &pool->lock);
+int futex_wake(_Atomic int *futex, int count) {
+    return syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void task_queue_create(struct task_queue *queue) {
+    queue->slots = malloc(TASK_QUEUE_CAPACITY * sizeof(struct task_slot));
+    for (long i = 0; i < TASK_QUEUE_CAPACITY; ++i)
+        atomic_init(&queue->slots[i].sequence, i);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+/**
+ * The queue is never full, as it is bigger than TPOOL_MAX_TASKS, but the consumer of the previous lap can be still
+ * leaving the slot. Then the push waits for it, like task_queue_push_all().
+ */
+void task_queue_push(struct task_queue *queue, struct thread_task *task) {
+    long position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    struct task_slot *slot;
+    while (true) {
+        slot = &queue->slots[position & (TASK_QUEUE_CAPACITY - 1)];
+        long difference = atomic_load_explicit(&slot->sequence, memory_order_acquire) - position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else {
+            if (difference < 0)
+                sched_yield();
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    slot->task = task;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
 
-            if (pool->thread_update_event == TASKS_ENDED_EVENT) {
-                pthread_mutex_unlock(&pool->lock);
-                return NULL;
-            }
+struct thread_task *task_queue_pop(struct task_queue *queue) {
+    long position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    struct task_slot *slot;
+    while (true) {
+        slot = &queue->slots[position & (TASK_QUEUE_CAPACITY - 1)];
+        long difference = atomic_load_explicit(&slot->sequence, memory_order_acquire) - (position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
         }
+    }
+    struct thread_task *task = slot->task;
+    atomic_store_explicit(&slot->sequence, position + TASK_QUEUE_CAPACITY, memory_order_release);
+    return task;
+}
 
+/**
+ * Push the tasks with one claim of the tail. The claimed slots are free, as the queue is bigger than
+ * TPOOL_MAX_TASKS, but the consumers of the previous lap can be still leaving them.
+ */
+void task_queue_push_all(struct task_queue *queue, struct thread_task **tasks, int count) {
+    long position = atomic_fetch_add_explicit(&queue->tail, count, memory_order_relaxed);
+    for (int i = 0; i < count; ++i, ++position) {
+        struct task_slot *slot = &queue->slots[position & (TASK_QUEUE_CAPACITY - 1)];
+        while (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position)
+            sched_yield();
+        slot->task = tasks[i];
+        atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    }
+}
 
-        struct thread_task *task_to_execute = pool->tasks[0];
+struct thread_task *find_task(struct thread_worker *worker) {
+    struct thread_task *task = task_deque_pop(&worker->deque);
+    if (task != NULL)
+        return task;
+    task = task_queue_pop(&worker->pool->queue);
+    if (task != NULL)
+        return task;
+    struct thread_pool *pool = worker->pool;
+    int thread_count = atomic_load_explicit(&pool->thread_count, memory_order_acquire);
+    int start = (int) (worker->steal_seed++ % thread_count);
+    for (int i = 0; i < thread_count; ++i) {
+        struct thread_worker *victim = &pool->workers[(start + i) % thread_count];
+        if (victim == worker)
+            continue;
+        task = task_deque_steal(&victim->deque);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
 
-        pool->unassigned_tasks_count--;
-        swap_tasks_in_pool(task_to_execute, pool->tasks[pool->unassigned_tasks_count]);
+const uint64_t ONE_SLEEPING_THREAD = (uint64_t) 1 << 32;
 
-        pool->running_tasks_count++;
-        task_to_execute->assigned = true;
-        pthread_mutex_unlock(&pool->lock);
+int sleeping_thread_count(uint64_t sleep_state) {
+    return (int) (sleep_state >> 32);
+}
 
-        void *result = task_to_execute->function(task_to_execute->arg);
+int waking_thread_count(uint64_t sleep_state) {
+    return (int) (sleep_state & UINT32_MAX);
+}
 
-        pthread_mutex_lock(&pool->lock);
-        task_to_execute->result = result;
-        pool->running_tasks_count--;
-        pthread_cond_broadcast(&task_to_execute->has_just_finished_cond);
-        task_to_execute->finished = true;
+/** Sleep until there is a task. Returns NULL when the pool is deleted. */
+struct thread_task *wait_for_task(struct thread_worker *worker) {
+    struct thread_pool *pool = worker->pool;
+    set_worker_idle(worker, true);
+    while (!atomic_load(&pool->is_stopping)) {
+        int epoch = atomic_load(&pool->wake_epoch);
+        atomic_fetch_add(&pool->sleep_state, ONE_SLEEPING_THREAD);
+        atomic_thread_fence(memory_order_seq_cst);
+        // A task pushed before the increment is found here, a task pushed after it bumps the epoch
+        struct thread_task *task = find_task(worker);
+        if (task == NULL && !atomic_load(&pool->is_stopping))
+            futex_wait(&pool->wake_epoch, epoch);
+        // Whoever leaves takes one pending wakeup
+        uint64_t sleep_state = atomic_load(&pool->sleep_state);
+        uint64_t new_sleep_state;
+        do {
+            new_sleep_state = sleep_state - ONE_SLEEPING_THREAD - (waking_thread_count(sleep_state) > 0);
+        } while (!atomic_compare_exchange_weak(&pool->sleep_state, &sleep_state, new_sleep_state));
+        if (task == NULL)
+            task = find_task(worker);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
 
-        if (task_to_execute->scheduled_for_deletion) {
-            thread_task_join_no_lock(task_to_execute);
-            thread_task_delete(task_to_execute);
-        }
+/** Wake up to @a count sleeping workers which nobody is waking yet. Returns how many are woken. */
+int wake_workers(struct thread_pool *pool, int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t sleep_state = atomic_load_explicit(&pool->sleep_state, memory_order_relaxed);
+    int wake_count;
+    do {
+        wake_count = sleeping_thread_count(sleep_state) - waking_thread_count(sleep_state);
+        if (wake_count > count)
+            wake_count = count;
+        if (wake_count <= 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&pool->sleep_state, &sleep_state, sleep_state + wake_count));
+    atomic_fetch_add(&pool->wake_epoch, 1);
+    futex_wake(&pool->wake_epoch, wake_count);
+    return wake_count;
+}
 
-        pthread_mutex_unlock(&pool->lock);
+int task_stage(int state) {
+    return state & TASK_STAGE_MASK;
+}
+
+bool task_is_in_pool(int state) {
+    return task_stage(state) != TASK_CREATED && task_stage(state) != TASK_JOINED;
+}
+
+/** Wait until the task is finished. Returns false if the @a deadline has passed, NULL means no deadline. */
+bool wait_for_task_finish(struct thread_task *task, const struct timespec *deadline) {
+    int state = atomic_load_explicit(&task->state, memory_order_acquire);
+    while (task_stage(state) != TASK_FINISHED) {
+        if ((state & TASK_HAS_WAITERS) == 0 &&
+            !atomic_compare_exchange_weak(&task->state, &state, state | TASK_HAS_WAITERS))
+            continue;
+        if (futex_wait_until(&task->state, state | TASK_HAS_WAITERS, deadline) != 0 && errno == ETIMEDOUT)
+            return false;
+        state = atomic_load_explicit(&task->state, memory_order_acquire);
+    }
+    return true;
+}
+
+// The task is finished
+void release_finished_task(struct thread_task *task) {
+    atomic_fetch_sub(&task->parent_pool->pushed_tasks_count, 1);
+    task->parent_pool = NULL;
+    // The next run waits for new dependencies, and new successors wait for it
+    atomic_store_explicit(&task->pending_dependency_count, 1, memory_order_relaxed);
+    atomic_store_explicit(&task->successors, NULL, memory_order_relaxed);
+    atomic_store_explicit(&task->state, TASK_JOINED, memory_order_relaxed);
+}
+
+bool try_create_thread(struct thread_pool *pool);
+
+/** Queue pushed tasks of the @a pool which have no dependencies left, and get workers for them. */
+void schedule_tasks(struct thread_pool *pool, struct thread_task **tasks, int count) {
+    // Tasks of a task stay with its worker unless stolen
+    if (current_worker != NULL && current_worker->pool == pool) {
+        for (int i = 0; i < count; ++i)
+            task_deque_push(&current_worker->deque, tasks[i]);
+    } else if (count == 1) {
+        task_queue_push(&pool->queue, tasks[0]);
+    } else {
+        task_queue_push_all(&pool->queue, tasks, count);
+    }
+    // New threads only for the tasks no sleeping worker takes
+    for (int i = wake_workers(pool, count); i < count && try_create_thread(pool); ++i);
+}
+
+// The push and each finished dependency release the task once, the last one makes it ready
+bool release_dependency_hold(struct thread_task *task) {
+    return atomic_fetch_sub_explicit(&task->pending_dependency_count, 1, memory_order_acq_rel) == 1;
+}
+
+void release_dependency(struct thread_task *task) {
+    if (release_dependency_hold(task))
+        schedule_tasks(task->parent_pool, &task, 1);
+}
+
+/** Add the @a link to the successors of the @a task. Returns false if the task is finished already. */
+bool add_successor(struct thread_task *task, struct task_link *link) {
+    link->next = atomic_load(&task->successors);
+    do {
+        if (link->next == &finished_successors)
+            return false;
+    } while (!atomic_compare_exchange_weak(&task->successors, &link->next, link));
+    return true;
+}
+
+void run_task(struct thread_worker *worker, struct thread_task *task) {
+    atomic_fetch_add_explicit(&task->state, TASK_RUNNING - TASK_PUSHED, memory_order_relaxed);
+
+    void *result = task->function(task->arg);
+
+    // Before the task is finished, so the pool is seen idle and empty right after a join
+    set_worker_idle(worker, true);
+    atomic_fetch_sub(&worker->pool->unfinished_tasks_count, 1);
+    task->result = result;
+    // Taken before the task is finished, as then it can be deleted
+    struct task_link *successors = atomic_exchange(&task->successors, &finished_successors);
+    int state = atomic_fetch_add_explicit(&task->state, TASK_FINISHED - TASK_RUNNING, memory_order_acq_rel);
+    if ((state & TASK_IS_DETACHED) != 0) {
+        release_finished_task(task);
+        thread_task_delete(task);
+    } else if ((state & TASK_HAS_WAITERS) != 0) {
+        // The joiner can delete the task already, but a wakeup doesn't touch the memory
+        futex_wake(&task->state, INT_MAX);
+    }
+    while (successors != NULL) {
+        struct task_link *next = successors->next;
+        if (successors->task != NULL)
+            release_dependency(successors->task);
+        else if (atomic_fetch_sub(successors->join_count, 1) == 1)
+            // Like the state, the joiner can be gone already
+            futex_wake(successors->join_count, 1);
+        free(successors);
+        successors = next;
+    }
+}
+
+void *execute_thread(void *arg) {
+    struct thread_worker *worker = (struct thread_worker *) arg;
+    current_worker = worker;
+
+    while (true) {
+        struct thread_task *task = find_task(worker);
+        if (task == NULL)
+            task = wait_for_task(worker);
+        if (task == NULL)
+            return NULL;
+        set_worker_idle(worker, false);
+        run_task(worker, task);
     }
 }
 
@@ -106,83 +500,128 @@ int thread_pool_new(int max_thread_count, struct thread_pool **pool) {
     struct thread_pool *new_pool = malloc(sizeof(struct thread_pool));
     *new_pool = (struct thread_pool) {
             .threads = malloc(max_thread_count * sizeof(pthread_t)),
+            .workers = calloc(max_thread_count, sizeof(struct thread_worker)),
             .max_thread_count = max_thread_count,
-            .thread_count = 0,
 
-            .tasks = malloc(TPOOL_MAX_TASKS * sizeof(struct thread_task *)),
-            .unassigned_tasks_count = 0,
-            .running_tasks_count = 0,
-
-            .thread_update_event = NONE
     };
+    task_queue_create(&new_pool->queue);
+    for (int i = 0; i < max_thread_count; ++i) {
+        struct thread_worker *worker = &new_pool->workers[i];
+        worker->pool = new_pool;
+        worker->steal_seed = i;
+        atomic_init(&worker->deque.array, task_array_new(INITIAL_DEQUE_CAPACITY));
+    }
 
     pthread_mutex_init(&new_pool->lock, NULL);
-    pthread_cond_init(&new_pool->thread_update_cond, NULL);
 
     *pool = new_pool;
     return SUCCESS;
 }
 
 int thread_pool_thread_count(const struct thread_pool *pool) {
-    pthread_mutex_lock(&((struct thread_pool *) pool)->lock);
-    int count = pool->thread_count;
-    pthread_mutex_unlock(&((struct thread_pool *) pool)->lock);
-    return count;
+    return atomic_load(&((struct thread_pool *) pool)->thread_count);
 }
 
 int thread_pool_delete(struct thread_pool *pool) {
-    pthread_mutex_lock(&pool->lock);
-    if (pool->unassigned_tasks_count > 0 || pool->running_tasks_count > 0) {
-        pthread_mutex_unlock(&pool->lock);
+    if (atomic_load(&pool->unfinished_tasks_count) > 0)
         return TPOOL_ERR_HAS_TASKS;
-    }
 
-    pool->thread_update_event = TASKS_ENDED_EVENT;
-    pthread_cond_broadcast(&pool->thread_update_cond);
+    atomic_store(&pool->is_stopping, true);
+    atomic_fetch_add(&pool->wake_epoch, 1);
+    futex_wake(&pool->wake_epoch, INT_MAX);
 
-    pthread_mutex_unlock(&pool->lock);
-
-    for (int i = 0; i < pool->thread_count; ++i) {
+    int thread_count = atomic_load(&pool->thread_count);
+    for (int i = 0; i < thread_count; ++i) {
         pthread_join(pool->threads[i], NULL);
     }
 
-
-    pthread_cond_destroy(&pool->thread_update_cond);
+    for (int i = 0; i < pool->max_thread_count; ++i) {
+        struct task_array *array = atomic_load(&pool->workers[i].deque.array);
+        while (array != NULL) {
+            struct task_array *previous = array->previous;
+            free(array);
+            array = previous;
+        }
+    }
     pthread_mutex_destroy(&pool->lock);
-    free(pool->tasks);
+    free(pool->queue.slots);
+    free(pool->workers);
     free(pool->threads);
     free(pool);
 
     return SUCCESS;
 }
 
-int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task) {
+/** Start one more thread if all of them are busy. Returns true if started. */
+bool try_create_thread(struct thread_pool *pool) {
+    if (atomic_load(&pool->idle_thread_count) > 0 || atomic_load(&pool->thread_count) == pool->max_thread_count)
+        return false;
     pthread_mutex_lock(&pool->lock);
+    int thread_count = atomic_load(&pool->thread_count);
+    bool is_created = thread_count < pool->max_thread_count;
+    if (is_created) {
+        // Before the start, as the worker divides by the count. Its deque is ready already.
+        atomic_store(&pool->thread_count, thread_count + 1);
+        pthread_create(&pool->threads[thread_count], NULL, execute_thread, &pool->workers[thread_count]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return is_created;
+}
 
-    if (pool->pushed_tasks_count >= TPOOL_MAX_TASKS) {
-        pthread_mutex_unlock(&pool->lock);
+int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task) {
+    if (atomic_fetch_add(&pool->pushed_tasks_count, 1) >= TPOOL_MAX_TASKS) {
+        atomic_fetch_sub(&pool->pushed_tasks_count, 1);
         return TPOOL_ERR_TOO_MANY_TASKS;
     }
+    atomic_fetch_add(&pool->unfinished_tasks_count, 1);
 
-    task->finished = false;
-    task->assigned = false;
+    atomic_store_explicit(&task->state, TASK_PUSHED, memory_order_relaxed);
     task->parent_pool = pool;
+    release_dependency(task);
 
-    pool->tasks[pool->pushed_tasks_count++] = task;
-    task->index_in_parent_pool = pool->pushed_tasks_count - 1;
-    pool->unassigned_tasks_count++;
-    if (pool->running_tasks_count == pool->thread_count && pool->thread_count < pool->max_thread_count) {
-        // Create new thread
-        pthread_create(&pool->threads[pool->thread_count++], NULL, execute_thread, pool);
-    } else {
-        // Use existing thread
-        if (pool->unassigned_tasks_count == 1) {
-            pool->thread_update_event = TASK_APPEARS_EVENT;
-            pthread_cond_signal(&pool->thread_update_cond);
+    return SUCCESS;
+}
+
+/** Mark the tasks of a batch call. Returns false and leaves no marks if a task is listed twice. */
+bool mark_listed_tasks(struct thread_task **tasks, int count) {
+    for (int i = 0; i < count; ++i) {
+        if ((atomic_fetch_or(&tasks[i]->state, TASK_IS_LISTED) & TASK_IS_LISTED) != 0) {
+            while (--i >= 0)
+                atomic_fetch_and(&tasks[i]->state, ~TASK_IS_LISTED);
+            return false;
         }
     }
-    swap_tasks_in_pool(pool->tasks[pool->unassigned_tasks_count - 1], task);
-    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+int thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks, int count) {
+    if (count < 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (count == 0)
+        return SUCCESS;
+    // All or nothing. The marks are dropped when the tasks are pushed.
+    if (!mark_listed_tasks(tasks, count))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (atomic_fetch_add(&pool->pushed_tasks_count, count) > TPOOL_MAX_TASKS - count) {
+        atomic_fetch_sub(&pool->pushed_tasks_count, count);
+        for (int i = 0; i < count; ++i)
+            atomic_fetch_and(&tasks[i]->state, ~TASK_IS_LISTED);
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+    atomic_fetch_add(&pool->unfinished_tasks_count, count);
+
+    // The tasks waiting for dependencies are scheduled by them, the others are queued together
+    struct thread_task **ready_tasks = malloc(count * sizeof(struct thread_task *));
+    int ready_count = 0;
+    for (int i = 0; i < count; ++i) {
+        atomic_store_explicit(&tasks[i]->state, TASK_PUSHED, memory_order_relaxed);
+        tasks[i]->parent_pool = pool;
+        if (release_dependency_hold(tasks[i]))
+            ready_tasks[ready_count++] = tasks[i];
+    }
+    if (ready_count > 0)
+        schedule_tasks(pool, ready_tasks, ready_count);
+    free(ready_tasks);
 
     return SUCCESS;
 }
@@ -192,66 +631,78 @@ int thread_task_new(struct thread_task **task, thread_task_f function, void *arg
     *new_task = (struct thread_task) {
             .function = function,
             .arg = arg,
-            .finished = false,
-            .scheduled_for_deletion = false,
-            .assigned = false,
-            .parent_pool = NULL,
-            .index_in_parent_pool = NONE
+            .parent_pool = NULL
     };
-    pthread_cond_init(&new_task->has_just_finished_cond, NULL);
+    atomic_init(&new_task->state, TASK_CREATED);
+    atomic_init(&new_task->pending_dependency_count, 1);
+    atomic_init(&new_task->successors, NULL);
 
     *task = new_task;
     return SUCCESS;
 }
 
 bool thread_task_is_finished(const struct thread_task *task) {
-    if (task->parent_pool == NULL)
-        return task->finished; // NOTE: Returns that the task is finished after it was joined but before it was pushed
-
-    pthread_mutex_lock(&task->parent_pool->lock);
-    bool is_finished = task->finished;
-    pthread_mutex_unlock(&task->parent_pool->lock);
-
-    return is_finished;
+    int stage = task_stage(atomic_load_explicit(&((struct thread_task *) task)->state, memory_order_acquire));
+    // NOTE: Returns that the task is finished after it was joined but before it was pushed
+    return stage == TASK_FINISHED || stage == TASK_JOINED;
 }
 
 bool thread_task_is_running(const struct thread_task *task) {
-    if (task->parent_pool == NULL)
-        return false;
-
-    pthread_mutex_lock(&task->parent_pool->lock);
-    bool is_running = task->assigned && !task->finished;
-    pthread_mutex_unlock(&task->parent_pool->lock);
-
-    return is_running;
+    int state = atomic_load_explicit(&((struct thread_task *) task)->state, memory_order_relaxed);
+    return task_stage(state) == TASK_RUNNING;
 }
 
 int thread_task_join(struct thread_task *task, void **result) {
-    struct thread_pool *parent_pool = task->parent_pool;
-    if (parent_pool == NULL)
+    if (!task_is_in_pool(atomic_load_explicit(&task->state, memory_order_relaxed)))
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
-    pthread_mutex_lock(&parent_pool->lock);
-
-    thread_task_join_no_lock(task);
+    wait_for_task_finish(task, NULL);
     *result = task->result;
+    release_finished_task(task);
 
-    pthread_mutex_unlock(&parent_pool->lock);
     return SUCCESS;
 }
 
-void thread_task_join_no_lock(struct thread_task *task) {
-    struct thread_pool *parent_pool = task->parent_pool;
-    while (!task->finished) {
-        pthread_cond_wait(&task->has_just_finished_cond, &parent_pool->lock);
+int thread_task_join_all(struct thread_task **tasks, int count, void **results) {
+    if (count < 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    for (int i = 0; i < count; ++i) {
+        if (!task_is_in_pool(atomic_load_explicit(&tasks[i]->state, memory_order_relaxed)))
+            return TPOOL_ERR_TASK_NOT_PUSHED;
     }
+    // The marks are dropped when the tasks are joined
+    if (!mark_listed_tasks(tasks, count))
+        return TPOOL_ERR_INVALID_ARGUMENT;
 
-    swap_tasks_in_pool(task, parent_pool->tasks[parent_pool->pushed_tasks_count - 1]);
-    parent_pool->pushed_tasks_count--;
+    // The unfinished tasks count down one futex, plus one until all of them are counted
+    _Atomic int join_count = 1;
+    for (int i = 0; i < count; ++i) {
+        if (task_stage(atomic_load_explicit(&tasks[i]->state, memory_order_relaxed)) == TASK_FINISHED)
+            continue;
+        struct task_link *link = malloc(sizeof(struct task_link));
+        link->task = NULL;
+        link->join_count = &join_count;
+        atomic_fetch_add(&join_count, 1);
+        if (!add_successor(tasks[i], link)) {
+            atomic_fetch_sub(&join_count, 1);
+            free(link);
+        }
+    }
+    int pending_count = atomic_fetch_sub(&join_count, 1) - 1;
+    while (pending_count != 0) {
+        futex_wait(&join_count, pending_count);
+        pending_count = atomic_load(&join_count);
+    }
 
-    task->parent_pool = NULL;
-    task->index_in_parent_pool = NONE;
-    task->assigned = false;
+    for (int i = 0; i < count; ++i) {
+        // Returns at once, unless the worker has not marked the task finished yet
+        wait_for_task_finish(tasks[i], NULL);
+        if (results != NULL)
+            results[i] = tasks[i]->result;
+        release_finished_task(tasks[i]);
+    }
+
+    return SUCCESS;
 }
 
 
@@ -295,31 +746,21 @@ struct timespec now_as_timespec() {
 
 int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result) {
-    if (task->parent_pool == NULL)
+    if (!task_is_in_pool(atomic_load_explicit(&task->state, memory_order_relaxed)))
         return TPOOL_ERR_TASK_NOT_PUSHED;
-    struct thread_pool *parent_pool = task->parent_pool;
-    pthread_mutex_lock(&parent_pool->lock);
 
+    // Longer ones are infinite, and they would overflow the conversion
+    const double max_timeout = 1e9;
+    if (timeout < 0)
+        timeout = 0;
     struct timespec timeout_spec = add_timespec(
             now_as_timespec(),
             milliseconds_to_timespec((long long) (timeout * (double) milliseconds_in_sec)));
 
-    while (!task->finished) {
-        if (ETIMEDOUT == pthread_cond_timedwait(&task->has_just_finished_cond, &parent_pool->lock, &timeout_spec)) {
-            pthread_mutex_unlock(&parent_pool->lock);
-            return TPOOL_ERR_TIMEOUT;
-        }
-    }
-
-    swap_tasks_in_pool(task, parent_pool->tasks[parent_pool->pushed_tasks_count - 1]);
-    parent_pool->pushed_tasks_count--;
-
-    task->parent_pool = NULL;
-    task->index_in_parent_pool = NONE;
-    task->assigned = false;
-
+    if (!wait_for_task_finish(task, timeout < max_timeout ? &timeout_spec : NULL))
+        return TPOOL_ERR_TIMEOUT;
     *result = task->result;
-    pthread_mutex_unlock(&parent_pool->lock);
+    release_finished_task(task);
 
     return SUCCESS;
 }
@@ -328,10 +769,19 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 
 
 int thread_task_delete(struct thread_task *task) {
-    if (task->parent_pool != NULL)
+    // A task waiting for dependencies is referenced by them
+    if (task_is_in_pool(atomic_load_explicit(&task->state, memory_order_relaxed)) ||
+        atomic_load(&task->pending_dependency_count) > 1)
         return TPOOL_ERR_TASK_IN_POOL;
 
-    pthread_cond_destroy(&task->has_just_finished_cond);
+    // The tasks waiting for the next finish of this one don't wait any more
+    struct task_link *successors = atomic_load(&task->successors);
+    while (successors != NULL && successors != &finished_successors) {
+        struct task_link *next = successors->next;
+        release_dependency(successors->task);
+        free(successors);
+        successors = next;
+    }
     free(task);
     return SUCCESS;
 }
@@ -340,18 +790,62 @@ int thread_task_delete(struct thread_task *task) {
 
 int
 thread_task_detach(struct thread_task *task) {
-    if (task->parent_pool == NULL)
+    int state = atomic_load_explicit(&task->state, memory_order_acquire);
+    if (!task_is_in_pool(state))
         return TPOOL_ERR_TASK_NOT_PUSHED;
-    struct thread_pool *parent_pool = task->parent_pool;
 
-    pthread_mutex_lock(&parent_pool->lock);
-    if (task->finished) {
-        thread_task_join_no_lock(task);
-        thread_task_delete(task);
-    } else {
-        task->scheduled_for_deletion = true;
+    while (task_stage(state) != TASK_FINISHED) {
+        // The worker deletes it then
+        if (atomic_compare_exchange_weak(&task->state, &state, state | TASK_IS_DETACHED))
+            return SUCCESS;
+    }
+    release_finished_task(task);
+    thread_task_delete(task);
+
+    return SUCCESS;
+}
+
+#endif
+
+#ifdef NEED_DEPENDENCIES
+
+int
+thread_task_depends_on(struct thread_task *task, struct thread_task *dependency) {
+    if (task == dependency)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (task_is_in_pool(atomic_load(&task->state)))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    struct task_link *link = malloc(sizeof(struct task_link));
+    link->task = task;
+    link->join_count = NULL;
+    // Before the link is seen, as the dependency can finish right away
+    atomic_fetch_add(&task->pending_dependency_count, 1);
+    if (!add_successor(dependency, link)) {
+        atomic_fetch_sub(&task->pending_dependency_count, 1);
+        free(link);
     }
-    pthread_mutex_unlock(&parent_pool->lock);
+
+    return SUCCESS;
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next) {
+    return thread_task_depends_on(next, task);
+}
+
+void *do_nothing(void *arg) {
+    return arg;
+}
+
+int
+thread_task_when_all(struct thread_task **task, struct thread_task **tasks, int count) {
+    if (count < 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    thread_task_new(task, do_nothing, NULL);
+    for (int i = 0; i < count; ++i)
+        thread_task_depends_on(*task, tasks[i]);
 
     return SUCCESS;
 }
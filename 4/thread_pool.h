@@ -12,11 +12,16 @@
  *
  *     #define NEED_TIMED_JOIN
  *
+ * To enable dependencies between tasks do:
+ *
+ *     #define NEED_DEPENDENCIES
+ *
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
 #define NEED_DETACH
 #define NEED_TIMED_JOIN
+#define NEED_DEPENDENCIES
 
 struct thread_pool;
 struct thread_task;
@@ -86,6 +91,25 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push all the @a tasks at once. Cheaper than pushing them one
+ * by one: the tasks are queued together and the pool wakes only
+ * as many sleeping threads as there are tasks to run.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Size of @a tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative @a count, or a
+ *       task is listed twice. None of them is pushed then.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has no room for all the
+ *       tasks. None of them is pushed then.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
 /** Thread pool task API. */
 
 /**
@@ -127,6 +151,24 @@ thread_task_is_running(const struct thread_task *task);
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Join all the @a tasks. The caller sleeps at most once, until
+ * the last of them is finished.
+ * @param tasks Tasks to join.
+ * @param count Size of @a tasks.
+ * @param[out] results Array of @a count results of @a tasks, or
+ *     NULL if they are not needed.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative @a count, or a
+ *       task is listed twice. None of them is joined then.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - one of the tasks is not pushed
+ *       to a pool. None of them is joined then.
+ */
+int
+thread_task_join_all(struct thread_task **tasks, int count, void **results);
+
 #ifdef NEED_TIMED_JOIN
 
 /**
@@ -153,7 +195,8 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result);
  * @retval 0 Success.
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_IN_POOL - can not drop the task. It still
- *       is in a pool. Need to join it firstly.
+ *       is in a pool. Need to join it firstly. Or it waits for
+ *       its dependencies.
  */
 int
 thread_task_delete(struct thread_task *task);
@@ -174,3 +217,50 @@ int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+#ifdef NEED_DEPENDENCIES
+
+/**
+ * Make @a task wait for @a dependency. Once pushed, @a task is
+ * run only after the next finish of @a dependency, or right away
+ * if @a dependency is finished and not joined yet. A task can
+ * have many dependencies and many dependent tasks, but they must
+ * not make a cycle. A task which waits for its dependencies can't
+ * be deleted. Deleting a dependency releases the tasks waiting
+ * for it, as if it finished.
+ * @param task Task to wait. Not pushed yet.
+ * @param dependency Task to wait for.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a task can't wait for itself.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a task is pushed already.
+ */
+int
+thread_task_depends_on(struct thread_task *task,
+		       struct thread_task *dependency);
+
+/**
+ * Run @a next after @a task. The same as
+ * thread_task_depends_on(next, task).
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Create a task which does nothing and depends on all the
+ * @a tasks. Push and join it to wait for all of them at once, or
+ * make other tasks depend on it.
+ * @param[out] task Pointer to store result task object.
+ * @param tasks Tasks to wait for.
+ * @param count Size of @a tasks.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - negative @a count.
+ */
+int
+thread_task_when_all(struct thread_task **task, struct thread_task **tasks,
+		     int count);
+
+#endif